@@ -0,0 +1,360 @@
+#include "callbacks.h"
+
+// This file provides a compact way to keep sounds in memory: IMA
+// ADPCM, which stores each 16-bit sample in 4 bits, and which is
+// cheap enough to decode inside the copying callback. A big sample
+// library takes about a quarter of the memory it would as raw
+// samples, and playing a sound doesn't copy it: the sound is shared,
+// and each playing copy just has a reader (see adpcmReader, below).
+
+// The sound is cut into blocks of ADPCM_BLOCK_FRAMES frames. Each
+// block starts with the first frame of each channel, stored exactly,
+// along with the encoder's step index at that point; so any block
+// can be decoded without the ones before it, and seeking or jumping
+// back to a loop start costs at most one block of decoding. The rest
+// of the block is one byte per frame: the left channel's code in the
+// low nibble and the right channel's in the high one.
+
+// ADPCM is lossy. Quiet passages come back almost exactly, but the
+// error grows with the size of the jumps between samples; expect
+// something like 30-40 dB of signal-to-noise on music.
+
+#define ADPCM_HEADER_BYTES (4 * CHANNELS)
+#define ADPCM_BLOCK_BYTES (ADPCM_HEADER_BYTES + ADPCM_BLOCK_FRAMES - 1)
+
+static const int indexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int stepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+struct adpcmSound{
+  // one reference for Racket, one for each reader.
+  int refs;
+  unsigned long frames;
+  unsigned long blocks;
+  // blocks * ADPCM_BLOCK_BYTES bytes, right after this struct.
+  unsigned char *data;
+};
+
+// the two blocks a reader decoded most recently. Two, because a
+// crossfade reads from both ends of a loop at once, and resampling
+// reads across block boundaries.
+#define READER_SLOTS 2
+
+struct adpcmReader{
+  adpcmSound *sound;
+  long block[READER_SLOTS];
+  // the slot to decode into next:
+  int victim;
+  short decoded[READER_SLOTS][ADPCM_BLOCK_FRAMES * CHANNELS];
+};
+
+// one channel's decoder (or encoder) state.
+typedef struct adpcmChannel{
+  int predictor;
+  int index;
+} adpcmChannel;
+
+static int clampIndex(int index){
+  return (index < 0) ? 0 : ((index > 88) ? 88 : index);
+}
+
+static int clampPredictor(int p){
+  return (p > 32767) ? 32767 : ((p < -32768) ? -32768 : p);
+}
+
+static short decodeNibble(adpcmChannel *c, int code){
+  int step = stepTable[c->index];
+  int diff = step >> 3;
+  if (code & 4) {
+    diff += step;
+  }
+  if (code & 2) {
+    diff += step >> 1;
+  }
+  if (code & 1) {
+    diff += step >> 2;
+  }
+  if (code & 8) {
+    c->predictor = clampPredictor(c->predictor - diff);
+  } else {
+    c->predictor = clampPredictor(c->predictor + diff);
+  }
+  c->index = clampIndex(c->index + indexTable[code]);
+  return (short)c->predictor;
+}
+
+// pick the code that gets closest to the sample, and update the
+// state exactly as the decoder will.
+static int encodeSample(adpcmChannel *c, int sample){
+  int step = stepTable[c->index];
+  int diff = sample - c->predictor;
+  int code = 0;
+  if (diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+  if (diff >= step) {
+    code |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step) {
+    code |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step) {
+    code |= 1;
+  }
+  decodeNibble(c,code);
+  return code;
+}
+
+static void writeHeader(unsigned char *p, const adpcmChannel *c){
+  unsigned short u = (unsigned short)(short)c->predictor;
+  p[0] = (unsigned char)(u & 0xff);
+  p[1] = (unsigned char)(u >> 8);
+  p[2] = (unsigned char)c->index;
+  p[3] = 0;
+}
+
+static void readHeader(const unsigned char *p, adpcmChannel *c){
+  c->predictor = (short)(unsigned short)(p[0] | (p[1] << 8));
+  c->index = clampIndex(p[2]);
+}
+
+// encode a whole sound; called only by Racket. Returns NULL if
+// there's no memory for it.
+adpcmSound *adpcmEncode(const short *samples, unsigned long frames){
+  unsigned long blocks = (frames + ADPCM_BLOCK_FRAMES - 1) / ADPCM_BLOCK_FRAMES;
+  adpcmSound *s = (adpcmSound *)arenaAlloc(sizeof(adpcmSound) + blocks * ADPCM_BLOCK_BYTES);
+  adpcmChannel state[CHANNELS];
+  unsigned char *p;
+  unsigned long b, f, frame;
+  int ch, code[CHANNELS], sample;
+  if (s == NULL) {
+    return NULL;
+  }
+  s->refs = 1;
+  s->frames = frames;
+  s->blocks = blocks;
+  s->data = (unsigned char *)(s + 1);
+  for (ch = 0; ch < CHANNELS; ch++) {
+    state[ch].index = 0;
+  }
+  for (b = 0; b < blocks; b++) {
+    p = s->data + b * ADPCM_BLOCK_BYTES;
+    frame = b * ADPCM_BLOCK_FRAMES;
+    // the first frame goes in the header as it is; the step index
+    // carries over from the last block, so the encoder doesn't have
+    // to adapt all over again.
+    for (ch = 0; ch < CHANNELS; ch++) {
+      state[ch].predictor = samples[frame * CHANNELS + ch];
+      writeHeader(p + 4 * ch,&state[ch]);
+    }
+    p += ADPCM_HEADER_BYTES;
+    for (f = 1; f < ADPCM_BLOCK_FRAMES; f++) {
+      for (ch = 0; ch < CHANNELS; ch++) {
+        // the last block is padded with silence:
+        sample = (frame + f < frames) ? samples[(frame + f) * CHANNELS + ch] : 0;
+        code[ch] = encodeSample(&state[ch],sample);
+      }
+      *p++ = (unsigned char)(code[0] | (code[1] << 4));
+    }
+  }
+  return s;
+}
+
+void adpcmSoundRelease(adpcmSound *s){
+  if (RS_ATOMIC_ADD(&s->refs,-1) == 1) {
+    arenaFree(s);
+  }
+}
+
+unsigned long adpcmSoundFrames(adpcmSound *s){
+  return s->frames;
+}
+
+// the number of bytes the encoded sound takes.
+unsigned long adpcmSoundBytes(adpcmSound *s){
+  return (unsigned long)(sizeof(adpcmSound) + s->blocks * ADPCM_BLOCK_BYTES);
+}
+
+// decode one whole block into 'out'.
+static void decodeBlock(const adpcmSound *s, unsigned long b, short *out){
+  const unsigned char *p = s->data + b * ADPCM_BLOCK_BYTES;
+  adpcmChannel left, right;
+  unsigned long f;
+  readHeader(p,&left);
+  readHeader(p + 4,&right);
+  out[0] = (short)left.predictor;
+  out[1] = (short)right.predictor;
+  p += ADPCM_HEADER_BYTES;
+  // the two channels don't depend on each other, so the compiler
+  // can interleave their work.
+  for (f = 1; f < ADPCM_BLOCK_FRAMES; f++) {
+    out[f * CHANNELS] = decodeNibble(&left,p[f - 1] & 0x0f);
+    out[f * CHANNELS + 1] = decodeNibble(&right,p[f - 1] >> 4);
+  }
+}
+
+// decode 'frames' frames starting at 'frame' into 'out', which must
+// have room for them; called only by Racket.
+void adpcmDecode(adpcmSound *s, unsigned long frame, unsigned long frames, short *out){
+  short block[ADPCM_BLOCK_FRAMES * CHANNELS];
+  unsigned long b, offset, n;
+  while (frames > 0) {
+    b = frame / ADPCM_BLOCK_FRAMES;
+    offset = frame % ADPCM_BLOCK_FRAMES;
+    n = MYMIN(frames, ADPCM_BLOCK_FRAMES - offset);
+    if (offset == 0 && n == ADPCM_BLOCK_FRAMES) {
+      decodeBlock(s,b,out);
+    } else {
+      decodeBlock(s,b,block);
+      memcpy(out,block + offset * CHANNELS,FRAMES_TO_BYTES(n));
+    }
+    out += n * CHANNELS;
+    frame += n;
+    frames -= n;
+  }
+}
+
+adpcmReader *adpcmReaderNew(adpcmSound *s){
+  adpcmReader *r = (adpcmReader *)arenaAlloc(sizeof(adpcmReader));
+  int i;
+  if (r == NULL) {
+    return NULL;
+  }
+  RS_ATOMIC_ADD(&s->refs,1);
+  r->sound = s;
+  for (i = 0; i < READER_SLOTS; i++) {
+    r->block[i] = -1;
+  }
+  r->victim = 0;
+  return r;
+}
+
+void adpcmReaderFree(adpcmReader *r){
+  adpcmSoundRelease(r->sound);
+  arenaFree(r);
+}
+
+// the decoded frames of block b, from the cache if they're there.
+static const short *readerBlock(adpcmReader *r, unsigned long b){
+  int slot;
+  for (slot = 0; slot < READER_SLOTS; slot++) {
+    if (r->block[slot] == (long)b) {
+      return r->decoded[slot];
+    }
+  }
+  slot = r->victim;
+  r->victim = (slot + 1) % READER_SLOTS;
+  decodeBlock(r->sound,b,r->decoded[slot]);
+  r->block[slot] = (long)b;
+  return r->decoded[slot];
+}
+
+// the callbacks' view of a packed sound: copy out 'frames' frames
+// starting at 'frame'. The caller keeps the range within the sound.
+void adpcmRead(adpcmReader *r, unsigned long frame, unsigned long frames, short *out){
+  unsigned long b, offset, n;
+  while (frames > 0) {
+    b = frame / ADPCM_BLOCK_FRAMES;
+    offset = frame % ADPCM_BLOCK_FRAMES;
+    n = MYMIN(frames, ADPCM_BLOCK_FRAMES - offset);
+    memcpy(out,readerBlock(r,b) + offset * CHANNELS,FRAMES_TO_BYTES(n));
+    out += n * CHANNELS;
+    frame += n;
+    frames -= n;
+  }
+}
+
+// one sample, for resampling.
+short adpcmSampleAt(adpcmReader *r, unsigned long frame, int channel){
+  return readerBlock(r,frame / ADPCM_BLOCK_FRAMES)
+    [(frame % ADPCM_BLOCK_FRAMES) * CHANNELS + channel];
+}
+
+// how fast are we? Each returns nanoseconds per frame, averaged
+// over the given number of passes over the whole sound.
+double adpcmEncodeBenchmark(const short *samples, unsigned long frames, int iterations){
+  double start = rsMonotonicSeconds();
+  double elapsed;
+  adpcmSound *s;
+  int i;
+  for (i = 0; i < iterations; i++) {
+    s = adpcmEncode(samples,frames);
+    if (s == NULL) {
+      return -1.0;
+    }
+    adpcmSoundRelease(s);
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  if (frames == 0 || iterations <= 0) {
+    return 0.0;
+  }
+  return elapsed * 1e9 / ((double)frames * iterations);
+}
+
+// this one decodes the way the callback does, a buffer at a time
+// through a reader.
+double adpcmDecodeBenchmark(adpcmSound *s, unsigned long bufferFrames, int iterations){
+  adpcmReader *r = adpcmReaderNew(s);
+  short *buf = (short *)arenaAlloc(FRAMES_TO_BYTES(bufferFrames));
+  double start, elapsed;
+  unsigned long frame, n;
+  int i;
+  if (r == NULL || buf == NULL || bufferFrames == 0) {
+    if (r != NULL) {
+      adpcmReaderFree(r);
+    }
+    arenaFree(buf);
+    return -1.0;
+  }
+  start = rsMonotonicSeconds();
+  for (i = 0; i < iterations; i++) {
+    for (frame = 0; frame < s->frames; frame += n) {
+      n = MYMIN(bufferFrames, s->frames - frame);
+      adpcmRead(r,frame,n,buf);
+    }
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  adpcmReaderFree(r);
+  arenaFree(buf);
+  if (s->frames == 0 || iterations <= 0) {
+    return 0.0;
+  }
+  return elapsed * 1e9 / ((double)s->frames * iterations);
+}
+
+// the copying callbacks read their sound through these, so they
+// don't have to care whether it's packed. Both expect frames
+// within the sound.
+void soundCopyFrames(soundCopyingInfo *ri, unsigned long frame, unsigned long frames,
+                     short *out){
+  if (ri->packed) {
+    adpcmRead(ri->packed,frame,frames,out);
+  } else {
+    memcpy(out,ri->sound + frame * CHANNELS,FRAMES_TO_BYTES(frames));
+  }
+}
+
+short soundSampleAt(soundCopyingInfo *ri, unsigned long frame, int channel){
+  if (ri->packed) {
+    return adpcmSampleAt(ri->packed,frame,channel);
+  }
+  return ri->sound[frame * CHANNELS + channel];
+}
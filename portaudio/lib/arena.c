@@ -0,0 +1,674 @@
+#include "callbacks.h"
+#include <stdint.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <sys/mman.h>
+# include <sched.h>
+# include <unistd.h>
+#endif
+
+// This file provides the allocator used for every buffer that the
+// callbacks touch: sounds, rings, and the info records themselves.
+// Plain malloc is a bad fit for that memory, for two reasons: the
+// pages it returns may not have been touched yet, so the audio thread
+// takes the page faults the first time it reads them; and they can
+// be paged out later on. Either way, the callback misses its deadline.
+
+// So instead, memory comes from large regions that are touched (and,
+// if the OS allows it, mlock'ed) when they're mapped. Small blocks are
+// carved from 4MB slabs and recycled through per-size-class free lists;
+// big ones get a region of their own, which is kept around for reuse
+// when it's freed. Regions (retired big ones, and slabs with nothing
+// left in them) are only returned to the OS by arenaTrim, which the
+// stream-control thread calls after each close (see control.c).
+
+// Freeing a block is safe on the audio thread (from the
+// stream-finished callback, say): it takes no lock and never calls
+// into the kernel. The block is pushed onto a lock-free list of
+// deferred frees, and whoever next takes the lock--an allocation, a
+// trim, or a look at the statistics, none of which happen on the
+// audio thread--puts it back where it belongs. To tell whether a
+// pointer is one of ours without the lock, arenaFree reads a table of
+// the regions that's replaced, rather than changed, by whoever maps
+// or unmaps one; see beginTableUpdate.
+
+// blocks of up to 2^ARENA_MAX_CLASS bytes come from slabs:
+#define ARENA_MIN_CLASS 4
+#define ARENA_MAX_CLASS 20
+#define ARENA_CLASSES (ARENA_MAX_CLASS - ARENA_MIN_CLASS + 1)
+#define ARENA_SLAB_BYTES (4 * 1024 * 1024)
+#define ARENA_LARGE_CLASS (-1)
+#define ARENA_MAGIC 0x52534e44
+// the magic of a block that's been freed:
+#define ARENA_FREED_MAGIC (ARENA_MAGIC ^ 1)
+// the most regions (slabs and large blocks) mapped at once. Running
+// out is counted in the statistics (regionTableFull), and the
+// allocation that needed the region fails.
+#define ARENA_MAX_REGIONS 4096
+// how many times a waiter spins before it starts yielding:
+#define ARENA_SPINS 100
+
+// every block is preceded by one of these; it's padded to 32 bytes,
+// which keeps payloads 16-byte aligned on every platform.
+typedef struct arenaHeader{
+  union {
+    struct {
+      // the free list (or the list of retired large regions):
+      struct arenaHeader *nextFree;
+      // large blocks only: the size of the whole region
+      size_t regionBytes;
+      int sizeClass;
+      int magic;
+    } f;
+    char pad[32];
+  } u;
+} arenaHeader;
+
+#define H_NEXT(h) ((h)->u.f.nextFree)
+#define H_REGION(h) ((h)->u.f.regionBytes)
+#define H_CLASS(h) ((h)->u.f.sizeClass)
+#define H_MAGIC(h) ((h)->u.f.magic)
+
+typedef struct arenaStats{
+  unsigned long long reservedBytes;
+  unsigned long long lockedBytes;
+  unsigned long long inUseBytes;
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long liveBlocks;
+  unsigned long slabs;
+  unsigned long largeBlocks;
+  unsigned long retiredLargeBlocks;
+  unsigned long lockFailures;
+  unsigned long foreignFrees;
+  unsigned long regionTableFull;
+  unsigned long classFree[ARENA_CLASSES];
+} arenaStats;
+
+// a region the arena has mapped: a slab, or a large block.
+typedef struct arenaRegion{
+  char *start;
+  size_t bytes;
+  int locked;
+  int slab;
+} arenaRegion;
+
+// the regions that are mapped, in address order.
+typedef struct arenaRegionTable{
+  arenaRegion regions[ARENA_MAX_REGIONS];
+  int count;
+} arenaRegionTable;
+
+// every slab starts with one of these; it's padded like a block
+// header, so the blocks after it stay aligned.
+typedef struct arenaSlab{
+  union {
+    struct {
+      // the blocks carved from it that haven't been freed:
+      unsigned long liveBlocks;
+      // arenaTrim only: set on the slabs it's returning, which are
+      // chained through nextDoomed
+      int doomed;
+      struct arenaSlab *nextDoomed;
+    } s;
+    char pad[32];
+  } u;
+} arenaSlab;
+
+static struct {
+  volatile int spin;
+  int lockMemory;
+  // the slab being carved up, and the part of it that hasn't been yet:
+  arenaSlab *slab;
+  char *slabNext;
+  char *slabEnd;
+  arenaHeader *freeLists[ARENA_CLASSES];
+  // freed large blocks, waiting for reuse or for arenaTrim:
+  arenaHeader *retired;
+  // blocks freed since the lock was last taken; pushed without it:
+  arenaHeader *deferred;
+  arenaStats stats;
+  // every region that's mapped, so that arenaFree can tell whether a
+  // pointer is one of ours before it reads the header in front of it.
+  // One table is current; the other is rewritten and made current by
+  // each change, and the generation goes up on both sides of that.
+  arenaRegionTable tables[2];
+  int current;
+  unsigned int tableGeneration;
+} arena = { .lockMemory = 1 };
+
+// a spinlock, rather than a mutex, because the critical sections
+// are a handful of instructions. It's never taken on the audio
+// thread. A waiter spins with a pause for a while, then gives up its
+// time slice each time around, so that it can't starve a holder on
+// the same core.
+#ifdef _MSC_VER
+# define ARENA_TRY_LOCK() (InterlockedExchange((volatile LONG *)&arena.spin, 1) == 0)
+# define ARENA_HELD() (arena.spin != 0)
+# define ARENA_UNLOCK() InterlockedExchange((volatile LONG *)&arena.spin, 0)
+#else
+# define ARENA_TRY_LOCK() (__atomic_exchange_n(&arena.spin, 1, __ATOMIC_ACQUIRE) == 0)
+# define ARENA_HELD() (__atomic_load_n(&arena.spin, __ATOMIC_RELAXED) != 0)
+# define ARENA_UNLOCK() __atomic_store_n(&arena.spin, 0, __ATOMIC_RELEASE)
+#endif
+#define ARENA_LOCK() arenaLock()
+
+static void reclaimDeferred(void);
+
+static void cpuPause(void){
+#if defined(_MSC_VER)
+  YieldProcessor();
+#elif defined(__SSE2__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static void yieldThread(void){
+#ifdef WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+// take the lock, and put back whatever's been freed since it was
+// last taken, so that the holder sees every block where it belongs.
+static void arenaLock(void){
+  int spins = 0;
+  while (!ARENA_TRY_LOCK()) {
+    // wait until it looks free before trying again:
+    while (ARENA_HELD()) {
+      if (spins < ARENA_SPINS) {
+        spins++;
+        cpuPause();
+      } else {
+        yieldThread();
+      }
+    }
+  }
+  reclaimDeferred();
+}
+
+// add a freed block to the deferred list. Lock-free: the loop only
+// goes around again if another free got in first.
+static void pushDeferred(arenaHeader *h){
+#ifdef _MSC_VER
+  arenaHeader *head;
+  do {
+    head = arena.deferred;
+    H_NEXT(h) = head;
+  } while (InterlockedCompareExchangePointer((PVOID volatile *)&arena.deferred,
+                                             h, head) != head);
+#else
+  arenaHeader *head = __atomic_load_n(&arena.deferred, __ATOMIC_RELAXED);
+  do {
+    H_NEXT(h) = head;
+  } while (!__atomic_compare_exchange_n(&arena.deferred, &head, h, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+// take the whole deferred list at once.
+static arenaHeader *takeDeferred(void){
+#ifdef _MSC_VER
+  return (arenaHeader *)InterlockedExchangePointer((PVOID volatile *)&arena.deferred, NULL);
+#else
+  return __atomic_exchange_n(&arena.deferred, NULL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static size_t pageBytes(void){
+#ifdef WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// map a fresh region, touch every page of it, and try to lock
+// it into memory. Returns NULL on failure. Never called with
+// the spinlock held.
+static char *mapRegion(size_t bytes, int *locked){
+  char *region;
+  size_t page = pageBytes();
+  size_t i;
+#ifdef WIN32
+  region = (char *)VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (region == NULL) {
+    return NULL;
+  }
+#else
+  region = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (region == (char *)MAP_FAILED) {
+    return NULL;
+  }
+#endif
+  // pre-fault: the audio thread should never be the first to touch a page.
+  for (i = 0; i < bytes; i += page) {
+    region[i] = 0;
+  }
+  *locked = 0;
+  if (arena.lockMemory) {
+#ifdef WIN32
+    *locked = VirtualLock(region, bytes) ? 1 : 0;
+#else
+    *locked = (mlock(region, bytes) == 0) ? 1 : 0;
+#endif
+  }
+  return region;
+}
+
+static void unmapRegion(char *region, size_t bytes){
+#ifdef WIN32
+  VirtualFree(region, 0, MEM_RELEASE);
+#else
+  munmap(region, bytes);
+#endif
+}
+
+// the smallest class that holds the given number of payload bytes
+static int sizeClassFor(size_t bytes){
+  int c = ARENA_MIN_CLASS;
+  while (((size_t)1 << c) < bytes) {
+    c++;
+  }
+  return c;
+}
+
+static size_t roundUp(size_t n, size_t to){
+  return ((n + to - 1) / to) * to;
+}
+
+// the region of the given table that holds all of the given bytes,
+// or NULL if none of them does.
+static arenaRegion *findRegion(arenaRegionTable *t, uintptr_t addr, size_t bytes){
+  int lo = 0;
+  int hi = t->count;
+  int mid;
+  arenaRegion *r;
+  // find the first region that starts after addr:
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if ((uintptr_t)t->regions[mid].start <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return NULL;
+  }
+  r = &t->regions[lo - 1];
+  if (addr - (uintptr_t)r->start > r->bytes - bytes) {
+    return NULL;
+  }
+  return r;
+}
+
+// the current table. Assumes the lock is held.
+static arenaRegionTable *currentTable(void){
+  return &arena.tables[arena.current];
+}
+
+// start replacing the current table: returns the other one, holding
+// a copy of the current one, to be changed and passed to
+// endTableUpdate. Anyone still reading the other table (from two
+// changes ago) sees the generation move, and looks again. Assumes
+// the lock is held.
+static arenaRegionTable *beginTableUpdate(void){
+  arenaRegionTable *from = currentTable();
+  arenaRegionTable *to = &arena.tables[1 - arena.current];
+  RS_ATOMIC_ADD(&arena.tableGeneration, 1);
+  RS_FENCE();
+  memcpy(to->regions, from->regions, from->count * sizeof(arenaRegion));
+  to->count = from->count;
+  return to;
+}
+
+static void endTableUpdate(arenaRegionTable *to){
+  RS_ATOMIC_STORE(&arena.current, (int)(to - arena.tables));
+  RS_ATOMIC_ADD(&arena.tableGeneration, 1);
+}
+
+// do the given bytes lie in a region that's mapped? Safe without the
+// lock: it looks again if the table it read was being rewritten.
+// That only happens if two changes finish while it's looking, which
+// can't be held up by a thread that's stopped halfway through one.
+static int ownsBytes(uintptr_t addr, size_t bytes){
+  unsigned int generation;
+  int found;
+  do {
+    generation = RS_ATOMIC_LOAD(&arena.tableGeneration);
+    found = findRegion(&arena.tables[RS_ATOMIC_LOAD(&arena.current)],
+                       addr, bytes) != NULL;
+    RS_FENCE();
+  } while (RS_ATOMIC_LOAD(&arena.tableGeneration) != generation);
+  return found;
+}
+
+// record a newly mapped region. Returns 0, having recorded nothing,
+// if the table is full. Assumes the lock is held.
+static int noteRegion(char *region, size_t bytes, int locked, int slab){
+  arenaRegionTable *t;
+  int i;
+  if (currentTable()->count == ARENA_MAX_REGIONS) {
+    arena.stats.regionTableFull += 1;
+    return 0;
+  }
+  t = beginTableUpdate();
+  // keep them in address order:
+  i = t->count;
+  while (i > 0 && (uintptr_t)t->regions[i - 1].start > (uintptr_t)region) {
+    t->regions[i] = t->regions[i - 1];
+    i--;
+  }
+  t->regions[i].start = region;
+  t->regions[i].bytes = bytes;
+  t->regions[i].locked = locked;
+  t->regions[i].slab = slab;
+  t->count += 1;
+  endTableUpdate(t);
+  arena.stats.reservedBytes += bytes;
+  if (locked) {
+    arena.stats.lockedBytes += bytes;
+  } else if (arena.lockMemory) {
+    arena.stats.lockFailures += 1;
+  }
+  return 1;
+}
+
+// forget a region that's about to be unmapped, and its bytes.
+// Assumes the lock is held.
+static void forgetRegion(char *region){
+  arenaRegion *r = findRegion(currentTable(), (uintptr_t)region, 1);
+  arenaRegionTable *t;
+  int i;
+  if (r == NULL) {
+    return;
+  }
+  arena.stats.reservedBytes -= r->bytes;
+  if (r->locked) {
+    arena.stats.lockedBytes -= r->bytes;
+  }
+  i = (int)(r - currentTable()->regions);
+  t = beginTableUpdate();
+  t->count -= 1;
+  for (; i < t->count; i++) {
+    t->regions[i] = t->regions[i + 1];
+  }
+  endTableUpdate(t);
+}
+
+// the slab that a small block was carved from. Assumes the lock is
+// held.
+static arenaSlab *slabOf(arenaHeader *h){
+  return (arenaSlab *)findRegion(currentTable(), (uintptr_t)h, sizeof(arenaHeader))->start;
+}
+
+// put the blocks on the deferred list where they belong. Assumes
+// the lock is held.
+static void reclaimDeferred(void){
+  arenaHeader *h = takeDeferred();
+  arenaHeader *next;
+  int c;
+  for (; h != NULL; h = next) {
+    next = H_NEXT(h);
+    c = H_CLASS(h);
+    arena.stats.frees += 1;
+    arena.stats.liveBlocks -= 1;
+    if (c == ARENA_LARGE_CLASS) {
+      arena.stats.inUseBytes -= H_REGION(h) - sizeof(arenaHeader);
+      arena.stats.largeBlocks -= 1;
+      arena.stats.retiredLargeBlocks += 1;
+      H_NEXT(h) = arena.retired;
+      arena.retired = h;
+    } else {
+      arena.stats.inUseBytes -= (size_t)1 << c;
+      arena.stats.classFree[c - ARENA_MIN_CLASS] += 1;
+      slabOf(h)->u.s.liveBlocks -= 1;
+      H_NEXT(h) = arena.freeLists[c - ARENA_MIN_CLASS];
+      arena.freeLists[c - ARENA_MIN_CLASS] = h;
+    }
+  }
+}
+
+static void *allocSmall(size_t bytes){
+  int c = sizeClassFor(bytes);
+  size_t blockBytes = sizeof(arenaHeader) + ((size_t)1 << c);
+  arenaHeader *h;
+  char *slab;
+  int locked;
+
+  ARENA_LOCK();
+  h = arena.freeLists[c - ARENA_MIN_CLASS];
+  if (h != NULL) {
+    arena.freeLists[c - ARENA_MIN_CLASS] = H_NEXT(h);
+    arena.stats.classFree[c - ARENA_MIN_CLASS] -= 1;
+    slabOf(h)->u.s.liveBlocks += 1;
+  } else {
+    if (arena.slabNext == NULL || (size_t)(arena.slabEnd - arena.slabNext) < blockBytes) {
+      // the rest of the current slab is abandoned; at most 1MB.
+      ARENA_UNLOCK();
+      slab = mapRegion(ARENA_SLAB_BYTES, &locked);
+      if (slab == NULL) {
+        return NULL;
+      }
+      ARENA_LOCK();
+      if (!noteRegion(slab, ARENA_SLAB_BYTES, locked, 1)) {
+        ARENA_UNLOCK();
+        unmapRegion(slab, ARENA_SLAB_BYTES);
+        return NULL;
+      }
+      arena.stats.slabs += 1;
+      arena.slab = (arenaSlab *)slab;
+      arena.slabNext = slab + sizeof(arenaSlab);
+      arena.slabEnd = slab + ARENA_SLAB_BYTES;
+    }
+    h = (arenaHeader *)arena.slabNext;
+    arena.slabNext += blockBytes;
+    arena.slab->u.s.liveBlocks += 1;
+  }
+  H_CLASS(h) = c;
+  H_MAGIC(h) = ARENA_MAGIC;
+  arena.stats.inUseBytes += (size_t)1 << c;
+  arena.stats.allocs += 1;
+  arena.stats.liveBlocks += 1;
+  ARENA_UNLOCK();
+  return (void *)(h + 1);
+}
+
+// take a retired region off the list if one fits without wasting
+// more than half of it. Assumes the lock is held.
+static arenaHeader *reuseRetired(size_t regionBytes){
+  arenaHeader **prev;
+  arenaHeader *h;
+  for (prev = &arena.retired; *prev != NULL; prev = &H_NEXT(*prev)) {
+    h = *prev;
+    if (H_REGION(h) >= regionBytes && H_REGION(h) / 2 <= regionBytes) {
+      *prev = H_NEXT(h);
+      arena.stats.retiredLargeBlocks -= 1;
+      return h;
+    }
+  }
+  return NULL;
+}
+
+static void *allocLarge(size_t bytes){
+  size_t regionBytes = roundUp(sizeof(arenaHeader) + bytes, pageBytes());
+  arenaHeader *h;
+  int locked;
+
+  ARENA_LOCK();
+  h = reuseRetired(regionBytes);
+  if (h == NULL) {
+    ARENA_UNLOCK();
+    h = (arenaHeader *)mapRegion(regionBytes, &locked);
+    if (h == NULL) {
+      return NULL;
+    }
+    ARENA_LOCK();
+    if (!noteRegion((char *)h, regionBytes, locked, 0)) {
+      ARENA_UNLOCK();
+      unmapRegion((char *)h, regionBytes);
+      return NULL;
+    }
+    H_REGION(h) = regionBytes;
+  }
+  H_CLASS(h) = ARENA_LARGE_CLASS;
+  H_MAGIC(h) = ARENA_MAGIC;
+  arena.stats.inUseBytes += H_REGION(h) - sizeof(arenaHeader);
+  arena.stats.allocs += 1;
+  arena.stats.liveBlocks += 1;
+  arena.stats.largeBlocks += 1;
+  ARENA_UNLOCK();
+  return (void *)(h + 1);
+}
+
+// allocate a block of (at least) the given size. Like malloc, the
+// contents are unspecified. Returns NULL on failure. May call into
+// the kernel when it has to grow, so call it from Racket's thread
+// (or a native worker), not from a callback.
+void *arenaAlloc(size_t bytes){
+  if (bytes == 0) {
+    bytes = 1;
+  }
+  if (bytes <= ((size_t)1 << ARENA_MAX_CLASS)) {
+    return allocSmall(bytes);
+  } else {
+    return allocLarge(bytes);
+  }
+}
+
+// like arenaAlloc, but the block is zeroed.
+void *arenaCalloc(size_t bytes){
+  void *p = arenaAlloc(bytes);
+  if (p != NULL) {
+    memset(p, 0, bytes);
+  }
+  return p;
+}
+
+// return a block to the arena. Takes no lock and never calls into
+// the kernel, so this is safe on the audio thread. Ignores NULL, and
+// counts (but otherwise ignores) pointers that didn't come from the
+// arena; it doesn't read in front of those unless it's memory the
+// arena mapped.
+void arenaFree(void *p){
+  arenaHeader *h;
+  uintptr_t addr = (uintptr_t)p;
+  if (p == NULL) {
+    return;
+  }
+  h = ((arenaHeader *)p) - 1;
+  if (addr % 16 != 0
+      || addr < sizeof(arenaHeader)
+      || !ownsBytes(addr - sizeof(arenaHeader), sizeof(arenaHeader))
+      // a second free of the same block is counted as a foreign one:
+      || !RS_ATOMIC_CAS(&H_MAGIC(h), ARENA_MAGIC, ARENA_FREED_MAGIC)) {
+    RS_ATOMIC_ADD(&arena.stats.foreignFrees, 1);
+    return;
+  }
+  pushDeferred(h);
+}
+
+// take the free blocks of the doomed slabs off the free lists.
+// Assumes the lock is held.
+static void unlistDoomedBlocks(void){
+  arenaHeader **prev;
+  int c;
+  for (c = 0; c < ARENA_CLASSES; c++) {
+    prev = &arena.freeLists[c];
+    while (*prev != NULL) {
+      if (slabOf(*prev)->u.s.doomed) {
+        *prev = H_NEXT(*prev);
+        arena.stats.classFree[c] -= 1;
+      } else {
+        prev = &H_NEXT(*prev);
+      }
+    }
+  }
+}
+
+// give retired large regions and empty slabs back to the OS, keeping
+// up to keepBytes of them in all for reuse: the most recently retired
+// large regions first, then slabs. Calls into the kernel, so it's
+// never called on the audio thread.
+void arenaTrim(size_t keepBytes){
+  arenaHeader *h;
+  arenaHeader *next;
+  arenaHeader **prev;
+  arenaRegionTable *t;
+  arenaSlab *doomed = NULL;
+  arenaSlab *slab;
+  size_t kept = 0;
+  int i;
+
+  ARENA_LOCK();
+  // detach the large regions past the ones we're keeping:
+  prev = &arena.retired;
+  while (*prev != NULL && kept + H_REGION(*prev) <= keepBytes) {
+    kept += H_REGION(*prev);
+    prev = &H_NEXT(*prev);
+  }
+  h = *prev;
+  *prev = NULL;
+  for (next = h; next != NULL; next = H_NEXT(next)) {
+    arena.stats.retiredLargeBlocks -= 1;
+    forgetRegion((char *)next);
+  }
+  // and the empty slabs past the ones we're keeping, except the one
+  // we're carving up:
+  t = currentTable();
+  for (i = 0; i < t->count; i++) {
+    slab = (arenaSlab *)t->regions[i].start;
+    if (t->regions[i].slab && slab != arena.slab && slab->u.s.liveBlocks == 0) {
+      if (kept + t->regions[i].bytes <= keepBytes) {
+        kept += t->regions[i].bytes;
+      } else {
+        slab->u.s.doomed = 1;
+        slab->u.s.nextDoomed = doomed;
+        doomed = slab;
+      }
+    }
+  }
+  if (doomed != NULL) {
+    unlistDoomedBlocks();
+    for (slab = doomed; slab != NULL; slab = slab->u.s.nextDoomed) {
+      arena.stats.slabs -= 1;
+      forgetRegion((char *)slab);
+    }
+  }
+  ARENA_UNLOCK();
+  while (h != NULL) {
+    next = H_NEXT(h);
+    unmapRegion((char *)h, H_REGION(h));
+    h = next;
+  }
+  while (doomed != NULL) {
+    slab = doomed->u.s.nextDoomed;
+    unmapRegion((char *)doomed, ARENA_SLAB_BYTES);
+    doomed = slab;
+  }
+}
+
+// should newly mapped regions be mlock'ed? On by default; turn it
+// off where the memlock limit is too small to be worth trying.
+void arenaSetLocking(int lockMemory){
+  arena.lockMemory = lockMemory;
+}
+
+void arenaGetStats(arenaStats *out){
+  ARENA_LOCK();
+  *out = arena.stats;
+  ARENA_UNLOCK();
+}
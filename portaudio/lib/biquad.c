@@ -0,0 +1,340 @@
+#include "callbacks.h"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+// This file provides a cascade of biquad filters (an EQ, say, or
+// a high-pass plus a couple of shelves) that the copying and
+// streaming callbacks can run over their output, so that a fixed
+// EQ doesn't have to be applied to every sound in Racket.
+
+// There are two pieces. A filterChain holds the coefficients;
+// Racket owns it and can change them at any time, and any number
+// of playing sounds can share it. A filterState holds the part
+// that belongs to one playing sound: the filter memory, and the
+// coefficients that sound is using right now. When Racket changes
+// the chain, each sound notices on its next buffer and glides
+// from its old coefficients to the new ones over FILTER_RAMP_FRAMES
+// frames, so a change doesn't click.
+
+// Racket publishes coefficients the same way ramp.c publishes
+// ramps: 'generation' is odd while Racket is writing, and a
+// callback only takes coefficients that it saw the same even
+// generation on both before and after copying them.
+
+// Sections are Direct Form II Transposed, in double precision,
+// with both channels of a frame going through one SSE2 register.
+// Audio that decays to nothing would eventually leave denormals
+// in the filter memory, which are extremely slow on x86; we turn
+// on flush-to-zero while filtering, and flush tiny state values to
+// zero between blocks on every platform.
+
+#define FILTER_MAX_SECTIONS 16
+#define FILTER_BLOCK 256
+#define FILTER_RAMP_FRAMES 256
+// during a glide, the coefficients are updated this often:
+#define FILTER_RAMP_STEP 16
+#define FILTER_TINY 1e-30
+
+typedef struct biquadCoeffs{
+  double b0, b1, b2, a1, a2;
+} biquadCoeffs;
+
+typedef struct filterChain{
+  // one reference for Racket, one for each filterState.
+  int refs;
+  unsigned int generation;
+  int sections;
+  biquadCoeffs coeffs[FILTER_MAX_SECTIONS];
+} filterChain;
+
+struct filterState{
+  filterChain *chain;
+  // only touched by the callback, once the sound is playing:
+  unsigned int seenGeneration;
+  int sections;
+  // the number of sections once the glide is over
+  int targetSections;
+  unsigned long rampPos;
+  biquadCoeffs from[FILTER_MAX_SECTIONS];
+  biquadCoeffs to[FILTER_MAX_SECTIONS];
+  biquadCoeffs cur[FILTER_MAX_SECTIONS];
+  // filter memory; two channels, interleaved
+  double z1[FILTER_MAX_SECTIONS][CHANNELS];
+  double z2[FILTER_MAX_SECTIONS][CHANNELS];
+};
+
+static const biquadCoeffs identity = {1.0, 0.0, 0.0, 0.0, 0.0};
+
+filterChain *filterChainNew(void){
+  filterChain *fc = (filterChain *)arenaCalloc(sizeof(filterChain));
+  if (fc == NULL) {
+    return NULL;
+  }
+  fc->refs = 1;
+  return fc;
+}
+
+void filterChainRelease(filterChain *fc){
+  if (RS_ATOMIC_ADD(&fc->refs,-1) == 1) {
+    arenaFree(fc);
+  }
+}
+
+// called only by Racket. 'coeffs' holds five doubles per section,
+// b0 b1 b2 a1 a2, normalized so that a0 is 1. Returns -1 if there
+// are too many sections.
+int filterChainSet(filterChain *fc, int sections, const double *coeffs){
+  unsigned int gen = fc->generation;
+  int i;
+  if (sections < 0 || FILTER_MAX_SECTIONS < sections) {
+    return -1;
+  }
+  RS_ATOMIC_STORE(&fc->generation,gen+1);
+  RS_FENCE();
+  fc->sections = sections;
+  for (i = 0; i < sections; i++) {
+    fc->coeffs[i].b0 = coeffs[5*i];
+    fc->coeffs[i].b1 = coeffs[5*i+1];
+    fc->coeffs[i].b2 = coeffs[5*i+2];
+    fc->coeffs[i].a1 = coeffs[5*i+3];
+    fc->coeffs[i].a2 = coeffs[5*i+4];
+  }
+  RS_ATOMIC_STORE(&fc->generation,gen+2);
+  return 0;
+}
+
+int filterChainMaxSections(void){
+  return FILTER_MAX_SECTIONS;
+}
+
+// copy the chain's coefficients into 'to', if Racket isn't in
+// the middle of changing them. Returns the number of sections,
+// or -1 if there's nothing new (or nothing consistent) to take.
+// They're copied aside first, and only into 'to' once the second
+// look at the generation says they're whole: 'to' may be the end
+// of a glide that's still running.
+static int readChain(filterState *fs, unsigned int *genOut){
+  filterChain *fc = fs->chain;
+  unsigned int before = RS_ATOMIC_LOAD(&fc->generation);
+  biquadCoeffs next[FILTER_MAX_SECTIONS];
+  int sections, i;
+  if (before == fs->seenGeneration || (before & 1)) {
+    return -1;
+  }
+  sections = fc->sections;
+  if (sections < 0 || FILTER_MAX_SECTIONS < sections) {
+    return -1;
+  }
+  for (i = 0; i < sections; i++) {
+    next[i] = fc->coeffs[i];
+  }
+  RS_FENCE();
+  if (RS_ATOMIC_LOAD(&fc->generation) != before) {
+    return -1;
+  }
+  for (i = 0; i < sections; i++) {
+    fs->to[i] = next[i];
+  }
+  for (i = sections; i < FILTER_MAX_SECTIONS; i++) {
+    fs->to[i] = identity;
+  }
+  *genOut = before;
+  return sections;
+}
+
+// make the state for one playing sound. It starts out with the
+// chain's current coefficients, without a glide. Returns NULL if
+// there's no memory.
+filterState *filterStateNew(filterChain *fc){
+  filterState *fs = (filterState *)arenaCalloc(sizeof(filterState));
+  unsigned int gen;
+  int sections, i;
+  if (fs == NULL) {
+    return NULL;
+  }
+  RS_ATOMIC_ADD(&fc->refs,1);
+  fs->chain = fc;
+  // Racket is the only writer, and it's the one calling us, so
+  // this can't fail unless the chain has never been set:
+  fs->seenGeneration = 0;
+  sections = readChain(fs,&gen);
+  if (sections < 0) {
+    sections = 0;
+    gen = 0;
+    for (i = 0; i < FILTER_MAX_SECTIONS; i++) {
+      fs->to[i] = identity;
+    }
+  }
+  fs->seenGeneration = gen;
+  fs->sections = sections;
+  fs->targetSections = sections;
+  fs->rampPos = FILTER_RAMP_FRAMES;
+  for (i = 0; i < FILTER_MAX_SECTIONS; i++) {
+    fs->from[i] = fs->to[i];
+    fs->cur[i] = fs->to[i];
+  }
+  return fs;
+}
+
+void filterStateFree(filterState *fs){
+  filterChainRelease(fs->chain);
+  arenaFree(fs);
+}
+
+// start gliding to new coefficients, if Racket has set some.
+static void pollChain(filterState *fs){
+  unsigned int gen;
+  int sections = readChain(fs,&gen);
+  int i;
+  if (sections < 0) {
+    return;
+  }
+  fs->seenGeneration = gen;
+  for (i = 0; i < FILTER_MAX_SECTIONS; i++) {
+    fs->from[i] = fs->cur[i];
+  }
+  // sections that are going away glide to identity before they
+  // stop running:
+  fs->sections = MYMAX(fs->sections,sections);
+  fs->targetSections = sections;
+  fs->rampPos = 0;
+}
+
+static void interpolateCoeffs(filterState *fs){
+  double t = (double)fs->rampPos / FILTER_RAMP_FRAMES;
+  int i;
+  for (i = 0; i < fs->sections; i++) {
+    fs->cur[i].b0 = fs->from[i].b0 + t * (fs->to[i].b0 - fs->from[i].b0);
+    fs->cur[i].b1 = fs->from[i].b1 + t * (fs->to[i].b1 - fs->from[i].b1);
+    fs->cur[i].b2 = fs->from[i].b2 + t * (fs->to[i].b2 - fs->from[i].b2);
+    fs->cur[i].a1 = fs->from[i].a1 + t * (fs->to[i].a1 - fs->from[i].a1);
+    fs->cur[i].a2 = fs->from[i].a2 + t * (fs->to[i].a2 - fs->from[i].a2);
+  }
+}
+
+// run one section over 'frames' interleaved stereo frames, in place.
+static void runSection(const biquadCoeffs *c, double *z1, double *z2,
+                       double *buf, unsigned long frames){
+  unsigned long i;
+#ifdef __SSE2__
+  __m128d b0 = _mm_set1_pd(c->b0);
+  __m128d b1 = _mm_set1_pd(c->b1);
+  __m128d b2 = _mm_set1_pd(c->b2);
+  __m128d a1 = _mm_set1_pd(c->a1);
+  __m128d a2 = _mm_set1_pd(c->a2);
+  __m128d s1 = _mm_loadu_pd(z1);
+  __m128d s2 = _mm_loadu_pd(z2);
+  __m128d x, y;
+  for (i = 0; i < frames; i++) {
+    x = _mm_loadu_pd(buf + i * CHANNELS);
+    y = _mm_add_pd(_mm_mul_pd(b0,x),s1);
+    s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1,x),_mm_mul_pd(a1,y)),s2);
+    s2 = _mm_sub_pd(_mm_mul_pd(b2,x),_mm_mul_pd(a2,y));
+    _mm_storeu_pd(buf + i * CHANNELS,y);
+  }
+  _mm_storeu_pd(z1,s1);
+  _mm_storeu_pd(z2,s2);
+#else
+  double x, y;
+  int ch;
+  for (ch = 0; ch < CHANNELS; ch++) {
+    double s1 = z1[ch];
+    double s2 = z2[ch];
+    for (i = 0; i < frames; i++) {
+      x = buf[i * CHANNELS + ch];
+      y = c->b0 * x + s1;
+      s1 = c->b1 * x - c->a1 * y + s2;
+      s2 = c->b2 * x - c->a2 * y;
+      buf[i * CHANNELS + ch] = y;
+    }
+    z1[ch] = s1;
+    z2[ch] = s2;
+  }
+#endif
+}
+
+static void flushTinyState(filterState *fs){
+  int i, ch;
+  for (i = 0; i < fs->sections; i++) {
+    for (ch = 0; ch < CHANNELS; ch++) {
+      if (-FILTER_TINY < fs->z1[i][ch] && fs->z1[i][ch] < FILTER_TINY) {
+        fs->z1[i][ch] = 0.0;
+      }
+      if (-FILTER_TINY < fs->z2[i][ch] && fs->z2[i][ch] < FILTER_TINY) {
+        fs->z2[i][ch] = 0.0;
+      }
+    }
+  }
+}
+
+// filter 'frames' frames of interleaved stereo in place. Called
+// only by the callback that owns the state.
+void filterStateProcess(filterState *fs, short *samples, unsigned long frames){
+  double buf[FILTER_BLOCK * CHANNELS];
+  unsigned long done = 0;
+  unsigned long block, i;
+  int s;
+#ifdef __SSE2__
+  unsigned int savedCsr = _mm_getcsr();
+  // flush-to-zero and denormals-are-zero
+  _mm_setcsr(savedCsr | 0x8040);
+#endif
+
+  pollChain(fs);
+  while (done < frames) {
+    block = MYMIN(frames - done, FILTER_BLOCK);
+    if (fs->rampPos < FILTER_RAMP_FRAMES) {
+      block = MYMIN(block, FILTER_RAMP_STEP);
+      interpolateCoeffs(fs);
+    }
+    for (i = 0; i < block * CHANNELS; i++) {
+      buf[i] = samples[done * CHANNELS + i];
+    }
+    for (s = 0; s < fs->sections; s++) {
+      runSection(&fs->cur[s],fs->z1[s],fs->z2[s],buf,block);
+    }
+    for (i = 0; i < block * CHANNELS; i++) {
+      samples[done * CHANNELS + i] = rsToSample(buf[i]);
+    }
+    flushTinyState(fs);
+    if (fs->rampPos < FILTER_RAMP_FRAMES) {
+      fs->rampPos += block;
+      if (fs->rampPos >= FILTER_RAMP_FRAMES) {
+        // the glide is over: land exactly on the new coefficients,
+        // and stop running the sections that were removed.
+        fs->rampPos = FILTER_RAMP_FRAMES;
+        for (s = 0; s < FILTER_MAX_SECTIONS; s++) {
+          fs->cur[s] = fs->to[s];
+        }
+        for (s = fs->targetSections; s < fs->sections; s++) {
+          fs->z1[s][0] = fs->z1[s][1] = 0.0;
+          fs->z2[s][0] = fs->z2[s][1] = 0.0;
+        }
+        fs->sections = fs->targetSections;
+      }
+    }
+    done += block;
+  }
+
+#ifdef __SSE2__
+  _mm_setcsr(savedCsr);
+#endif
+}
+
+// for benchmarks: filter the given buffer 'iterations' times and
+// return the average number of nanoseconds per frame per section.
+double filterStateBenchmark(filterState *fs, short *samples, unsigned long frames,
+                            int iterations){
+  double start = rsMonotonicSeconds();
+  double elapsed;
+  int i;
+  for (i = 0; i < iterations; i++) {
+    filterStateProcess(fs,samples,frames);
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  if (fs->sections == 0 || frames == 0 || iterations <= 0) {
+    return 0.0;
+  }
+  return elapsed * 1e9 / ((double)frames * iterations * fs->sections);
+}
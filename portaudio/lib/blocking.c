@@ -0,0 +1,361 @@
+#include "callbacks.h"
+
+// This file provides a blocking-mode alternative to the
+// callbacks: a native thread that owns a stream opened
+// without a callback, and that moves data between the stream
+// and a queue of buffers using Pa_WriteStream or Pa_ReadStream.
+// Racket only ever touches the queue, so Racket never blocks
+// in portaudio.
+
+// For output, Racket enqueues copies of its buffers and the
+// thread writes them out in chunks sized by
+// Pa_GetStreamWriteAvailable. For input, the thread reads
+// chunks into freshly allocated buffers and queues them up
+// for Racket to take.
+
+#define BLOCKING_OUTPUT 0
+#define BLOCKING_INPUT 1
+
+typedef struct blockingChunk{
+  struct blockingChunk *next;
+  short *samples;
+  unsigned long frames;
+  // frames of this chunk already written (output) or taken (input)
+  unsigned long offset;
+} blockingChunk;
+
+typedef struct blockingIoStats{
+  unsigned long framesTransferred;
+  unsigned long queuedFrames;
+  unsigned long underflows;
+  unsigned long overflows;
+  unsigned long droppedFrames;
+  int lastError;
+} blockingIoStats;
+
+typedef struct blockingIo{
+  PaStream *stream;
+  int direction;
+  // the most we'll hand to portaudio in a single call
+  unsigned long chunkFrames;
+  // input only: the most we'll hold before dropping old data
+  unsigned long maxQueuedFrames;
+  // output only: write silence while the queue is empty
+  int padWithSilence;
+  short *silence;
+
+  rsMutex lock;
+  rsCond cond;
+  rsThread thread;
+  int threadStarted;
+  int stopRequested;
+  // set by the thread when it exits, so Racket can tell
+  // that the stream has died:
+  int finished;
+
+  blockingChunk *head;
+  blockingChunk *tail;
+  blockingIoStats stats;
+} blockingIo;
+
+static void freeChunk(blockingChunk *c){
+  free(c->samples);
+  free(c);
+}
+
+// take the head chunk off the queue. Assumes the lock is held.
+static void popChunk(blockingIo *bio){
+  blockingChunk *c = bio->head;
+  bio->head = c->next;
+  if (bio->head == NULL) {
+    bio->tail = NULL;
+  }
+  freeChunk(c);
+}
+
+// add a chunk to the end of the queue. Assumes the lock is held.
+static void pushChunk(blockingIo *bio, blockingChunk *c){
+  c->next = NULL;
+  if (bio->tail == NULL) {
+    bio->head = c;
+  } else {
+    bio->tail->next = c;
+  }
+  bio->tail = c;
+}
+
+// how many frames should we write right now? We never hand
+// over more than a chunk, and we try not to hand over more
+// than will fit without blocking. If nothing fits, we write
+// a small piece anyway; the write will then block until the
+// device has room, which is exactly what we want.
+static unsigned long framesToWrite(blockingIo *bio, unsigned long pending){
+  signed long avail = paFns.getStreamWriteAvailable(bio->stream);
+  unsigned long n = MYMIN(pending, bio->chunkFrames);
+  if (avail > 0) {
+    n = MYMIN(n, (unsigned long)avail);
+  } else {
+    n = MYMIN(n, MYMAX(bio->chunkFrames / 4, 1));
+  }
+  return n;
+}
+
+static void outputThread(void *arg){
+  blockingIo *bio = (blockingIo *)arg;
+  blockingChunk *c;
+  unsigned long n;
+  PaError err;
+
+  rsMutexLock(&bio->lock);
+  while (!bio->stopRequested) {
+    c = bio->head;
+    if (c == NULL) {
+      rsMutexUnlock(&bio->lock);
+      if (bio->padWithSilence) {
+        err = paFns.writeStream(bio->stream, bio->silence,
+                                framesToWrite(bio, bio->chunkFrames));
+      } else {
+        err = paNoError;
+        rsMutexLock(&bio->lock);
+        if (bio->head == NULL && !bio->stopRequested) {
+          rsCondWait(&bio->cond, &bio->lock);
+        }
+        rsMutexUnlock(&bio->lock);
+      }
+    } else {
+      // only this thread removes chunks, so c stays valid
+      // while we're unlocked.
+      rsMutexUnlock(&bio->lock);
+      n = framesToWrite(bio, c->frames - c->offset);
+      err = paFns.writeStream(bio->stream, c->samples + c->offset * CHANNELS, n);
+      rsMutexLock(&bio->lock);
+      c->offset += n;
+      bio->stats.framesTransferred += n;
+      bio->stats.queuedFrames -= n;
+      if (c->offset == c->frames) {
+        popChunk(bio);
+      }
+      rsCondBroadcast(&bio->cond);
+      rsMutexUnlock(&bio->lock);
+    }
+    rsMutexLock(&bio->lock);
+    if (err == paOutputUnderflowed) {
+      bio->stats.underflows += 1;
+    } else if (err != paNoError) {
+      bio->stats.lastError = err;
+      break;
+    }
+  }
+  bio->finished = 1;
+  rsCondBroadcast(&bio->cond);
+  rsMutexUnlock(&bio->lock);
+}
+
+static void inputThread(void *arg){
+  blockingIo *bio = (blockingIo *)arg;
+  blockingChunk *c;
+  signed long avail;
+  unsigned long n;
+  PaError err;
+
+  rsMutexLock(&bio->lock);
+  while (!bio->stopRequested) {
+    rsMutexUnlock(&bio->lock);
+    avail = paFns.getStreamReadAvailable(bio->stream);
+    n = (avail > 0) ? MYMIN((unsigned long)avail, bio->chunkFrames) : bio->chunkFrames;
+    c = (blockingChunk *)malloc(sizeof(blockingChunk));
+    if (c != NULL) {
+      c->samples = (short *)malloc(FRAMES_TO_BYTES(n));
+      if (c->samples == NULL) {
+        free(c);
+        c = NULL;
+      }
+    }
+    if (c == NULL) {
+      rsMutexLock(&bio->lock);
+      bio->stats.lastError = paInsufficientMemory;
+      break;
+    }
+    c->frames = n;
+    c->offset = 0;
+    err = paFns.readStream(bio->stream, c->samples, n);
+    rsMutexLock(&bio->lock);
+    if (err == paInputOverflowed) {
+      bio->stats.overflows += 1;
+    } else if (err != paNoError) {
+      bio->stats.lastError = err;
+      freeChunk(c);
+      break;
+    }
+    pushChunk(bio, c);
+    bio->stats.framesTransferred += n;
+    bio->stats.queuedFrames += n;
+    // if Racket isn't keeping up, throw away the oldest data:
+    while (bio->stats.queuedFrames > bio->maxQueuedFrames && bio->head != bio->tail) {
+      n = bio->head->frames - bio->head->offset;
+      bio->stats.queuedFrames -= n;
+      bio->stats.droppedFrames += n;
+      popChunk(bio);
+    }
+    rsCondBroadcast(&bio->cond);
+  }
+  bio->finished = 1;
+  rsCondBroadcast(&bio->cond);
+  rsMutexUnlock(&bio->lock);
+}
+
+// start a native thread servicing the given stream, which must
+// have been opened with a NULL callback and started. Direction
+// is 0 for output and 1 for input. Returns NULL if the thread
+// couldn't be started or portaudio's entry points haven't been
+// registered.
+blockingIo *blockingIoStart(PaStream *stream, int direction,
+                            unsigned long chunkFrames,
+                            unsigned long maxQueuedFrames,
+                            int padWithSilence){
+  blockingIo *bio;
+  int failed;
+
+  if (paFns.getStreamWriteAvailable == NULL || paFns.getStreamReadAvailable == NULL
+      || paFns.writeStream == NULL || paFns.readStream == NULL || chunkFrames == 0) {
+    return NULL;
+  }
+  bio = (blockingIo *)calloc(1, sizeof(blockingIo));
+  if (bio == NULL) {
+    return NULL;
+  }
+  bio->stream = stream;
+  bio->direction = direction;
+  bio->chunkFrames = chunkFrames;
+  bio->maxQueuedFrames = MYMAX(maxQueuedFrames, chunkFrames);
+  bio->padWithSilence = padWithSilence && (direction == BLOCKING_OUTPUT);
+  if (bio->padWithSilence) {
+    bio->silence = (short *)calloc(chunkFrames * CHANNELS, SAMPLEBYTES);
+    if (bio->silence == NULL) {
+      free(bio);
+      return NULL;
+    }
+  }
+  rsMutexInit(&bio->lock);
+  rsCondInit(&bio->cond);
+  failed = rsThreadCreate(&bio->thread,
+                          (direction == BLOCKING_OUTPUT) ? outputThread : inputThread,
+                          bio);
+  if (failed) {
+    rsCondDestroy(&bio->cond);
+    rsMutexDestroy(&bio->lock);
+    free(bio->silence);
+    free(bio);
+    return NULL;
+  }
+  bio->threadStarted = 1;
+  return bio;
+}
+
+// queue a copy of the given frames for output. Returns 0 if the
+// copy couldn't be allocated or the thread has stopped.
+int blockingIoEnqueue(blockingIo *bio, const short *samples, unsigned long frames){
+  blockingChunk *c;
+  if (frames == 0) {
+    return 1;
+  }
+  c = (blockingChunk *)malloc(sizeof(blockingChunk));
+  if (c == NULL) {
+    return 0;
+  }
+  c->samples = (short *)malloc(FRAMES_TO_BYTES(frames));
+  if (c->samples == NULL) {
+    free(c);
+    return 0;
+  }
+  memcpy(c->samples, samples, FRAMES_TO_BYTES(frames));
+  c->frames = frames;
+  c->offset = 0;
+  rsMutexLock(&bio->lock);
+  if (bio->finished) {
+    rsMutexUnlock(&bio->lock);
+    freeChunk(c);
+    return 0;
+  }
+  pushChunk(bio, c);
+  bio->stats.queuedFrames += frames;
+  rsCondBroadcast(&bio->cond);
+  rsMutexUnlock(&bio->lock);
+  return 1;
+}
+
+// copy up to 'frames' recorded frames into dst, returning the
+// number of frames copied. Never blocks on the device.
+unsigned long blockingIoDequeue(blockingIo *bio, short *dst, unsigned long frames){
+  unsigned long copied = 0;
+  unsigned long n;
+  blockingChunk *c;
+
+  rsMutexLock(&bio->lock);
+  while (copied < frames && bio->head != NULL) {
+    c = bio->head;
+    n = MYMIN(frames - copied, c->frames - c->offset);
+    memcpy(dst + copied * CHANNELS, c->samples + c->offset * CHANNELS,
+           FRAMES_TO_BYTES(n));
+    copied += n;
+    c->offset += n;
+    bio->stats.queuedFrames -= n;
+    if (c->offset == c->frames) {
+      popChunk(bio);
+    }
+  }
+  rsMutexUnlock(&bio->lock);
+  return copied;
+}
+
+// frames waiting to be written (output) or taken (input)
+unsigned long blockingIoQueuedFrames(blockingIo *bio){
+  unsigned long result;
+  rsMutexLock(&bio->lock);
+  result = bio->stats.queuedFrames;
+  rsMutexUnlock(&bio->lock);
+  return result;
+}
+
+// has the thread stopped, either by request or on an error?
+int blockingIoFinished(blockingIo *bio){
+  int result;
+  rsMutexLock(&bio->lock);
+  result = bio->finished;
+  rsMutexUnlock(&bio->lock);
+  return result;
+}
+
+void blockingIoGetStats(blockingIo *bio, blockingIoStats *out){
+  rsMutexLock(&bio->lock);
+  *out = bio->stats;
+  rsMutexUnlock(&bio->lock);
+}
+
+// ask the thread to stop, and wait until it has. Each portaudio
+// call made by the thread returns within about a chunk, so this
+// doesn't wait long. The stream must not be closed until this
+// has returned.
+void blockingIoStop(blockingIo *bio){
+  rsMutexLock(&bio->lock);
+  bio->stopRequested = 1;
+  rsCondBroadcast(&bio->cond);
+  rsMutexUnlock(&bio->lock);
+  if (bio->threadStarted) {
+    rsThreadJoin(bio->thread);
+    bio->threadStarted = 0;
+  }
+}
+
+// stop the thread if necessary and free everything, including
+// any buffers still in the queue.
+void blockingIoFree(blockingIo *bio){
+  blockingIoStop(bio);
+  while (bio->head != NULL) {
+    popChunk(bio);
+  }
+  rsCondDestroy(&bio->cond);
+  rsMutexDestroy(&bio->lock);
+  free(bio->silence);
+  free(bio);
+}
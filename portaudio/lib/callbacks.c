@@ -1,7 +1,4 @@
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include "portaudio.h"
+#include "callbacks.h"
 
 // This file provides callbacks suitable for passing to
 // portaudio that can respond to portaudio requests for
@@ -15,6 +12,9 @@
 // in its struct that allow two-way communication between
 // C and Racket, and that it knows how to loop around to
 // the beginning of the buffer again after it reaches the end.
+// (The copying callback can loop too, but only over a fixed
+// region of its sound; see loop.c. Its sound can also be packed;
+// see adpcm.c.)
 
 // Implementation note: Portaudio is very specific that these
 // callbacks definitely can't block; this is why we need
@@ -22,46 +22,14 @@
 // output; the low-level callback never blocks, and the higher-level
 // callback is written in Racket (and might block).
 
-typedef struct soundCopyingInfo{
-  // this sound is assumed to be malloc'ed, and gets freed when finished.
-  short *sound;
-  unsigned long curSample;
-  unsigned long numSamples;
-} soundCopyingInfo;
-
-typedef struct soundStreamInfo{
-  unsigned int   bufferFrames;
-  char *buffer;
-
-  // only mutated by C (er... I believe?)
-  unsigned int lastFrameRead;
-  unsigned int lastOffsetRead;
-
-  // only mutated by Racket
-  unsigned int lastFrameWritten;
-  unsigned int lastOffsetWritten;
-
-  int   faultCount;
-  int   *all_done;
-} soundStreamInfo;
-
-#define CHANNELS 2
-#define SAMPLEBYTES 2
-
-#define MYMIN(a,b) ((a)<(b) ? (a) : (b))
-#define MYMAX(a,b) ((a)>(b) ? (a) : (b))
-#define FRAMES_TO_BYTES(a) ((a)*CHANNELS*SAMPLEBYTES)
-
-
-void freeCopyingInfo(soundCopyingInfo *ri);
-void freeStreamingInfo(soundStreamInfo *ssi);
 
 // this is a callback that plays sound from a fixed buffer.
 // note that this callback's interface is fixed by portaudio.
 // assumes 16-bit ints, 2 channels.
 
 // NB: the only effect of this callback is to copy bytes from
-// one buffer to another. No allocation or freeing takes place.
+// one buffer to another (scaling, filtering and limiting them, if
+// the sound has gain controls, an EQ or a limiter). No allocation or freeing takes place.
 int copyingCallback(
     const void *input, // pointer to input sounds : unused here
     void *output, // the buffer to copy into
@@ -80,8 +48,26 @@ int copyingCallback(
   size_t bytesToCopy;
   char *zeroRegionBegin;
   size_t bytesToZero;
-
-  if (ri->numSamples <= nextCurSample) {
+  unsigned long framesCopied;
+  int result;
+
+  if (ri->control || ri->loopEnd || ri->packed) {
+    // this sound has controls (see ramp.c), a loop (see loop.c),
+    // or needs decoding (see adpcm.c).
+    if (ri->control) {
+      framesCopied = controlledCopy(ri,(short *)output,frameCount);
+    } else {
+      framesCopied = loopCopy(ri,(short *)output,frameCount);
+    }
+    if (framesCopied < frameCount || ri->numSamples <= ri->curSample) {
+      memset((short *)output + framesCopied * CHANNELS, 0,
+             FRAMES_TO_BYTES(frameCount - framesCopied));
+      result = paComplete;
+    } else {
+      result = paContinue;
+    }
+
+  } else if (ri->numSamples <= nextCurSample) {
     // request is for more samples than the rest of the sound.
     // Therefore, this is the last chunk.
     bytesToCopy = SAMPLEBYTES * (ri->numSamples - ri->curSample);
@@ -91,21 +77,43 @@ int copyingCallback(
     bytesToZero = FRAMES_TO_BYTES(frameCount) - bytesToCopy;
     memset(zeroRegionBegin,0,bytesToZero);
     ri->curSample = ri->numSamples;
-    return(paComplete);
+    result = paComplete;
 
   } else {
     // this is not the last chunk.
     bytesToCopy = SAMPLEBYTES * samplesToCopy;
     memcpy(output,(void *)copyBegin,bytesToCopy);
     ri->curSample = nextCurSample;
-    return(paContinue);
+    result = paContinue;
+  }
+
+  // the EQ, if any (see biquad.c):
+  if (ri->filter) {
+    filterStateProcess(ri->filter,(short *)output,frameCount);
   }
+  // the limiter, if any (see limiter.c). What it's still holding
+  // back has to be played before the sound is done:
+  if (ri->limiter) {
+    limiterProcess(ri->limiter,(short *)output,frameCount);
+    if (result == paComplete && !limiterDrained(ri->limiter)) {
+      result = paContinue;
+    }
+  }
+  // the spectrum analyzer, if any (see spectrum.c):
+  if (ri->spectrum) {
+    spectrumWrite(ri->spectrum,(const short *)output,frameCount);
+  }
+  return(result);
 }
 
 // this is a recording callback. I believe it works for some
 // sets of inputs, but I don't believe it works in general.
 // for one thing, it records a fixed duration sound.
 
+// DEPRECATED: nothing in the package uses it any more; recordings
+// are made by recordingCallback (see recorder.c). It stays only for
+// callers of make-copying-info/rec in callback-support.rkt.
+
 // assumes 16-bit ints, 2 channels.
 
 // NB: the only effect of this callback is to copy bytes from
@@ -142,6 +150,19 @@ int copyingCallbackRec(
   }
 }
 
+// how many frames at the end of this stretch are silent?
+// Scans backward, so sound near the end is found quickly.
+static unsigned int trailingSilentFrames(const short *samples, unsigned int frames){
+  unsigned long i = (unsigned long)frames * CHANNELS;
+  while (i > 0) {
+    if (samples[i-1] != 0) {
+      return frames - (unsigned int)((i-1) / CHANNELS) - 1;
+    }
+    i--;
+  }
+  return frames;
+}
+
 // this is a streaming callback, to be used with sounds
 // that are being generated as they're being played back.
 
@@ -149,7 +170,8 @@ int copyingCallbackRec(
 // meanings of input arguments.
 
 // NB: the only effect of this callback is to copy bytes from
-// one buffer to another. No allocation or freeing takes place.
+// one buffer to another (and filter and limit them, if the stream
+// has an EQ or a limiter). No allocation or freeing takes place.
 int streamingCallback(
     const void *input, void *output,
     unsigned long frameCount,
@@ -170,7 +192,19 @@ int streamingCallback(
   // stupid windows. I bet there's some way to get around this restriction.
   unsigned int bytesInEnd;
   unsigned int bytesAtBeginning;
-  
+  unsigned int trailingSilence;
+  // negative once the reader has overtaken the writer:
+  int framesWaiting = (int)(ssi->lastFrameWritten - ssi->lastFrameRead);
+
+  // how close to running dry we came, for the latency controller. A
+  // reset from Racket that races this costs one observation, no more.
+  if (framesWaiting < 0) {
+    framesWaiting = 0;
+  }
+  if ((unsigned int)framesWaiting < ssi->lowWaterFrames) {
+    ssi->lowWaterFrames = (unsigned int)framesWaiting;
+  }
+
   if (lastOffsetToCopy > bufferBytes) {
     // break it into two pieces:
     bytesInEnd = bufferBytes - ssi->lastOffsetRead;
@@ -184,7 +218,37 @@ int streamingCallback(
   // fill the rest with zeros, if any:
   if (lastFrameToCopy < lastFrameRequested) {
     memset((void *)((char *)output+bytesToCopy),0,FRAMES_TO_BYTES(lastFrameRequested - lastFrameToCopy));
-    ssi->faultCount += 1;
+    // if the filler has said it's idle, running dry is expected.
+    if (!ssi->idle) {
+      ssi->faultCount += 1;
+    }
+  }
+  // the EQ, if any (see biquad.c). It runs over the silence too,
+  // so that the filters ring out naturally.
+  if (ssi->filter) {
+    filterStateProcess(ssi->filter,(short *)output,frameCount);
+  }
+  // then the limiter, if any (see limiter.c):
+  if (ssi->limiter) {
+    limiterProcess(ssi->limiter,(short *)output,frameCount);
+  }
+  // keep track of how long it's been since we played any sound,
+  // so that a silent stream can be suspended:
+  trailingSilence = trailingSilentFrames((const short *)output, framesToCopy);
+  if (trailingSilence < framesToCopy) {
+    ssi->silentFrames = trailingSilence;
+  } else {
+    ssi->silentFrames += framesToCopy;
+  }
+  ssi->silentFrames += lastFrameRequested - lastFrameToCopy;
+  // a record of what we delivered, if anyone wants one (see tap.c):
+  if (ssi->tap) {
+    tapWrite(ssi->tap,output,frameCount,ssi->lastFrameRead,statusFlags,
+             lastFrameRequested - lastFrameToCopy,ssi->faultCount,timeInfo);
+  }
+  // and the spectrum analyzer, if any (see spectrum.c):
+  if (ssi->spectrum) {
+    spectrumWrite(ssi->spectrum,(const short *)output,frameCount);
   }
   // update record. Advance to the desired point, even
   // if it wasn't available.
@@ -198,27 +262,89 @@ int streamingCallback(
 // clean up when done:  free the sound data and the
 // closure data
 void freeCopyingInfo(soundCopyingInfo *ri){
-  free(ri->sound);
-  free(ri);
+  if (ri->control) {
+    playbackControlRelease(ri->control);
+  }
+  if (ri->filter) {
+    filterStateFree(ri->filter);
+  }
+  if (ri->packed) {
+    adpcmReaderFree(ri->packed);
+  }
+  if (ri->spectrum) {
+    spectrumRelease(ri->spectrum);
+  }
+  if (ri->limiter) {
+    limiterDetach(ri->limiter);
+  }
+  arenaFree(ri->sound);
+  arenaFree(ri);
 }
 
-// clean up a streamingInfo record when done, sets a cell used to indicate
-// the stream can be freed
+// the stream-finished callback for a streamingInfo record: sets a
+// cell used to indicate that the stream is all done. It doesn't free
+// the record; Racket may be in the middle of filling its ring, so
+// Racket frees it (with freeStreamingInfo) once it has seen the cell.
+void streamingInfoFinished(soundStreamInfo *ssi){
+  // the stream is only being suspended (see control.c), and will
+  // be started again; we're not done with any of this yet.
+  if (RS_ATOMIC_LOAD(&ssi->suspendState) != STREAM_RUNNING) {
+    return;
+  }
+  // when all_done is 1, this triggers racket to call PaClose on the
+  // stream, and then to free the record.
+  RS_ATOMIC_STORE(ssi->all_done, 1);
+}
+
+// clean up a streamingInfo record, once its stream is all done (or
+// if it never played). The all_done cell belongs to Racket, and
+// isn't freed here.
 void freeStreamingInfo(soundStreamInfo *ssi){
-  // when all_done is 1, this triggers racket to call PaClose on the stream.
-  // note that we're not mutating the structure here,
-  // but rather a cell that it points to, so it will
-  // survive the free(ssi).
-  *(ssi->all_done) = 1;
-  free(ssi->buffer);
-  free(ssi);
+  if (ssi->filter) {
+    filterStateFree(ssi->filter);
+  }
+  if (ssi->spectrum) {
+    spectrumRelease(ssi->spectrum);
+  }
+  if (ssi->limiter) {
+    limiterDetach(ssi->limiter);
+  }
+  if (ssi->shared == NULL) {
+    arenaFree(ssi->buffer);
+  }
+  arenaFree(ssi);
+}
+
+// find the first frame in [fromFrame, toFrame) of the ring that
+// isn't silent, or toFrame if they're all silent. Used by Racket
+// to decide when to resume a suspended stream; the callback must
+// not be running when this is called.
+unsigned int firstSoundingFrame(soundStreamInfo *ssi,
+                                unsigned int fromFrame,
+                                unsigned int toFrame){
+  unsigned int frame;
+  short *sample;
+  for (frame = fromFrame; frame != toFrame; frame++) {
+    sample = (short *)(ssi->buffer + FRAMES_TO_BYTES(frame % ssi->bufferFrames));
+    if (sample[0] != 0 || sample[1] != 0) {
+      return frame;
+    }
+  }
+  return toFrame;
 }
 
-// this is just a stub to call malloc.
+// this is the allocator for everything the callbacks touch.
 // it's necessary on windows, to ensure
 // that the free & malloc used on the
 // sound info blocks are associated
-// with the same library.
+// with the same library. It also means that
+// these blocks come from the arena (see arena.c),
+// so they're resident before the callback sees them.
 void *dll_malloc(size_t bytes){
-  return malloc(bytes);
+  return arenaAlloc(bytes);
+}
+
+// the matching free, for blocks that never made it to a callback.
+void dll_free(void *p){
+  arenaFree(p);
 }
@@ -0,0 +1,378 @@
+#ifndef RSOUND_CALLBACKS_H
+#define RSOUND_CALLBACKS_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "portaudio.h"
+
+// This header is shared by the C files that make up the
+// librsoundcallbacks library. Racket never sees it; the
+// structs declared here are mirrored by hand in
+// callbacks-lib.rkt and callback-support.rkt, so any change
+// to a struct layout must be made in both places.
+
+// a change of gain, to be applied by the copying callback.
+typedef struct playbackRamp{
+  float targetLeft;
+  float targetRight;
+  // the length of the ramp; 0 means a jump.
+  unsigned long frames;
+  // the frame of the sound at which the ramp starts, or
+  // RAMP_NOW to start with the next callback.
+  unsigned long startFrame;
+  int shape;
+  // end the sound when the ramp finishes (for fade-outs):
+  int stopAtEnd;
+} playbackRamp;
+
+#define RAMP_LINEAR 0
+#define RAMP_EXPONENTIAL 1
+#define RAMP_NOW ((unsigned long)-1)
+
+#define INTERPOLATE_LINEAR 0
+#define INTERPOLATE_CUBIC 1
+
+// the controls for one playing sound: gain (see ramp.c) and
+// playback rate (see varispeed.c).
+typedef struct playbackControl{
+  // one reference for Racket, one for the playing sound.
+  int refs;
+  // written by Racket: 'generation' is odd while Racket is
+  // writing 'pending', and is bumped again when it's done.
+  unsigned int generation;
+  playbackRamp pending;
+  // only touched by the callback, once the sound is playing:
+  unsigned int seenGeneration;
+  int rampWaiting;
+  int rampActive;
+  playbackRamp ramp;
+  unsigned long rampPos;
+  float startLeft;
+  float startRight;
+  float left;
+  float right;
+
+  // written by Racket, with its own generation counter that
+  // works like the one above:
+  unsigned int rateGeneration;
+  double pendingRate;
+  unsigned long pendingRateFrames;
+  int pendingInterpolation;
+  // only touched by the callback, once the sound is playing:
+  unsigned int seenRateGeneration;
+  double rate;
+  double rateFrom;
+  double rateTarget;
+  unsigned long rateGlidePos;
+  unsigned long rateGlideFrames;
+  int interpolation;
+
+  // set by Racket to make a looping sound play on past the end
+  // of its loop:
+  int loopExit;
+} playbackControl;
+
+// the EQ state for one playing sound (see biquad.c).
+typedef struct filterState filterState;
+
+// a sound stored as IMA ADPCM, and a playing sound's view of it
+// (see adpcm.c).
+typedef struct adpcmSound adpcmSound;
+typedef struct adpcmReader adpcmReader;
+typedef struct outputTap outputTap;
+typedef struct spectrumAnalyzer spectrumAnalyzer;
+// a look-ahead limiter (see limiter.c).
+typedef struct limiterState limiterState;
+#define ADPCM_BLOCK_FRAMES 512
+
+typedef struct soundCopyingInfo{
+  // this sound is assumed to be malloc'ed, and gets freed when finished.
+  short *sound;
+  unsigned long curSample;
+  unsigned long numSamples;
+  // gain, pan and rate to be applied while copying, or NULL to
+  // just copy.
+  playbackControl *control;
+  // with a control: the fractional part of the playback position
+  // (curSample is the whole part), and the number of frames played.
+  double fraction;
+  unsigned long framesPlayed;
+  // filters to run over the output, or NULL.
+  filterState *filter;
+  // a loop region, in frames of the sound (see loop.c); loopEnd
+  // is 0 if there's no loop. loopsLeft is the number of times
+  // left to jump back to the start, or -1 to loop forever.
+  unsigned long loopStart;
+  unsigned long loopEnd;
+  long loopsLeft;
+  unsigned long crossfadeFrames;
+  // if the sound is packed (see adpcm.c), its reader; 'sound' is
+  // NULL, and curSample and numSamples count samples of the
+  // unpacked sound.
+  adpcmReader *packed;
+  // if the sound is being analyzed (see spectrum.c), the analyzer;
+  // the record holds a reference to it.
+  spectrumAnalyzer *spectrum;
+  // if the output is limited (see limiter.c), the limiter; the
+  // record holds a reference to it.
+  limiterState *limiter;
+} soundCopyingInfo;
+
+typedef struct soundStreamInfo{
+  unsigned int   bufferFrames;
+  char *buffer;
+
+  // only mutated by C (er... I believe?)
+  unsigned int lastFrameRead;
+  unsigned int lastOffsetRead;
+
+  // only mutated by Racket
+  unsigned int lastFrameWritten;
+  unsigned int lastOffsetWritten;
+
+  int   faultCount;
+  int   *all_done;
+
+  // auto-suspend (see control.c). The number of silent frames
+  // the callback has delivered since the last sound; only
+  // mutated by C.
+  unsigned int silentFrames;
+  // set by Racket while the filler has nothing to play; the
+  // silence that results doesn't count as faults.
+  int idle;
+  // one of the STREAM_ states below; only mutated by the
+  // control thread.
+  int suspendState;
+  // also maintained by the control thread:
+  unsigned int suspends;
+  double suspendedAt;
+  double suspendedSeconds;
+  // seconds from a resume request until the stream was running:
+  double wakeLatency;
+  double maxWakeLatency;
+  // seconds spent in Pa_StartStream on the last resume:
+  double resumeLatency;
+  // filters to run over the output, or NULL; freed with the
+  // rest of the record.
+  filterState *filter;
+  // if the ring is in shared memory (see shm.c), its header; the
+  // buffer is in the same segment, and isn't ours to free.
+  struct sharedRingHeader *shared;
+  // if what the callback delivers is being recorded (see tap.c), the
+  // tap; Racket closes it once the stream is done.
+  outputTap *tap;
+  // the part of the ring Racket keeps full, in frames; never more
+  // than bufferFrames. Racket may move it while the stream runs (see
+  // fill-scheduler.rkt): a smaller window means less latency.
+  unsigned int windowFrames;
+  // the fewest frames the callback has found waiting in the ring
+  // since Racket last reset it; only lowered by C.
+  unsigned int lowWaterFrames;
+  // if the output is being analyzed (see spectrum.c), the analyzer;
+  // the record holds a reference to it.
+  spectrumAnalyzer *spectrum;
+  // if the output is limited (see limiter.c), the limiter; the
+  // record holds a reference to it.
+  limiterState *limiter;
+} soundStreamInfo;
+
+#define STREAM_RUNNING 0
+#define STREAM_SUSPENDING 1
+#define STREAM_SUSPENDED 2
+
+#define CHANNELS 2
+#define SAMPLEBYTES 2
+
+#define MYMIN(a,b) ((a)<(b) ? (a) : (b))
+#define MYMAX(a,b) ((a)>(b) ? (a) : (b))
+#define FRAMES_TO_BYTES(a) ((a)*CHANNELS*SAMPLEBYTES)
+
+// a sample computed in floating point, rounded (halves away from
+// zero) and clipped to a short; a NaN (say, a silent sample at an
+// infinite gain) is 0. Every path that turns floating-point samples
+// into output goes through one of these two; the SSE2 loops that do
+// it four at a time zero NaNs, clip, add a half with the sample's
+// sign, and truncate, to get the same answers.
+static inline short rsToSample(double x){
+  if (x >= 32767.0) {
+    return 32767;
+  } else if (x <= -32768.0) {
+    return -32768;
+  } else if (x != x) {
+    return 0;
+  } else {
+    return (short)(x >= 0.0 ? x + 0.5 : x - 0.5);
+  }
+}
+
+// the same, in single precision, for the paths that compute in
+// floats.
+static inline short rsToSampleF(float x){
+  if (x >= 32767.0f) {
+    return 32767;
+  } else if (x <= -32768.0f) {
+    return -32768;
+  } else if (x != x) {
+    return 0;
+  } else {
+    return (short)(x >= 0.0f ? x + 0.5f : x - 0.5f);
+  }
+}
+
+int streamingCallback(const void *input, void *output,
+                      unsigned long frameCount,
+                      const PaStreamCallbackTimeInfo* timeInfo,
+                      PaStreamCallbackFlags statusFlags,
+                      void *userData);
+void freeCopyingInfo(soundCopyingInfo *ri);
+// copy frames from the sound, applying its gain controls (see
+// ramp.c). Returns the number of frames copied, which is fewer
+// than asked for at the end of the sound or if a ramp stopped it.
+unsigned long controlledCopy(soundCopyingInfo *ri, short *output, unsigned long frames);
+void playbackControlRelease(playbackControl *pc);
+// does this sound need resampling right now? (see varispeed.c)
+int varispeedActive(soundCopyingInfo *ri);
+// resample up to 'frames' frames into 'output'; returns the number
+// produced, which is fewer at the end of the sound.
+unsigned long varispeedRender(soundCopyingInfo *ri, short *output, unsigned long frames);
+// is the sound going to jump back to its loop start? (see loop.c)
+int loopActive(soundCopyingInfo *ri);
+// copy up to 'frames' frames into 'output', looping as needed;
+// returns the number copied, which is fewer at the end of the sound.
+unsigned long loopCopy(soundCopyingInfo *ri, short *output, unsigned long frames);
+// one sample at the given frame, taking the loop and its crossfade
+// into account, for resampling.
+double loopSampleAt(soundCopyingInfo *ri, long frame, int channel);
+// move the position on by 'frames' whole frames, jumping back at
+// the loop end.
+void loopAdvance(soundCopyingInfo *ri, unsigned long frames);
+// read the sound, packed or not (see adpcm.c).
+void soundCopyFrames(soundCopyingInfo *ri, unsigned long frame, unsigned long frames,
+                     short *out);
+short soundSampleAt(soundCopyingInfo *ri, unsigned long frame, int channel);
+void adpcmReaderFree(adpcmReader *r);
+void filterStateProcess(filterState *fs, short *samples, unsigned long frames);
+void filterStateFree(filterState *fs);
+void tapWrite(outputTap *t, const void *output, unsigned long frames,
+              unsigned int position, PaStreamCallbackFlags statusFlags,
+              unsigned int underrunFrames, int faultCount,
+              const PaStreamCallbackTimeInfo *timeInfo);
+void streamingInfoFinished(soundStreamInfo *ssi);
+void freeStreamingInfo(soundStreamInfo *ssi);
+void spectrumWrite(spectrumAnalyzer *sa, const short *samples, unsigned long frames);
+void spectrumRelease(spectrumAnalyzer *sa);
+void limiterProcess(limiterState *ls, short *samples, unsigned long frames);
+void limiterProcessWide(limiterState *ls, const int *in, short *out, unsigned long frames);
+int limiterDrained(limiterState *ls);
+void limiterReset(limiterState *ls);
+void limiterRelease(limiterState *ls);
+void limiterDetach(limiterState *ls);
+// mixing, for the callbacks that mix (see kernels.c).
+void kernelAccumulate(int *acc, const short *in, unsigned long samples, int clear);
+void kernelSaturate(short *out, const int *acc, unsigned long samples);
+// every stream's lifecycle record (see lifecycle.c); the close
+// thread hands it back once the stream is closed.
+typedef struct streamLife streamLife;
+void lifecycleClosed(streamLife *life, double requestedAt);
+void *dll_malloc(size_t bytes);
+void dll_free(void *p);
+
+// the allocator for memory that callbacks touch; see arena.c.
+void *arenaAlloc(size_t bytes);
+void *arenaCalloc(size_t bytes);
+void arenaFree(void *p);
+void arenaTrim(size_t keepBytes);
+// how many bytes of freed regions the arena keeps for reuse when the
+// stream-control thread trims it:
+#define ARENA_RETAINED_BYTES (64 * 1024 * 1024)
+
+
+// NATIVE THREADS
+//
+// Some of the work in this library happens on threads that
+// we start ourselves, rather than on Racket's thread or on
+// portaudio's callback thread. These are the smallest wrappers
+// that let that code build on both pthreads and Windows.
+
+#ifdef WIN32
+# include <windows.h>
+typedef HANDLE rsThread;
+typedef CRITICAL_SECTION rsMutex;
+typedef CONDITION_VARIABLE rsCond;
+#else
+# include <pthread.h>
+typedef pthread_t rsThread;
+typedef pthread_mutex_t rsMutex;
+typedef pthread_cond_t rsCond;
+#endif
+
+// returns 0 on success
+int rsThreadCreate(rsThread *thread, void (*fn)(void *), void *arg);
+void rsThreadJoin(rsThread thread);
+void rsMutexInit(rsMutex *m);
+void rsMutexDestroy(rsMutex *m);
+void rsMutexLock(rsMutex *m);
+void rsMutexUnlock(rsMutex *m);
+void rsCondInit(rsCond *c);
+void rsCondDestroy(rsCond *c);
+void rsCondWait(rsCond *c, rsMutex *m);
+// waits at most the given number of milliseconds
+void rsCondTimedWait(rsCond *c, rsMutex *m, long millis);
+void rsCondBroadcast(rsCond *c);
+// seconds on a monotonic clock with an unspecified origin
+double rsMonotonicSeconds(void);
+void rsSleepMillis(long millis);
+
+// word-sized loads and stores shared between threads. Everything
+// passed to these must be naturally aligned.
+#ifdef _MSC_VER
+# define RS_ATOMIC_LOAD(p)       (MemoryBarrier(), *(p))
+# define RS_ATOMIC_STORE(p,v)    do { MemoryBarrier(); *(p) = (v); MemoryBarrier(); } while (0)
+# define RS_ATOMIC_ADD(p,v)      InterlockedExchangeAdd((volatile LONG *)(p),(v))
+// nonzero if *p was 'expected' and is now 'desired'
+# define RS_ATOMIC_CAS(p,expected,desired) \
+  (InterlockedCompareExchange((volatile LONG *)(p),(desired),(expected)) == (expected))
+# define RS_ATOMIC_LOAD_PTR(p)   (MemoryBarrier(), *(p))
+# define RS_ATOMIC_STORE_PTR(p,v) do { MemoryBarrier(); *(p) = (v); MemoryBarrier(); } while (0)
+# define RS_FENCE()              MemoryBarrier()
+#else
+# define RS_ATOMIC_LOAD(p)       __atomic_load_n((p),__ATOMIC_ACQUIRE)
+# define RS_ATOMIC_STORE(p,v)    __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+# define RS_ATOMIC_ADD(p,v)      __atomic_fetch_add((p),(v),__ATOMIC_ACQ_REL)
+# define RS_ATOMIC_LOAD_PTR(p)   __atomic_load_n((p),__ATOMIC_ACQUIRE)
+# define RS_ATOMIC_STORE_PTR(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+// a full barrier, for the places where a store has to be seen
+// before a following load:
+# define RS_FENCE()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+# define RS_ATOMIC_CAS(p,expected,desired) \
+  rsAtomicCas((p),(expected),(desired))
+static inline int rsAtomicCas(int *p, int expected, int desired){
+  return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+
+// PORTAUDIO ENTRY POINTS
+//
+// This library isn't linked against portaudio; Racket loads
+// portaudio itself and hands us the few entry points that our
+// native threads need to call, using setPaFunction. A NULL
+// entry means that Racket hasn't registered it (yet).
+
+typedef struct paFunctionTable{
+  PaError (*writeStream)(PaStream *stream, const void *buffer, unsigned long frames);
+  PaError (*readStream)(PaStream *stream, void *buffer, unsigned long frames);
+  signed long (*getStreamWriteAvailable)(PaStream *stream);
+  signed long (*getStreamReadAvailable)(PaStream *stream);
+  PaError (*startStream)(PaStream *stream);
+  PaError (*stopStream)(PaStream *stream);
+  PaError (*closeStream)(PaStream *stream);
+} paFunctionTable;
+
+extern paFunctionTable paFns;
+
+int setPaFunction(const char *name, void *fn);
+
+#endif
@@ -0,0 +1,312 @@
+#include "callbacks.h"
+
+// This file provides the stream-control thread: a single native
+// thread that performs the portaudio calls that may block for a
+// buffer or more, so that Racket doesn't have to: closing
+// streams, and suspending and resuming idle streaming ones.
+// Pa_StopStream waits for the pending buffers to drain, and
+// while Racket is inside it, the whole VM is stuck.
+
+// Racket enqueues a request and returns immediately. Requests
+// are performed in the order they were made. Racket can tell
+// when a given request has been performed by comparing the
+// 'completed' count against the ticket returned by the enqueue.
+
+// Suspending a streaming stream is just stopping it, without
+// letting the stream-finished callback mark it all done (see
+// streamingInfoFinished). Resuming is starting it again. A
+// suspended stream that gets closed never becomes inactive
+// again, so portaudio won't call the finished callback; we
+// keep a list of the suspended streams so that we can mark
+// them all done ourselves.
+
+#define CONTROL_CLOSE 0
+#define CONTROL_SUSPEND 1
+#define CONTROL_RESUME 2
+
+typedef struct controlRequest{
+  struct controlRequest *next;
+  PaStream *stream;
+  int op;
+  // suspend and resume only:
+  soundStreamInfo *ssi;
+  // close only: the stream's lifecycle record, or NULL.
+  streamLife *life;
+  double requested;
+} controlRequest;
+
+typedef struct suspendedStream{
+  struct suspendedStream *next;
+  PaStream *stream;
+  soundStreamInfo *ssi;
+} suspendedStream;
+
+typedef struct streamControlStats{
+  unsigned long submitted;
+  unsigned long completed;
+  unsigned long errors;
+  int lastError;
+} streamControlStats;
+
+// 0 = not started, 1 = starting, 2 = running, 3 = couldn't start
+static int controlState = 0;
+static rsMutex controlLock;
+static rsCond controlCond;
+static rsThread controlThread;
+static controlRequest *controlHead = NULL;
+static controlRequest *controlTail = NULL;
+static streamControlStats controlStats;
+// only touched by the control thread:
+static suspendedStream *suspendedStreams = NULL;
+
+// take the given stream off the suspended list, returning its
+// info, or NULL if it wasn't there.
+static soundStreamInfo *forgetSuspended(PaStream *stream){
+  suspendedStream **p = &suspendedStreams;
+  suspendedStream *s;
+  soundStreamInfo *ssi;
+  while (*p != NULL) {
+    if ((*p)->stream == stream) {
+      s = *p;
+      ssi = s->ssi;
+      *p = s->next;
+      free(s);
+      return ssi;
+    }
+    p = &((*p)->next);
+  }
+  return NULL;
+}
+
+static PaError suspendStream(controlRequest *r){
+  soundStreamInfo *ssi = r->ssi;
+  suspendedStream *s;
+  PaError err;
+
+  if (ssi->suspendState != STREAM_RUNNING) {
+    return paNoError;
+  }
+  s = (suspendedStream *)malloc(sizeof(suspendedStream));
+  if (s == NULL) {
+    return paInsufficientMemory;
+  }
+  RS_ATOMIC_STORE(&ssi->suspendState, STREAM_SUSPENDING);
+  err = paFns.stopStream(r->stream);
+  if (err != paNoError) {
+    // who knows what state it's in; let it carry on as before.
+    RS_ATOMIC_STORE(&ssi->suspendState, STREAM_RUNNING);
+    free(s);
+    return err;
+  }
+  s->stream = r->stream;
+  s->ssi = ssi;
+  s->next = suspendedStreams;
+  suspendedStreams = s;
+  ssi->suspends += 1;
+  ssi->suspendedAt = rsMonotonicSeconds();
+  RS_ATOMIC_STORE(&ssi->suspendState, STREAM_SUSPENDED);
+  return paNoError;
+}
+
+static PaError resumeStream(controlRequest *r){
+  soundStreamInfo *ssi = r->ssi;
+  double startedAt;
+  double now;
+  PaError err;
+
+  if (ssi->suspendState != STREAM_SUSPENDED) {
+    return paNoError;
+  }
+  ssi->silentFrames = 0;
+  // the finished callback has to be armed again before the
+  // stream can finish:
+  RS_ATOMIC_STORE(&ssi->suspendState, STREAM_RUNNING);
+  startedAt = rsMonotonicSeconds();
+  err = paFns.startStream(r->stream);
+  now = rsMonotonicSeconds();
+  if (err != paNoError) {
+    // still stopped, so still ours to free on close.
+    RS_ATOMIC_STORE(&ssi->suspendState, STREAM_SUSPENDED);
+    return err;
+  }
+  forgetSuspended(r->stream);
+  ssi->suspendedSeconds += now - ssi->suspendedAt;
+  ssi->resumeLatency = now - startedAt;
+  ssi->wakeLatency = now - r->requested;
+  ssi->maxWakeLatency = MYMAX(ssi->maxWakeLatency, ssi->wakeLatency);
+  return paNoError;
+}
+
+static PaError performRequest(controlRequest *r){
+  soundStreamInfo *suspended;
+  PaError err;
+  switch (r->op) {
+  case CONTROL_CLOSE:
+    // stopping first is what the synchronous close always did;
+    // without it, some hosts deadlock in the abort that
+    // Pa_CloseStream does otherwise. An error from the stop
+    // (e.g. because the stream already stopped itself) is of
+    // no interest; the close is what matters.
+    paFns.stopStream(r->stream);
+    err = paFns.closeStream(r->stream);
+    // (if the close failed, who knows whether the callback can
+    // still run; better to leak the record than to free it.)
+    if (err == paNoError) {
+      lifecycleClosed(r->life, r->requested);
+    }
+    suspended = forgetSuspended(r->stream);
+    if (suspended != NULL) {
+      RS_ATOMIC_STORE(&suspended->suspendState, STREAM_RUNNING);
+      streamingInfoFinished(suspended);
+    }
+    // a closed stream has usually just freed its sound; this thread
+    // can afford the system calls that hand it back:
+    arenaTrim(ARENA_RETAINED_BYTES);
+    break;
+  case CONTROL_SUSPEND:
+    err = suspendStream(r);
+    break;
+  case CONTROL_RESUME:
+    err = resumeStream(r);
+    break;
+  default:
+    err = paInternalError;
+  }
+  return err;
+}
+
+static void controlLoop(void *arg){
+  controlRequest *r;
+  PaError err;
+
+  rsMutexLock(&controlLock);
+  for (;;) {
+    while (controlHead == NULL) {
+      rsCondWait(&controlCond, &controlLock);
+    }
+    r = controlHead;
+    controlHead = r->next;
+    if (controlHead == NULL) {
+      controlTail = NULL;
+    }
+    rsMutexUnlock(&controlLock);
+    err = performRequest(r);
+    free(r);
+    rsMutexLock(&controlLock);
+    if (err != paNoError) {
+      controlStats.errors += 1;
+      controlStats.lastError = err;
+    }
+    RS_ATOMIC_STORE(&controlStats.completed, controlStats.completed + 1);
+    rsCondBroadcast(&controlCond);
+  }
+}
+
+// start the thread unless it's already running. Safe to call
+// from any number of places at once. Returns 1 if the thread is
+// running.
+static int ensureStarted(void){
+  int state;
+  if (RS_ATOMIC_CAS(&controlState, 0, 1)) {
+    rsMutexInit(&controlLock);
+    rsCondInit(&controlCond);
+    memset(&controlStats, 0, sizeof(controlStats));
+    if (rsThreadCreate(&controlThread, controlLoop, NULL) == 0) {
+      RS_ATOMIC_STORE(&controlState, 2);
+    } else {
+      RS_ATOMIC_STORE(&controlState, 3);
+    }
+  }
+  while ((state = RS_ATOMIC_LOAD(&controlState)) == 1) {
+    rsSleepMillis(1);
+  }
+  return state == 2;
+}
+
+// add a request to the queue, returning its ticket, or 0 if it
+// couldn't be queued.
+static unsigned long enqueueRequest(PaStream *stream, int op, soundStreamInfo *ssi,
+                                    streamLife *life){
+  controlRequest *r;
+  unsigned long ticket;
+
+  if (paFns.startStream == NULL || paFns.stopStream == NULL
+      || paFns.closeStream == NULL || !ensureStarted()) {
+    return 0;
+  }
+  r = (controlRequest *)malloc(sizeof(controlRequest));
+  if (r == NULL) {
+    return 0;
+  }
+  r->next = NULL;
+  r->stream = stream;
+  r->op = op;
+  r->ssi = ssi;
+  r->life = life;
+  r->requested = rsMonotonicSeconds();
+  rsMutexLock(&controlLock);
+  if (controlTail == NULL) {
+    controlHead = r;
+  } else {
+    controlTail->next = r;
+  }
+  controlTail = r;
+  controlStats.submitted += 1;
+  ticket = controlStats.submitted;
+  rsCondBroadcast(&controlCond);
+  rsMutexUnlock(&controlLock);
+  return ticket;
+}
+
+// queue a close of the given stream. Returns the ticket for the
+// request: once streamControlCompleted() reaches it, the stream
+// is closed. Returns 0 if the request couldn't be queued (the
+// thread couldn't be started, memory ran out, or Racket hasn't
+// registered the entry points); the caller should then close the
+// stream itself. The stream's lifecycle record (see lifecycle.c),
+// if it has one, is freed once it's closed.
+unsigned long streamControlClose(PaStream *stream, streamLife *life){
+  return enqueueRequest(stream, CONTROL_CLOSE, NULL, life);
+}
+
+// queue a suspend of the given streaming stream. Once the
+// request has been performed, ssi->suspendState says whether it
+// worked.
+unsigned long streamControlSuspend(PaStream *stream, soundStreamInfo *ssi){
+  return enqueueRequest(stream, CONTROL_SUSPEND, ssi, NULL);
+}
+
+// queue a resume of a suspended streaming stream. Racket may move
+// the ring's read position while the stream is suspended, but
+// not once it has asked for a resume.
+unsigned long streamControlResume(PaStream *stream, soundStreamInfo *ssi){
+  return enqueueRequest(stream, CONTROL_RESUME, ssi, NULL);
+}
+
+// the number of requests made so far; a request's ticket is the
+// value this had just after it was made.
+unsigned long streamControlSubmitted(void){
+  if (RS_ATOMIC_LOAD(&controlState) != 2) {
+    return 0;
+  }
+  return RS_ATOMIC_LOAD(&controlStats.submitted);
+}
+
+// the number of requests performed so far. Never blocks, so it's
+// fine to poll this from Racket.
+unsigned long streamControlCompleted(void){
+  if (RS_ATOMIC_LOAD(&controlState) != 2) {
+    return 0;
+  }
+  return RS_ATOMIC_LOAD(&controlStats.completed);
+}
+
+void streamControlGetStats(streamControlStats *out){
+  if (RS_ATOMIC_LOAD(&controlState) != 2) {
+    memset(out, 0, sizeof(streamControlStats));
+    return;
+  }
+  rsMutexLock(&controlLock);
+  *out = controlStats;
+  rsMutexUnlock(&controlLock);
+}
@@ -0,0 +1,797 @@
+#include "callbacks.h"
+
+// This file provides a small processing graph that runs inside
+// the portaudio callback, so that gain, panning, filtering and
+// mixing don't have to happen in Racket before the data gets
+// here.
+
+// Racket builds the graph out of nodes: sources (a sound, a
+// streaming ring, or the stream's input), processors (gain, pan,
+// biquad, mixer) and a single sink, which is always node 0 and
+// writes to the stream's output. Calling dspGraphCompile sorts
+// the nodes that feed the sink so that every node comes after
+// its inputs, and flattens them into an array of kernel calls.
+// The callback just walks that array. All processing is done
+// on interleaved stereo floats.
+
+// Edits to the graph don't affect the callback until the next
+// compile, which swaps the new schedule in with a single pointer
+// store. The old schedule (and anything else the callback might
+// still be looking at, like a removed node or a replaced sound)
+// isn't freed until we know that the callback is done with it:
+// the callback bumps a counter as it starts and again as it
+// finishes, so an odd count means it's running, and a count
+// that has changed means it has finished the call it was in.
+
+// None of the dspGraph functions other than the callback may be
+// called on more than one thread at a time; Racket's thread is
+// the only one that should call them.
+
+#define DSP_MAX_INPUTS 32
+
+#define DSP_SINK 0
+#define DSP_SOUND 1
+#define DSP_RING 2
+#define DSP_INPUT 3
+#define DSP_GAIN 4
+#define DSP_PAN 5
+#define DSP_BIQUAD 6
+#define DSP_MIXER 7
+#define DSP_TYPES 8
+
+// error codes, for Racket:
+#define DSP_OK 0
+#define DSP_NO_MEMORY (-1)
+#define DSP_BAD_NODE (-2)
+#define DSP_TOO_MANY_INPUTS (-3)
+#define DSP_CYCLE (-4)
+
+// a sound that may be played by any number of sound nodes.
+// Freed when the last reference is released.
+typedef struct soundHandle{
+  int refs;
+  unsigned long frames;
+  short *samples;
+} soundHandle;
+
+typedef struct dspNode{
+  int id;
+  int type;
+  int removed;
+  // this node's output for the current block:
+  float *out;
+
+  // edited by Racket, and copied into the schedule by compile:
+  int inputs[DSP_MAX_INPUTS];
+  int numInputs;
+
+  // parameters; written by Racket, read by the callback.
+  float gain;
+  float panLeft;
+  float panRight;
+  // biquad coefficients (b0 b1 b2 a1 a2), published the way
+  // ramp.c publishes ramps: 'coeffGeneration' is odd while Racket
+  // is writing, and the callback only takes coefficients that it
+  // saw the same even generation on both before and after copying.
+  float pendingCoeffs[5];
+  unsigned int coeffGeneration;
+
+  // state; only touched by the callback.
+  float coeffs[5];
+  unsigned int seenCoeffGeneration;
+  float z[CHANNELS][2];
+  unsigned long pos;
+  int seenStarts;
+
+  // sources:
+  soundHandle *sound;
+  int loop;
+  int starts;
+  soundStreamInfo *ring;
+  short *ringBuffer;
+} dspNode;
+
+typedef struct dspGraph dspGraph;
+typedef struct dspStep dspStep;
+
+typedef void (*dspKernel)(dspGraph *g, dspStep *step, unsigned long frames);
+
+struct dspStep{
+  dspKernel kernel;
+  dspNode *node;
+  int numInputs;
+  dspNode *inputs[DSP_MAX_INPUTS];
+};
+
+typedef struct dspSchedule{
+  int numSteps;
+  dspStep *steps;
+} dspSchedule;
+
+// something the callback may still be using, and what to do
+// with it once it isn't.
+typedef struct dspRetired{
+  struct dspRetired *next;
+  void *ptr;
+  void (*release)(void *ptr);
+  unsigned long seq;
+} dspRetired;
+
+struct dspGraph{
+  unsigned long maxFrames;
+  dspNode **nodes;
+  int numNodes;
+  int capacity;
+  dspSchedule *schedule;
+  // odd while the callback is running:
+  unsigned long callbackSeq;
+  dspRetired *retired;
+  // where the current block comes from and goes to; only used
+  // by the callback.
+  const short *blockInput;
+  short *blockOutput;
+};
+
+
+// SOUND HANDLES
+
+soundHandle *soundHandleNew(const short *samples, unsigned long frames){
+  soundHandle *h = (soundHandle *)arenaAlloc(sizeof(soundHandle));
+  if (h == NULL) {
+    return NULL;
+  }
+  h->samples = (short *)arenaAlloc(MYMAX(FRAMES_TO_BYTES(frames), 1));
+  if (h->samples == NULL) {
+    arenaFree(h);
+    return NULL;
+  }
+  memcpy(h->samples, samples, FRAMES_TO_BYTES(frames));
+  h->frames = frames;
+  h->refs = 1;
+  return h;
+}
+
+static void soundHandleRetain(soundHandle *h){
+  RS_ATOMIC_ADD(&h->refs, 1);
+}
+
+void soundHandleRelease(soundHandle *h){
+  if (RS_ATOMIC_ADD(&h->refs, -1) == 1) {
+    arenaFree(h->samples);
+    arenaFree(h);
+  }
+}
+
+static void releaseSound(void *p){
+  soundHandleRelease((soundHandle *)p);
+}
+
+
+// DEFERRED FREEING
+
+// hand something to the retired list; it'll be released once the
+// callback can't be using it any more.
+static int retire(dspGraph *g, void *ptr, void (*release)(void *)){
+  dspRetired *r = (dspRetired *)malloc(sizeof(dspRetired));
+  if (r == NULL) {
+    return 0;
+  }
+  // the caller has already unhooked ptr from everything the
+  // callback can see; the fence makes sure that happened before
+  // we look at the counter.
+  RS_FENCE();
+  r->seq = RS_ATOMIC_LOAD(&g->callbackSeq);
+  r->ptr = ptr;
+  r->release = release;
+  r->next = g->retired;
+  g->retired = r;
+  return 1;
+}
+
+// release everything that the callback is done with.
+static void reclaim(dspGraph *g){
+  dspRetired **p = &g->retired;
+  dspRetired *r;
+  unsigned long seq = RS_ATOMIC_LOAD(&g->callbackSeq);
+  while (*p != NULL) {
+    r = *p;
+    if ((r->seq % 2) == 0 || r->seq != seq) {
+      *p = r->next;
+      r->release(r->ptr);
+      free(r);
+    } else {
+      p = &(r->next);
+    }
+  }
+}
+
+static void freeSchedule(void *p){
+  dspSchedule *s = (dspSchedule *)p;
+  arenaFree(s->steps);
+  arenaFree(s);
+}
+
+static void freeNode(void *p){
+  dspNode *n = (dspNode *)p;
+  if (n->sound != NULL) {
+    soundHandleRelease(n->sound);
+  }
+  arenaFree(n->ringBuffer);
+  arenaFree(n->out);
+  arenaFree(n);
+}
+
+
+// KERNELS
+
+// the float that corresponds to a sample of 32767, as in the other
+// callbacks (and kernels.c), so that a sound that goes through the
+// graph untouched comes out as it went in:
+#define DSP_FULL_SCALE 32767.0f
+
+static void s16ToFloat(float *dst, const short *src, unsigned long samples){
+  unsigned long i;
+  for (i = 0; i < samples; i++) {
+    dst[i] = (float)src[i] * (1.0f / DSP_FULL_SCALE);
+  }
+}
+
+static void zeroKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  memset(step->node->out, 0, frames * CHANNELS * sizeof(float));
+}
+
+static void soundKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  dspNode *n = step->node;
+  soundHandle *h = (soundHandle *)RS_ATOMIC_LOAD_PTR(&n->sound);
+  int starts = RS_ATOMIC_LOAD(&n->starts);
+  unsigned long done = 0;
+  unsigned long chunk;
+
+  if (starts != n->seenStarts) {
+    n->seenStarts = starts;
+    n->pos = 0;
+  }
+  while (h != NULL && done < frames && h->frames > 0) {
+    if (n->pos >= h->frames) {
+      if (!n->loop) {
+        break;
+      }
+      n->pos = 0;
+    }
+    chunk = MYMIN(frames - done, h->frames - n->pos);
+    s16ToFloat(n->out + done * CHANNELS, h->samples + n->pos * CHANNELS, chunk * CHANNELS);
+    n->pos += chunk;
+    done += chunk;
+  }
+  memset(n->out + done * CHANNELS, 0, (frames - done) * CHANNELS * sizeof(float));
+}
+
+static void ringKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  dspNode *n = step->node;
+  soundStreamInfo *ssi = (soundStreamInfo *)RS_ATOMIC_LOAD_PTR(&n->ring);
+  if (ssi == NULL) {
+    zeroKernel(g, step, frames);
+    return;
+  }
+  // the streaming callback already knows how to read a ring:
+  streamingCallback(NULL, n->ringBuffer, frames, NULL, 0, ssi);
+  s16ToFloat(n->out, n->ringBuffer, frames * CHANNELS);
+}
+
+static void inputKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  if (g->blockInput == NULL) {
+    zeroKernel(g, step, frames);
+    return;
+  }
+  s16ToFloat(step->node->out, g->blockInput, frames * CHANNELS);
+}
+
+static void gainKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  float *out = step->node->out;
+  const float *in;
+  float gain = step->node->gain;
+  unsigned long i;
+  if (step->numInputs == 0) {
+    zeroKernel(g, step, frames);
+    return;
+  }
+  in = step->inputs[0]->out;
+  for (i = 0; i < frames * CHANNELS; i++) {
+    out[i] = in[i] * gain;
+  }
+}
+
+static void panKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  float *out = step->node->out;
+  const float *in;
+  float left = step->node->panLeft;
+  float right = step->node->panRight;
+  unsigned long i;
+  if (step->numInputs == 0) {
+    zeroKernel(g, step, frames);
+    return;
+  }
+  in = step->inputs[0]->out;
+  for (i = 0; i < frames; i++) {
+    out[2*i] = in[2*i] * left;
+    out[2*i+1] = in[2*i+1] * right;
+  }
+}
+
+// take the coefficients Racket last set, if it isn't in the middle
+// of setting them; otherwise keep the ones we have until the next
+// block.
+static void pollBiquad(dspNode *n){
+  unsigned int before = RS_ATOMIC_LOAD(&n->coeffGeneration);
+  unsigned int after;
+  float next[5];
+  int k;
+  if (before == n->seenCoeffGeneration || (before & 1)) {
+    return;
+  }
+  for (k = 0; k < 5; k++) {
+    next[k] = n->pendingCoeffs[k];
+  }
+  RS_FENCE();
+  after = RS_ATOMIC_LOAD(&n->coeffGeneration);
+  if (after != before) {
+    return;
+  }
+  for (k = 0; k < 5; k++) {
+    n->coeffs[k] = next[k];
+  }
+  n->seenCoeffGeneration = before;
+}
+
+// transposed direct form II, one channel at a time.
+static void biquadKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  dspNode *n = step->node;
+  float *out = n->out;
+  const float *in;
+  float b0, b1, b2, a1, a2;
+  float x, y, z1, z2;
+  unsigned long i;
+  int ch;
+  pollBiquad(n);
+  b0 = n->coeffs[0];
+  b1 = n->coeffs[1];
+  b2 = n->coeffs[2];
+  a1 = n->coeffs[3];
+  a2 = n->coeffs[4];
+  if (step->numInputs == 0) {
+    zeroKernel(g, step, frames);
+    return;
+  }
+  in = step->inputs[0]->out;
+  for (ch = 0; ch < CHANNELS; ch++) {
+    z1 = n->z[ch][0];
+    z2 = n->z[ch][1];
+    for (i = 0; i < frames; i++) {
+      x = in[i*CHANNELS+ch];
+      y = b0 * x + z1;
+      z1 = b1 * x - a1 * y + z2;
+      z2 = b2 * x - a2 * y;
+      out[i*CHANNELS+ch] = y;
+    }
+    n->z[ch][0] = z1;
+    n->z[ch][1] = z2;
+  }
+}
+
+static void mixerKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  float *out = step->node->out;
+  const float *in;
+  unsigned long i;
+  int k;
+  zeroKernel(g, step, frames);
+  for (k = 0; k < step->numInputs; k++) {
+    in = step->inputs[k]->out;
+    for (i = 0; i < frames * CHANNELS; i++) {
+      out[i] += in[i];
+    }
+  }
+}
+
+static void sinkKernel(dspGraph *g, dspStep *step, unsigned long frames){
+  short *dst = g->blockOutput;
+  const float *in;
+  unsigned long i;
+  if (step->numInputs == 0) {
+    memset(dst, 0, FRAMES_TO_BYTES(frames));
+    return;
+  }
+  in = step->inputs[0]->out;
+  for (i = 0; i < frames * CHANNELS; i++) {
+    dst[i] = rsToSampleF(in[i] * DSP_FULL_SCALE);
+  }
+}
+
+static dspKernel kernels[DSP_TYPES] = {
+  sinkKernel, soundKernel, ringKernel, inputKernel,
+  gainKernel, panKernel, biquadKernel, mixerKernel
+};
+
+
+// THE CALLBACK
+
+// a portaudio callback that runs the graph passed as its userData.
+// NB: no allocation, no locking.
+int dspGraphCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  dspGraph *g = (dspGraph *)userData;
+  dspSchedule *s;
+  unsigned long done = 0;
+  unsigned long frames;
+  int i;
+
+  RS_ATOMIC_ADD(&g->callbackSeq, 1);
+  RS_FENCE();
+  s = (dspSchedule *)RS_ATOMIC_LOAD_PTR(&g->schedule);
+  if (s == NULL) {
+    memset(output, 0, FRAMES_TO_BYTES(frameCount));
+  } else {
+    while (done < frameCount) {
+      frames = MYMIN(frameCount - done, g->maxFrames);
+      g->blockInput = (input == NULL) ? NULL : (const short *)input + done * CHANNELS;
+      g->blockOutput = (short *)output + done * CHANNELS;
+      for (i = 0; i < s->numSteps; i++) {
+        s->steps[i].kernel(g, &s->steps[i], frames);
+      }
+      done += frames;
+    }
+  }
+  RS_ATOMIC_ADD(&g->callbackSeq, 1);
+  return paContinue;
+}
+
+
+// BUILDING THE GRAPH
+
+static dspNode *lookup(dspGraph *g, int id){
+  if (id < 0 || id >= g->numNodes || g->nodes[id] == NULL || g->nodes[id]->removed) {
+    return NULL;
+  }
+  return g->nodes[id];
+}
+
+// add a node of the given type, returning its id, or a negative
+// error code.
+int dspGraphAddNode(dspGraph *g, int type){
+  dspNode *n;
+  dspNode **bigger;
+  int newCapacity;
+
+  if (type <= DSP_SINK || type >= DSP_TYPES) {
+    return DSP_BAD_NODE;
+  }
+  reclaim(g);
+  if (g->numNodes == g->capacity) {
+    newCapacity = g->capacity * 2;
+    bigger = (dspNode **)realloc(g->nodes, newCapacity * sizeof(dspNode *));
+    if (bigger == NULL) {
+      return DSP_NO_MEMORY;
+    }
+    g->nodes = bigger;
+    g->capacity = newCapacity;
+  }
+  n = (dspNode *)arenaCalloc(sizeof(dspNode));
+  if (n == NULL) {
+    return DSP_NO_MEMORY;
+  }
+  n->out = (float *)arenaCalloc(g->maxFrames * CHANNELS * sizeof(float));
+  if (type == DSP_RING) {
+    n->ringBuffer = (short *)arenaCalloc(FRAMES_TO_BYTES(g->maxFrames));
+  }
+  if (n->out == NULL || (type == DSP_RING && n->ringBuffer == NULL)) {
+    freeNode(n);
+    return DSP_NO_MEMORY;
+  }
+  n->type = type;
+  n->id = g->numNodes;
+  n->gain = 1.0f;
+  n->panLeft = 1.0f;
+  n->panRight = 1.0f;
+  n->pendingCoeffs[0] = 1.0f;
+  n->coeffs[0] = 1.0f;
+  g->nodes[g->numNodes] = n;
+  g->numNodes += 1;
+  return n->id;
+}
+
+dspGraph *dspGraphNew(unsigned long maxFrames){
+  dspGraph *g;
+  if (maxFrames == 0) {
+    return NULL;
+  }
+  g = (dspGraph *)calloc(1, sizeof(dspGraph));
+  if (g == NULL) {
+    return NULL;
+  }
+  g->maxFrames = maxFrames;
+  g->capacity = 16;
+  g->nodes = (dspNode **)calloc(g->capacity, sizeof(dspNode *));
+  if (g->nodes == NULL) {
+    free(g);
+    return NULL;
+  }
+  // the sink is always node 0:
+  g->nodes[0] = (dspNode *)arenaCalloc(sizeof(dspNode));
+  if (g->nodes[0] == NULL) {
+    free(g->nodes);
+    free(g);
+    return NULL;
+  }
+  g->nodes[0]->type = DSP_SINK;
+  g->numNodes = 1;
+  return g;
+}
+
+// feed 'from' into 'to'. Gain, pan, biquad and the sink take a
+// single input, so connecting to them replaces the old one.
+int dspGraphConnect(dspGraph *g, int from, int to){
+  dspNode *src = lookup(g, from);
+  dspNode *dst = lookup(g, to);
+  int i;
+  if (src == NULL || dst == NULL || src->type == DSP_SINK) {
+    return DSP_BAD_NODE;
+  }
+  switch (dst->type) {
+  case DSP_MIXER:
+    for (i = 0; i < dst->numInputs; i++) {
+      if (dst->inputs[i] == from) {
+        return DSP_OK;
+      }
+    }
+    if (dst->numInputs == DSP_MAX_INPUTS) {
+      return DSP_TOO_MANY_INPUTS;
+    }
+    dst->inputs[dst->numInputs] = from;
+    dst->numInputs += 1;
+    return DSP_OK;
+  case DSP_SINK:
+  case DSP_GAIN:
+  case DSP_PAN:
+  case DSP_BIQUAD:
+    dst->inputs[0] = from;
+    dst->numInputs = 1;
+    return DSP_OK;
+  default:
+    // sources don't take inputs
+    return DSP_BAD_NODE;
+  }
+}
+
+int dspGraphDisconnect(dspGraph *g, int from, int to){
+  dspNode *dst = lookup(g, to);
+  int i;
+  if (dst == NULL) {
+    return DSP_BAD_NODE;
+  }
+  for (i = 0; i < dst->numInputs; i++) {
+    if (dst->inputs[i] == from) {
+      dst->inputs[i] = dst->inputs[dst->numInputs - 1];
+      dst->numInputs -= 1;
+      break;
+    }
+  }
+  return DSP_OK;
+}
+
+// remove a node and all of its connections. It's freed once it's no
+// longer part of the schedule the callback is running.
+int dspGraphRemoveNode(dspGraph *g, int id){
+  dspNode *n = lookup(g, id);
+  int i;
+  if (n == NULL || n->type == DSP_SINK) {
+    return DSP_BAD_NODE;
+  }
+  for (i = 0; i < g->numNodes; i++) {
+    if (g->nodes[i] != NULL) {
+      dspGraphDisconnect(g, id, i);
+    }
+  }
+  n->removed = 1;
+  return DSP_OK;
+}
+
+int dspGraphSetGain(dspGraph *g, int id, double gain){
+  dspNode *n = lookup(g, id);
+  if (n == NULL || n->type != DSP_GAIN) {
+    return DSP_BAD_NODE;
+  }
+  n->gain = (float)gain;
+  return DSP_OK;
+}
+
+// left and right are gains; Racket works out the pan law.
+int dspGraphSetPan(dspGraph *g, int id, double left, double right){
+  dspNode *n = lookup(g, id);
+  if (n == NULL || n->type != DSP_PAN) {
+    return DSP_BAD_NODE;
+  }
+  n->panLeft = (float)left;
+  n->panRight = (float)right;
+  return DSP_OK;
+}
+
+// coefficients normalized so that a0 = 1.
+int dspGraphSetBiquad(dspGraph *g, int id,
+                      double b0, double b1, double b2,
+                      double a1, double a2){
+  dspNode *n = lookup(g, id);
+  unsigned int gen;
+  if (n == NULL || n->type != DSP_BIQUAD) {
+    return DSP_BAD_NODE;
+  }
+  gen = n->coeffGeneration;
+  RS_ATOMIC_STORE(&n->coeffGeneration, gen+1);
+  RS_FENCE();
+  n->pendingCoeffs[0] = (float)b0;
+  n->pendingCoeffs[1] = (float)b1;
+  n->pendingCoeffs[2] = (float)b2;
+  n->pendingCoeffs[3] = (float)a1;
+  n->pendingCoeffs[4] = (float)a2;
+  RS_ATOMIC_STORE(&n->coeffGeneration, gen+2);
+  return DSP_OK;
+}
+
+// start the given sound node playing the given sound from the
+// beginning. The node keeps its own reference to the sound.
+int dspGraphSetSound(dspGraph *g, int id, soundHandle *h, int loop){
+  dspNode *n = lookup(g, id);
+  soundHandle *old;
+  if (n == NULL || n->type != DSP_SOUND) {
+    return DSP_BAD_NODE;
+  }
+  reclaim(g);
+  if (h != NULL) {
+    soundHandleRetain(h);
+  }
+  old = n->sound;
+  n->loop = loop;
+  RS_ATOMIC_STORE_PTR(&n->sound, h);
+  RS_ATOMIC_ADD(&n->starts, 1);
+  if (old != NULL && !retire(g, old, releaseSound)) {
+    // better to leak it than to free it under the callback.
+    return DSP_NO_MEMORY;
+  }
+  return DSP_OK;
+}
+
+// read the given node's output from a streaming ring, filled by
+// Racket as usual. The ring must outlive the graph.
+int dspGraphSetRing(dspGraph *g, int id, soundStreamInfo *ssi){
+  dspNode *n = lookup(g, id);
+  if (n == NULL || n->type != DSP_RING) {
+    return DSP_BAD_NODE;
+  }
+  RS_ATOMIC_STORE_PTR(&n->ring, ssi);
+  return DSP_OK;
+}
+
+// has the given sound node played to the end of its sound?
+int dspGraphSoundDone(dspGraph *g, int id){
+  dspNode *n = lookup(g, id);
+  soundHandle *h;
+  if (n == NULL || n->type != DSP_SOUND) {
+    return 1;
+  }
+  h = n->sound;
+  return h == NULL || (!n->loop && RS_ATOMIC_LOAD(&n->starts) == RS_ATOMIC_LOAD(&n->seenStarts)
+                       && n->pos >= h->frames);
+}
+
+// depth-first, so that each node lands after all of its inputs.
+// marks: 0 = unvisited, 1 = in progress, 2 = done.
+static int visit(dspGraph *g, int id, char *marks, int *order, int *count){
+  dspNode *n = g->nodes[id];
+  int i, err;
+  if (marks[id] == 2) {
+    return DSP_OK;
+  }
+  if (marks[id] == 1) {
+    return DSP_CYCLE;
+  }
+  marks[id] = 1;
+  for (i = 0; i < n->numInputs; i++) {
+    err = visit(g, n->inputs[i], marks, order, count);
+    if (err != DSP_OK) {
+      return err;
+    }
+  }
+  marks[id] = 2;
+  order[*count] = id;
+  *count += 1;
+  return DSP_OK;
+}
+
+// turn the graph into a schedule and hand it to the callback.
+// Nodes that don't feed the sink aren't run at all.
+int dspGraphCompile(dspGraph *g){
+  char *marks;
+  int *order;
+  int count = 0;
+  int err;
+  int i, k;
+  dspSchedule *s;
+  dspSchedule *old;
+  dspNode *n;
+
+  reclaim(g);
+  marks = (char *)calloc(g->numNodes, 1);
+  order = (int *)malloc(g->numNodes * sizeof(int));
+  if (marks == NULL || order == NULL) {
+    free(marks);
+    free(order);
+    return DSP_NO_MEMORY;
+  }
+  err = visit(g, 0, marks, order, &count);
+  free(marks);
+  if (err != DSP_OK) {
+    free(order);
+    return err;
+  }
+  s = (dspSchedule *)arenaAlloc(sizeof(dspSchedule));
+  if (s != NULL) {
+    s->steps = (dspStep *)arenaAlloc(count * sizeof(dspStep));
+  }
+  if (s == NULL || s->steps == NULL) {
+    arenaFree(s);
+    free(order);
+    return DSP_NO_MEMORY;
+  }
+  s->numSteps = count;
+  for (i = 0; i < count; i++) {
+    n = g->nodes[order[i]];
+    s->steps[i].kernel = kernels[n->type];
+    s->steps[i].node = n;
+    s->steps[i].numInputs = n->numInputs;
+    for (k = 0; k < n->numInputs; k++) {
+      s->steps[i].inputs[k] = g->nodes[n->inputs[k]];
+    }
+  }
+  free(order);
+
+  old = g->schedule;
+  RS_ATOMIC_STORE_PTR(&g->schedule, s);
+  if (old != NULL && !retire(g, old, freeSchedule)) {
+    return DSP_NO_MEMORY;
+  }
+  // removed nodes can't be in the new schedule, so once the old
+  // one is done with, so are they.
+  for (i = 0; i < g->numNodes; i++) {
+    n = g->nodes[i];
+    if (n != NULL && n->removed && retire(g, n, freeNode)) {
+      g->nodes[i] = NULL;
+    }
+  }
+  return DSP_OK;
+}
+
+// free the graph and everything in it. The stream using it must
+// already be closed.
+void dspGraphFree(dspGraph *g){
+  dspRetired *r;
+  int i;
+  while (g->retired != NULL) {
+    r = g->retired;
+    g->retired = r->next;
+    r->release(r->ptr);
+    free(r);
+  }
+  if (g->schedule != NULL) {
+    freeSchedule(g->schedule);
+  }
+  for (i = 0; i < g->numNodes; i++) {
+    if (g->nodes[i] != NULL) {
+      freeNode(g->nodes[i]);
+    }
+  }
+  free(g->nodes);
+  free(g);
+}
@@ -0,0 +1,61 @@
+#ifndef RSOUND_JITTER_PACKET_H
+#define RSOUND_JITTER_PACKET_H
+
+// The packets a jitter buffer (see jitter.c and jitter-buffer.rkt)
+// reads from a socket: a header, then the samples, 16-bit signed, two
+// interleaved channels, in the host's byte order (the sender is on
+// the same host). One packet per datagram.
+
+// Unlike callbacks.h, this header is meant to be included by senders;
+// it doesn't depend on anything else here.
+
+// The timestamp is the stream position of the packet's first frame,
+// in frames. It wraps around at 2^32; the jitter buffer only ever
+// compares timestamps that are close together. Packets may arrive
+// late, out of order, twice, or not at all.
+
+#include <stdint.h>
+#include <string.h>
+
+#define JITTER_PACKET_MAGIC 0x4b50424au
+#define JITTER_PACKET_VERSION 1
+#define JITTER_PACKET_CHANNELS 2
+#define JITTER_PACKET_FRAME_BYTES (JITTER_PACKET_CHANNELS * 2)
+// no packet may hold more frames than this:
+#define JITTER_PACKET_MAX_FRAMES 4096
+
+typedef struct jitterPacketHeader{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t channels;
+  uint32_t timestamp;
+  uint32_t frames;
+} jitterPacketHeader;
+
+// the bytes in a packet of the given number of frames.
+static inline size_t jitterPacketBytes(uint32_t frames){
+  return sizeof(jitterPacketHeader) + (size_t)frames * JITTER_PACKET_FRAME_BYTES;
+}
+
+// fill in a header; the samples go right after it.
+static inline void jitterPacketInit(jitterPacketHeader *h, uint32_t timestamp,
+                                    uint32_t frames){
+  h->magic = JITTER_PACKET_MAGIC;
+  h->version = JITTER_PACKET_VERSION;
+  h->channels = JITTER_PACKET_CHANNELS;
+  h->timestamp = timestamp;
+  h->frames = frames;
+}
+
+// is this a well-formed packet of the given length?
+static inline int jitterPacketValid(const jitterPacketHeader *h, size_t bytes){
+  return bytes >= sizeof(jitterPacketHeader)
+    && h->magic == JITTER_PACKET_MAGIC
+    && h->version == JITTER_PACKET_VERSION
+    && h->channels == JITTER_PACKET_CHANNELS
+    && h->frames > 0
+    && h->frames <= JITTER_PACKET_MAX_FRAMES
+    && bytes == jitterPacketBytes(h->frames);
+}
+
+#endif
@@ -0,0 +1,582 @@
+#include <math.h>
+#include "callbacks.h"
+#include "jitter-packet.h"
+
+#ifndef WIN32
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# include <unistd.h>
+#endif
+
+// This file provides jitter buffers: a source for an output stream
+// that plays timestamped packets of sound as they arrive from
+// somewhere else on the same host, whether pushed from Racket
+// (jitterPush) or read from a socket by a native thread of the
+// buffer's own (jitterListen). The packets are put in order by their
+// timestamps, and the callback (jitterCallback) plays them at a delay
+// that it adapts to how unevenly they arrive.
+
+// Each packet goes in a slot of its own. A slot is FREE, FILLING
+// (a producer is copying a packet in), or READY; producers only take
+// FREE slots, under the producer lock, and the callback only frees
+// READY ones, so the callback needs no lock.
+
+// The delay: producers estimate the jitter of the arrivals (as RTP
+// does, RFC 3550), and aim for a delay of a packet plus four times
+// that, between the floor and the ceiling Racket sets. The callback
+// waits until that much is buffered before it starts, skips ahead
+// when far more than that is buffered, and when it runs out, holds
+// its place (so the delay grows by the time it waited).
+
+// Where a packet is missing, the callback conceals the gap by
+// playing the last of what it played before, over and over, fading
+// out; a packet that arrives after its place was played is late, and
+// dropped. The concealment is simple: there's no attempt to match
+// the pitch, or to fade the real sound back in.
+
+// a jitter buffer holds at most this many packets:
+#define JITTER_SLOTS 128
+// the frames the callback remembers, for concealment; also the
+// length of the piece that's repeated:
+#define JITTER_HISTORY 256
+// concealment fades out over this many frames:
+#define JITTER_FADE_FRAMES 2048
+// the reader thread looks for a stop request this often:
+#define JITTER_POLL_MILLIS 20
+
+#define SLOT_FREE 0
+#define SLOT_FILLING 1
+#define SLOT_READY 2
+
+// must agree with jitter-buffer-push! in jitter-buffer.rkt:
+#define PUSH_ACCEPTED 0
+#define PUSH_LATE 1
+#define PUSH_DUPLICATE 2
+#define PUSH_OVERFLOW 3
+#define PUSH_BAD 4
+
+typedef struct jitterSlot{
+  int state;
+  unsigned int timestamp;
+  unsigned int frames;
+  short *samples;
+} jitterSlot;
+
+// must agree with _jitter-stats in jitter-buffer.rkt.
+typedef struct jitterStats{
+  // mutated only by producers:
+  unsigned long packets;
+  unsigned long framesReceived;
+  unsigned long latePackets;
+  unsigned long lateFrames;
+  unsigned long duplicatePackets;
+  // no free slot for it:
+  unsigned long overflowPackets;
+  // malformed, from a socket:
+  unsigned long badPackets;
+  // mutated only by the callback:
+  unsigned long framesPlayed;
+  // frames whose packets never came in time:
+  unsigned long lostFrames;
+  unsigned long concealedFrames;
+  // skipped to bring the delay down:
+  unsigned long skippedFrames;
+  // times the callback ran out of packets:
+  unsigned long underruns;
+  // in seconds:
+  double jitter;
+  double targetDelay;
+  double delay;
+} jitterStats;
+
+typedef struct jitterBuffer{
+  double sampleRate;
+  unsigned int minDelayFrames;
+  unsigned int maxDelayFrames;
+  unsigned int maxPacketFrames;
+  jitterSlot slots[JITTER_SLOTS];
+
+  // set by producers, read by the callback:
+  unsigned int targetFrames;
+
+  // only touched by the callback:
+  int playing;
+  int empty;
+  unsigned int playPosition;
+  short history[JITTER_HISTORY * CHANNELS];
+  unsigned int historyPos;
+  unsigned int historyFrames;
+  unsigned int concealPos;
+
+  // producers' state, under the lock:
+  rsMutex lock;
+  int haveArrival;
+  double lastArrival;
+  unsigned int lastTimestamp;
+  double jitterFrames;
+
+  // the reader thread, if any, and its socket:
+  rsThread thread;
+  int threadStarted;
+  int stopRequested;
+  int fd;
+
+  int refs;
+  jitterStats stats;
+} jitterBuffer;
+
+// signed distance from b to a, for timestamps that may wrap around:
+static int tsDiff(unsigned int a, unsigned int b){
+  return (int)(a - b);
+}
+
+// a jitter buffer for a stream at the given rate, whose delay stays
+// between the given bounds, taking packets of at most the given
+// size. It holds one reference, Racket's. Returns NULL if there's no
+// memory. Called only by Racket.
+jitterBuffer *jitterNew(double sampleRate, unsigned int minDelayFrames,
+                        unsigned int maxDelayFrames, unsigned int maxPacketFrames){
+  jitterBuffer *jb;
+  int i;
+  if (maxPacketFrames == 0 || maxPacketFrames > JITTER_PACKET_MAX_FRAMES) {
+    return NULL;
+  }
+  jb = (jitterBuffer *)arenaCalloc(sizeof(jitterBuffer));
+  if (jb == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < JITTER_SLOTS; i++) {
+    jb->slots[i].samples = (short *)arenaAlloc(FRAMES_TO_BYTES(maxPacketFrames));
+    if (jb->slots[i].samples == NULL) {
+      while (i-- > 0) {
+        arenaFree(jb->slots[i].samples);
+      }
+      arenaFree(jb);
+      return NULL;
+    }
+  }
+  jb->sampleRate = sampleRate;
+  jb->minDelayFrames = minDelayFrames;
+  jb->maxDelayFrames = MYMAX(maxDelayFrames, minDelayFrames);
+  jb->maxPacketFrames = maxPacketFrames;
+  jb->targetFrames = jb->minDelayFrames;
+  jb->stats.targetDelay = jb->minDelayFrames / sampleRate;
+  jb->fd = -1;
+  jb->refs = 1;
+  rsMutexInit(&jb->lock);
+  return jb;
+}
+
+// PRODUCERS
+
+// note the packet's arrival, and move the target delay. The caller
+// holds the lock.
+static void noteArrival(jitterBuffer *jb, unsigned int timestamp, unsigned int frames){
+  double arrival = rsMonotonicSeconds() * jb->sampleRate;
+  double d;
+  double target;
+  if (jb->haveArrival) {
+    d = (arrival - jb->lastArrival) - (double)tsDiff(timestamp, jb->lastTimestamp);
+    jb->jitterFrames += (fabs(d) - jb->jitterFrames) / 16.0;
+  }
+  jb->haveArrival = 1;
+  jb->lastArrival = arrival;
+  jb->lastTimestamp = timestamp;
+  target = frames + 4.0 * jb->jitterFrames;
+  target = MYMAX(target, (double)jb->minDelayFrames);
+  target = MYMIN(target, (double)jb->maxDelayFrames);
+  RS_ATOMIC_STORE(&jb->targetFrames, (unsigned int)target);
+  jb->stats.jitter = jb->jitterFrames / jb->sampleRate;
+  jb->stats.targetDelay = target / jb->sampleRate;
+}
+
+// add a packet; returns one of the PUSH_ codes. The caller holds the
+// lock.
+static int push(jitterBuffer *jb, unsigned int timestamp, const short *samples,
+                unsigned int frames){
+  int i;
+  int free = -1;
+  jitterSlot *s;
+  if (frames == 0 || frames > jb->maxPacketFrames) {
+    jb->stats.badPackets += 1;
+    return PUSH_BAD;
+  }
+  noteArrival(jb, timestamp, frames);
+  if (RS_ATOMIC_LOAD(&jb->playing)
+      && tsDiff(timestamp + frames, RS_ATOMIC_LOAD(&jb->playPosition)) <= 0) {
+    jb->stats.latePackets += 1;
+    jb->stats.lateFrames += frames;
+    return PUSH_LATE;
+  }
+  for (i = 0; i < JITTER_SLOTS; i++) {
+    s = &jb->slots[i];
+    if (RS_ATOMIC_LOAD(&s->state) == SLOT_READY) {
+      if (s->timestamp == timestamp) {
+        jb->stats.duplicatePackets += 1;
+        return PUSH_DUPLICATE;
+      }
+    } else if (free < 0) {
+      free = i;
+    }
+  }
+  if (free < 0) {
+    jb->stats.overflowPackets += 1;
+    return PUSH_OVERFLOW;
+  }
+  s = &jb->slots[free];
+  RS_ATOMIC_STORE(&s->state, SLOT_FILLING);
+  s->timestamp = timestamp;
+  s->frames = frames;
+  memcpy(s->samples, samples, FRAMES_TO_BYTES(frames));
+  // everything has to be there before the callback sees it:
+  RS_ATOMIC_STORE(&s->state, SLOT_READY);
+  jb->stats.packets += 1;
+  jb->stats.framesReceived += frames;
+  return PUSH_ACCEPTED;
+}
+
+// add a packet of sound (two interleaved channels) whose first frame
+// belongs at the given timestamp. Returns one of the PUSH_ codes.
+int jitterPush(jitterBuffer *jb, unsigned int timestamp, const short *samples,
+               unsigned int frames){
+  int result;
+  rsMutexLock(&jb->lock);
+  result = push(jb, timestamp, samples, frames);
+  rsMutexUnlock(&jb->lock);
+  return result;
+}
+
+// THE CALLBACK
+
+// the ready slot holding the frame at 'position', or NULL.
+static jitterSlot *slotAt(jitterBuffer *jb, unsigned int position){
+  int i;
+  jitterSlot *s;
+  for (i = 0; i < JITTER_SLOTS; i++) {
+    s = &jb->slots[i];
+    if (RS_ATOMIC_LOAD(&s->state) == SLOT_READY
+        && tsDiff(position, s->timestamp) >= 0
+        && tsDiff(position, s->timestamp + s->frames) < 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+// free the slots that are wholly behind 'position', and find the
+// earliest timestamp at or after it and the latest end of any
+// packet. Returns the number of ready slots left.
+static int survey(jitterBuffer *jb, unsigned int position, int freeOld,
+                  unsigned int *earliest, unsigned int *latestEnd){
+  int i;
+  int ready = 0;
+  jitterSlot *s;
+  for (i = 0; i < JITTER_SLOTS; i++) {
+    s = &jb->slots[i];
+    if (RS_ATOMIC_LOAD(&s->state) != SLOT_READY) {
+      continue;
+    }
+    if (freeOld && tsDiff(s->timestamp + s->frames, position) <= 0) {
+      RS_ATOMIC_STORE(&s->state, SLOT_FREE);
+      continue;
+    }
+    if (ready == 0 || tsDiff(s->timestamp, *earliest) < 0) {
+      *earliest = s->timestamp;
+    }
+    if (ready == 0 || tsDiff(s->timestamp + s->frames, *latestEnd) > 0) {
+      *latestEnd = s->timestamp + s->frames;
+    }
+    ready++;
+  }
+  return ready;
+}
+
+static void remember(jitterBuffer *jb, const short *out, unsigned long frames){
+  unsigned long i;
+  for (i = 0; i < frames; i++) {
+    jb->history[jb->historyPos * CHANNELS] = out[i * CHANNELS];
+    jb->history[jb->historyPos * CHANNELS + 1] = out[i * CHANNELS + 1];
+    jb->historyPos = (jb->historyPos + 1) % JITTER_HISTORY;
+  }
+  jb->historyFrames = MYMIN(jb->historyFrames + frames, JITTER_HISTORY);
+  jb->concealPos = 0;
+}
+
+// fill 'out' with the end of what was played, repeated and fading.
+static void conceal(jitterBuffer *jb, short *out, unsigned long frames){
+  unsigned long i;
+  unsigned int start;
+  unsigned int at;
+  float gain;
+  if (jb->historyFrames == 0) {
+    memset(out, 0, FRAMES_TO_BYTES(frames));
+    return;
+  }
+  start = (jb->historyPos + JITTER_HISTORY - jb->historyFrames) % JITTER_HISTORY;
+  for (i = 0; i < frames; i++) {
+    if (jb->concealPos >= JITTER_FADE_FRAMES) {
+      out[i * CHANNELS] = 0;
+      out[i * CHANNELS + 1] = 0;
+      continue;
+    }
+    at = (start + jb->concealPos % jb->historyFrames) % JITTER_HISTORY;
+    gain = 1.0f - (float)jb->concealPos / JITTER_FADE_FRAMES;
+    out[i * CHANNELS] = rsToSampleF(jb->history[at * CHANNELS] * gain);
+    out[i * CHANNELS + 1] = rsToSampleF(jb->history[at * CHANNELS + 1] * gain);
+    jb->concealPos++;
+  }
+  jb->stats.concealedFrames += frames;
+}
+
+int jitterCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  jitterBuffer *jb = (jitterBuffer *)userData;
+  short *out = (short *)output;
+  unsigned long left = frameCount;
+  unsigned int target = RS_ATOMIC_LOAD(&jb->targetFrames);
+  unsigned int earliest = 0;
+  unsigned int latestEnd = 0;
+  unsigned int next;
+  unsigned long n;
+  int ready;
+  int excess;
+  jitterSlot *s;
+
+  ready = survey(jb, jb->playPosition, jb->playing, &earliest, &latestEnd);
+  if (!jb->playing) {
+    // wait until the target delay is buffered:
+    if (ready == 0 || tsDiff(latestEnd, earliest) < (int)target) {
+      memset(out, 0, FRAMES_TO_BYTES(frameCount));
+      return paContinue;
+    }
+    RS_ATOMIC_STORE(&jb->playPosition, earliest);
+    RS_ATOMIC_STORE(&jb->playing, 1);
+  }
+  if (ready > 0) {
+    // far too much buffered (e.g. after a burst): skip ahead.
+    excess = tsDiff(latestEnd, jb->playPosition) - (int)target
+      - (int)MYMAX(target / 2, frameCount);
+    if (excess > 0) {
+      RS_ATOMIC_STORE(&jb->playPosition, jb->playPosition + excess);
+      jb->stats.skippedFrames += excess;
+      survey(jb, jb->playPosition, 1, &earliest, &latestEnd);
+    }
+  }
+
+  while (left > 0) {
+    s = slotAt(jb, jb->playPosition);
+    if (s != NULL) {
+      n = MYMIN(left, (unsigned long)tsDiff(s->timestamp + s->frames, jb->playPosition));
+      memcpy(out, s->samples + tsDiff(jb->playPosition, s->timestamp) * CHANNELS,
+             FRAMES_TO_BYTES(n));
+      remember(jb, out, n);
+      jb->stats.framesPlayed += n;
+      jb->empty = 0;
+      RS_ATOMIC_STORE(&jb->playPosition, jb->playPosition + (unsigned int)n);
+      if (tsDiff(s->timestamp + s->frames, jb->playPosition) <= 0) {
+        RS_ATOMIC_STORE(&s->state, SLOT_FREE);
+      }
+    } else if (survey(jb, jb->playPosition, 1, &next, &latestEnd) > 0) {
+      // a gap, with packets after it: the missing ones are lost.
+      n = MYMIN(left, (unsigned long)tsDiff(next, jb->playPosition));
+      conceal(jb, out, n);
+      jb->stats.lostFrames += n;
+      RS_ATOMIC_STORE(&jb->playPosition, jb->playPosition + (unsigned int)n);
+    } else {
+      // nothing at all: hold our place until more comes.
+      n = left;
+      conceal(jb, out, n);
+      if (!jb->empty) {
+        jb->empty = 1;
+        jb->stats.underruns += 1;
+      }
+    }
+    out += n * CHANNELS;
+    left -= n;
+  }
+  ready = survey(jb, jb->playPosition, 1, &earliest, &latestEnd);
+  jb->stats.delay = (ready == 0)
+    ? 0.0
+    : MYMAX(0, tsDiff(latestEnd, jb->playPosition)) / jb->sampleRate;
+  return paContinue;
+}
+
+// SOCKETS
+
+// a datagram socket bound to the given UDP port on the loopback
+// interface (0 for any free port), or -1.
+int jitterOpenUdp(int port){
+#ifdef WIN32
+  return -1;
+#else
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+// the UDP port a socket is bound to, or -1.
+int jitterSocketPort(int fd){
+#ifdef WIN32
+  return -1;
+#else
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+#endif
+}
+
+// a Unix datagram socket bound to the given path (which mustn't
+// exist yet), or -1.
+int jitterOpenUnix(const char *path){
+#ifdef WIN32
+  return -1;
+#else
+  struct sockaddr_un addr;
+  int fd;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+// close a socket that never made it to jitterListen.
+void jitterCloseSocket(int fd){
+#ifndef WIN32
+  close(fd);
+#endif
+}
+
+#ifndef WIN32
+static void readerThread(void *arg){
+  jitterBuffer *jb = (jitterBuffer *)arg;
+  size_t bytes = jitterPacketBytes(JITTER_PACKET_MAX_FRAMES);
+  char *buf = (char *)malloc(bytes);
+  struct pollfd pfd;
+  ssize_t got;
+  jitterPacketHeader *h = (jitterPacketHeader *)buf;
+  if (buf == NULL) {
+    return;
+  }
+  pfd.fd = jb->fd;
+  pfd.events = POLLIN;
+  while (!RS_ATOMIC_LOAD(&jb->stopRequested)) {
+    if (poll(&pfd, 1, JITTER_POLL_MILLIS) <= 0) {
+      continue;
+    }
+    got = recv(jb->fd, buf, bytes, 0);
+    if (got < 0) {
+      continue;
+    }
+    rsMutexLock(&jb->lock);
+    if (jitterPacketValid(h, (size_t)got)) {
+      push(jb, h->timestamp, (const short *)(h + 1), h->frames);
+    } else {
+      jb->stats.badPackets += 1;
+    }
+    rsMutexUnlock(&jb->lock);
+  }
+  free(buf);
+}
+#endif
+
+// read packets from the given datagram socket (see jitter-packet.h)
+// on a thread of the buffer's own, until it's released. The buffer
+// closes the socket. Returns 0, or -1 if it's already listening or
+// the thread can't be started. Called only by Racket.
+int jitterListen(jitterBuffer *jb, int fd){
+#ifdef WIN32
+  return -1;
+#else
+  if (jb->threadStarted) {
+    return -1;
+  }
+  jb->fd = fd;
+  if (rsThreadCreate(&jb->thread, readerThread, jb) != 0) {
+    jb->fd = -1;
+    return -1;
+  }
+  jb->threadStarted = 1;
+  return 0;
+#endif
+}
+
+// LIFETIME
+
+void jitterGetStats(jitterBuffer *jb, jitterStats *out){
+  rsMutexLock(&jb->lock);
+  *out = jb->stats;
+  rsMutexUnlock(&jb->lock);
+}
+
+// a stream is about to play it.
+void jitterRetain(jitterBuffer *jb){
+  RS_ATOMIC_ADD(&jb->refs, 1);
+}
+
+static void dropReference(jitterBuffer *jb){
+  int i;
+  if (RS_ATOMIC_ADD(&jb->refs, -1) == 1) {
+    for (i = 0; i < JITTER_SLOTS; i++) {
+      arenaFree(jb->slots[i].samples);
+    }
+    rsMutexDestroy(&jb->lock);
+    arenaFree(jb);
+  }
+}
+
+// the finished callback of the stream playing it.
+void jitterStreamFinished(void *userData){
+  dropReference((jitterBuffer *)userData);
+}
+
+// drop Racket's reference, first stopping the reader thread, if any,
+// and closing its socket. Called only by Racket.
+void jitterRelease(jitterBuffer *jb){
+  if (jb->threadStarted) {
+    RS_ATOMIC_STORE(&jb->stopRequested, 1);
+    rsThreadJoin(jb->thread);
+    jb->threadStarted = 0;
+  }
+#ifndef WIN32
+  if (jb->fd >= 0) {
+    close(jb->fd);
+    jb->fd = -1;
+  }
+#endif
+  dropReference(jb);
+}
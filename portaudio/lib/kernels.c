@@ -0,0 +1,263 @@
+#include "callbacks.h"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+// This file provides bulk operations on sample buffers, for Racket
+// to call instead of looping over s16vectors and flvectors itself
+// (see sample-utils.rkt): mixing, scaling, converting between 16-bit
+// and floating-point samples, interleaving and de-interleaving, and
+// finding peaks. None of them are used by the callbacks.
+
+// Each has an SSE2 loop, eight samples at a time, and a plain loop
+// for the rest of the buffer and for other platforms. The two agree
+// to the sample: both clip, and round halves away from zero, as
+// rsToSample (in callbacks.h) does.
+
+// The buffers are all counted in samples, not frames; interleaved
+// buffers have CHANNELS samples per frame. None of them may overlap,
+// except that 'out' may be the same buffer as 'in' where a function
+// has both.
+
+// the floating-point sample that corresponds to 1.0:
+#define KERNEL_S16_MAX 32767.0
+
+static short saturate(int x){
+  if (x > 32767) {
+    return 32767;
+  } else if (x < -32768) {
+    return -32768;
+  } else {
+    return (short)x;
+  }
+}
+
+#ifdef __SSE2__
+// zero NaNs and clip to the range of a short, then round halves away
+// from zero by adding a half with the sample's sign and truncating.
+// (Without the first two steps, NaNs, huge values and infinities
+// would convert to the "integer indefinite" value, which packs makes
+// -32768.)
+static inline __m128i roundFloats(__m128 x){
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 signBit = _mm_set1_ps(-0.0f);
+  x = _mm_and_ps(x,_mm_cmpord_ps(x,x));
+  x = _mm_max_ps(_mm_set1_ps(-32768.0f),_mm_min_ps(_mm_set1_ps(32767.0f),x));
+  x = _mm_add_ps(x,_mm_or_ps(half,_mm_and_ps(x,signBit)));
+  return _mm_cvttps_epi32(x);
+}
+
+// the same for two doubles, which fill the low two ints.
+static inline __m128i roundDoubles(__m128d x){
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d signBit = _mm_set1_pd(-0.0);
+  x = _mm_and_pd(x,_mm_cmpord_pd(x,x));
+  x = _mm_max_pd(_mm_set1_pd(-32768.0),_mm_min_pd(_mm_set1_pd(32767.0),x));
+  x = _mm_add_pd(x,_mm_or_pd(half,_mm_and_pd(x,signBit)));
+  return _mm_cvttpd_epi32(x);
+}
+#endif
+
+// MIXING
+//
+// Mixing N buffers is two passes: each buffer is added into a
+// buffer of ints, and then the ints are clipped back to shorts, so
+// that the result is the clipped sum, however loud the parts are.
+
+// acc[i] = in[i] (if 'clear') or acc[i] + in[i] (if not).
+void kernelAccumulate(int *acc, const short *in, unsigned long samples, int clear){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128i raw, lo, hi;
+  for (; i + 8 <= samples; i += 8) {
+    raw = _mm_loadu_si128((const __m128i *)(in + i));
+    // sign-extend the shorts into ints
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw,raw),16);
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw,raw),16);
+    if (!clear) {
+      lo = _mm_add_epi32(lo,_mm_loadu_si128((const __m128i *)(acc + i)));
+      hi = _mm_add_epi32(hi,_mm_loadu_si128((const __m128i *)(acc + i + 4)));
+    }
+    _mm_storeu_si128((__m128i *)(acc + i),lo);
+    _mm_storeu_si128((__m128i *)(acc + i + 4),hi);
+  }
+#endif
+  for (; i < samples; i++) {
+    acc[i] = clear ? in[i] : acc[i] + in[i];
+  }
+}
+
+// out[i] = acc[i], clipped.
+void kernelSaturate(short *out, const int *acc, unsigned long samples){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= samples; i += 8) {
+    // packs saturates:
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(acc + i)),
+                                     _mm_loadu_si128((const __m128i *)(acc + i + 4))));
+  }
+#endif
+  for (; i < samples; i++) {
+    out[i] = saturate(acc[i]);
+  }
+}
+
+// GAIN
+
+// out[i] = in[i] * gain, rounded and clipped.
+void kernelGain(short *out, const short *in, unsigned long samples, double gain){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128 g = _mm_set1_ps((float)gain);
+  __m128i raw, lo, hi;
+  for (; i + 8 <= samples; i += 8) {
+    raw = _mm_loadu_si128((const __m128i *)(in + i));
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw,raw),16);
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw,raw),16);
+    lo = roundFloats(_mm_mul_ps(_mm_cvtepi32_ps(lo),g));
+    hi = roundFloats(_mm_mul_ps(_mm_cvtepi32_ps(hi),g));
+    _mm_storeu_si128((__m128i *)(out + i),_mm_packs_epi32(lo,hi));
+  }
+#endif
+  // in single precision, as the vector loop does:
+  for (; i < samples; i++) {
+    out[i] = rsToSampleF((float)in[i] * (float)gain);
+  }
+}
+
+// CONVERSION
+//
+// Floating-point samples are doubles (as in an flvector), with
+// 1.0 corresponding to 32767.
+
+void kernelS16ToDouble(double *out, const short *in, unsigned long samples){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128d scale = _mm_set1_pd(1.0 / KERNEL_S16_MAX);
+  __m128i raw, lo, hi;
+  for (; i + 8 <= samples; i += 8) {
+    raw = _mm_loadu_si128((const __m128i *)(in + i));
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw,raw),16);
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw,raw),16);
+    // two ints at a time become doubles:
+    _mm_storeu_pd(out + i,_mm_mul_pd(_mm_cvtepi32_pd(lo),scale));
+    _mm_storeu_pd(out + i + 2,_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(lo,8)),scale));
+    _mm_storeu_pd(out + i + 4,_mm_mul_pd(_mm_cvtepi32_pd(hi),scale));
+    _mm_storeu_pd(out + i + 6,_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(hi,8)),scale));
+  }
+#endif
+  for (; i < samples; i++) {
+    out[i] = in[i] * (1.0 / KERNEL_S16_MAX);
+  }
+}
+
+// rounded and clipped.
+void kernelDoubleToS16(short *out, const double *in, unsigned long samples){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128d scale = _mm_set1_pd(KERNEL_S16_MAX);
+  __m128i a, b, c, d;
+  for (; i + 8 <= samples; i += 8) {
+#define CONVERT_PAIR(k) \
+    roundDoubles(_mm_mul_pd(_mm_loadu_pd(in + i + (k)),scale))
+    a = CONVERT_PAIR(0);
+    b = CONVERT_PAIR(2);
+    c = CONVERT_PAIR(4);
+    d = CONVERT_PAIR(6);
+#undef CONVERT_PAIR
+    // each conversion fills the low two ints:
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_packs_epi32(_mm_unpacklo_epi64(a,b),_mm_unpacklo_epi64(c,d)));
+  }
+#endif
+  for (; i < samples; i++) {
+    out[i] = rsToSample(in[i] * KERNEL_S16_MAX);
+  }
+}
+
+// INTERLEAVING
+
+// 'frames' frames of stereo from two mono buffers.
+void kernelInterleave(short *out, const short *left, const short *right,
+                      unsigned long frames){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128i l, r;
+  for (; i + 8 <= frames; i += 8) {
+    l = _mm_loadu_si128((const __m128i *)(left + i));
+    r = _mm_loadu_si128((const __m128i *)(right + i));
+    _mm_storeu_si128((__m128i *)(out + i * CHANNELS),_mm_unpacklo_epi16(l,r));
+    _mm_storeu_si128((__m128i *)(out + i * CHANNELS + 8),_mm_unpackhi_epi16(l,r));
+  }
+#endif
+  for (; i < frames; i++) {
+    out[i * CHANNELS] = left[i];
+    out[i * CHANNELS + 1] = right[i];
+  }
+}
+
+// and back again.
+void kernelDeinterleave(short *left, short *right, const short *in,
+                        unsigned long frames){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128i a, b;
+  for (; i + 8 <= frames; i += 8) {
+    a = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS));
+    b = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS + 8));
+    // each int is a frame: the left sample in its low half and the
+    // right in its high half. The values fit, so packs just packs.
+    _mm_storeu_si128((__m128i *)(left + i),
+                     _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a,16),16),
+                                     _mm_srai_epi32(_mm_slli_epi32(b,16),16)));
+    _mm_storeu_si128((__m128i *)(right + i),
+                     _mm_packs_epi32(_mm_srai_epi32(a,16),_mm_srai_epi32(b,16)));
+  }
+#endif
+  for (; i < frames; i++) {
+    left[i] = in[i * CHANNELS];
+    right[i] = in[i * CHANNELS + 1];
+  }
+}
+
+// PEAKS
+
+// the largest absolute value of each channel in 'frames' frames of
+// stereo; peaks[0] is the left's and peaks[1] the right's. A sample
+// of -32768 has a peak of 32768.
+void kernelPeak(int *peaks, const short *in, unsigned long frames){
+  unsigned long i = 0;
+  int hi[2] = {0, 0};
+  int lo[2] = {0, 0};
+  int ch;
+#ifdef __SSE2__
+  // the lanes alternate left, right:
+  __m128i vmax = _mm_setzero_si128();
+  __m128i vmin = _mm_setzero_si128();
+  __m128i v;
+  short lanes[8];
+  int k;
+  for (; i + 4 <= frames; i += 4) {
+    v = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS));
+    vmax = _mm_max_epi16(vmax,v);
+    vmin = _mm_min_epi16(vmin,v);
+  }
+  _mm_storeu_si128((__m128i *)lanes,vmax);
+  for (k = 0; k < 8; k++) {
+    hi[k & 1] = MYMAX(hi[k & 1], lanes[k]);
+  }
+  _mm_storeu_si128((__m128i *)lanes,vmin);
+  for (k = 0; k < 8; k++) {
+    lo[k & 1] = MYMIN(lo[k & 1], lanes[k]);
+  }
+#endif
+  for (; i < frames; i++) {
+    for (ch = 0; ch < CHANNELS; ch++) {
+      hi[ch] = MYMAX(hi[ch], in[i * CHANNELS + ch]);
+      lo[ch] = MYMIN(lo[ch], in[i * CHANNELS + ch]);
+    }
+  }
+  peaks[0] = MYMAX(hi[0], -lo[0]);
+  peaks[1] = MYMAX(hi[1], -lo[1]);
+}
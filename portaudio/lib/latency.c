@@ -0,0 +1,220 @@
+#include "callbacks.h"
+
+// This file measures latency. The nominal latencies that portaudio
+// reports for a device (defaultLowOutputLatency and friends) are
+// often wrong by tens of milliseconds, so instead a duplex stream
+// plays a burst of sound now and then, and the callback listens for
+// it to come back in through the input (through a loopback cable, or
+// just out of the speakers and into the microphone). In a duplex
+// callback, an input frame and the output frame at the same place in
+// the buffers are handled at the same moment, so the number of
+// frames between the burst going out and coming back is the whole
+// round trip: output latency plus input latency.
+
+// The callback also averages the latencies that portaudio's
+// timestamps claim for each buffer (outputBufferDacTime and
+// inputBufferAdcTime against currentTime), which are usually closer
+// to the truth than the nominal ones. Output latency is then
+// estimated as the round trip less the timestamps' input latency
+// (see latency.rkt).
+
+// There's also a simulated host: latencySimulate runs the callback
+// against a loopback with known latencies, so that the measuring can
+// be tested without a cable.
+
+#define LATENCY_MAX_IMPULSES 64
+// the burst: a tone at an eighth of the sample rate, for this many
+// frames.
+#define LATENCY_BURST_FRAMES 64
+#define LATENCY_BURST_LEVEL 24000
+
+typedef struct latencyProbe{
+  int inputChannels;
+  // samples louder than this (in the first input channel) are the
+  // burst coming back:
+  int threshold;
+  // frames from one burst to the next; a burst that hasn't come back
+  // by then is given up on (so this has to be longer than any round
+  // trip, or a late burst is taken for the next one):
+  unsigned long period;
+  int impulses;
+  // frames since the stream started:
+  unsigned long frame;
+  // bursts played so far:
+  int sent;
+  // the frame the current burst started on, and whether it's still
+  // to come back:
+  unsigned long sentAt;
+  int listening;
+  // the round trip for each burst, in frames, or -1 if it never came
+  // back:
+  long roundTrip[LATENCY_MAX_IMPULSES];
+  // the sums of the latencies the timestamps claim, in seconds:
+  double reportedOutput;
+  double reportedInput;
+  unsigned long timedBuffers;
+  int done;
+} latencyProbe;
+
+latencyProbe *latencyProbeNew(int inputChannels, double threshold,
+                              unsigned long period, int impulses){
+  latencyProbe *p;
+  if (impulses < 1 || impulses > LATENCY_MAX_IMPULSES || inputChannels < 1
+      || period < 2 * LATENCY_BURST_FRAMES) {
+    return NULL;
+  }
+  p = (latencyProbe *)arenaCalloc(sizeof(latencyProbe));
+  if (p == NULL) {
+    return NULL;
+  }
+  p->inputChannels = inputChannels;
+  p->threshold = (int)(threshold * 32767.0);
+  p->period = period;
+  p->impulses = impulses;
+  return p;
+}
+
+void latencyProbeFree(latencyProbe *p){
+  arenaFree(p);
+}
+
+int latencyProbeDone(latencyProbe *p){
+  return RS_ATOMIC_LOAD(&p->done);
+}
+
+// the round trip, in frames, of burst i, or -1.
+long latencyProbeRoundTrip(latencyProbe *p, int i){
+  return p->roundTrip[i];
+}
+
+int latencyProbeSent(latencyProbe *p){
+  return p->sent;
+}
+
+// the average latencies the timestamps claimed, in seconds, or -1.0
+// if there were no timestamps.
+double latencyProbeReportedOutput(latencyProbe *p){
+  return p->timedBuffers ? p->reportedOutput / p->timedBuffers : -1.0;
+}
+
+double latencyProbeReportedInput(latencyProbe *p){
+  return p->timedBuffers ? p->reportedInput / p->timedBuffers : -1.0;
+}
+
+static short burstSample(unsigned long i){
+  // +,+,+,+,-,-,-,-: a square wave with a period of eight frames.
+  return ((i / 4) % 2) ? -LATENCY_BURST_LEVEL : LATENCY_BURST_LEVEL;
+}
+
+int latencyCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  latencyProbe *p = (latencyProbe *)userData;
+  const short *in = (const short *)input;
+  short *out = (short *)output;
+  unsigned long i, since;
+  int c, level;
+  short s;
+
+  if (timeInfo != NULL && timeInfo->currentTime > 0.0
+      && timeInfo->outputBufferDacTime > 0.0 && timeInfo->inputBufferAdcTime > 0.0) {
+    p->reportedOutput += timeInfo->outputBufferDacTime - timeInfo->currentTime;
+    p->reportedInput += timeInfo->currentTime - timeInfo->inputBufferAdcTime;
+    p->timedBuffers++;
+  }
+
+  for (i = 0; i < frameCount; i++, p->frame++) {
+    // listen:
+    if (p->listening && in != NULL) {
+      level = in[i * p->inputChannels];
+      if (level > p->threshold || -level > p->threshold) {
+        p->roundTrip[p->sent - 1] = (long)(p->frame - p->sentAt);
+        p->listening = 0;
+      }
+    }
+    // speak:
+    since = p->frame - p->sentAt;
+    if (p->sent == 0 || since >= p->period) {
+      if (p->listening) {
+        // never came back:
+        p->roundTrip[p->sent - 1] = -1;
+        p->listening = 0;
+      }
+      if (p->sent == p->impulses) {
+        RS_ATOMIC_STORE(&p->done,1);
+        memset(out + i * CHANNELS,0,FRAMES_TO_BYTES(frameCount - i));
+        return paComplete;
+      }
+      p->sent++;
+      p->sentAt = p->frame;
+      p->listening = 1;
+      since = 0;
+    }
+    s = (since < LATENCY_BURST_FRAMES) ? burstSample(since) : 0;
+    for (c = 0; c < CHANNELS; c++) {
+      out[i * CHANNELS + c] = s;
+    }
+  }
+  return paContinue;
+}
+
+// run the probe against a simulated host until it's done (or has
+// run for 'maxFrames' frames): the output comes back as input after
+// outputLatency + inputLatency frames, with noise of up to
+// 'noiseLevel' added, and the timestamps claim the given latencies.
+// Returns the number of frames run. The round trip must be at least
+// a buffer long.
+unsigned long latencySimulate(latencyProbe *p, unsigned long outputLatency,
+                              unsigned long inputLatency, unsigned long bufferFrames,
+                              double sampleRate, int noiseLevel, unsigned long maxFrames){
+  unsigned long delay = outputLatency + inputLatency;
+  // the output, remembered for long enough to be played back:
+  unsigned long historyFrames = delay + bufferFrames;
+  short *history = (short *)arenaCalloc(FRAMES_TO_BYTES(historyFrames));
+  short *in = (short *)arenaCalloc(bufferFrames * p->inputChannels * sizeof(short));
+  short *out = (short *)arenaCalloc(FRAMES_TO_BYTES(bufferFrames));
+  PaStreamCallbackTimeInfo timeInfo;
+  unsigned long frame = 0, i;
+  short back;
+  unsigned int seed = 12345;
+  int c, noise, result = paContinue;
+
+  // (a real host can't bring a buffer's output back within the same
+  // buffer either)
+  if (delay < bufferFrames || history == NULL || in == NULL || out == NULL) {
+    arenaFree(history);
+    arenaFree(in);
+    arenaFree(out);
+    return 0;
+  }
+  while (result == paContinue && frame < maxFrames) {
+    // what comes in is what went out 'delay' frames ago:
+    for (i = 0; i < bufferFrames; i++) {
+      seed = seed * 1103515245 + 12345;
+      noise = noiseLevel ? (int)((seed >> 16) % (2 * noiseLevel + 1)) - noiseLevel : 0;
+      back = (frame + i >= delay) ? history[((frame + i - delay) % historyFrames) * CHANNELS] : 0;
+      for (c = 0; c < p->inputChannels; c++) {
+        in[i * p->inputChannels + c] = (short)MYMAX(-32768, MYMIN(32767, back + noise));
+      }
+    }
+    // start the clock a second in, so that it's never 0:
+    timeInfo.currentTime = 1.0 + frame / sampleRate;
+    timeInfo.outputBufferDacTime = timeInfo.currentTime + outputLatency / sampleRate;
+    timeInfo.inputBufferAdcTime = timeInfo.currentTime - inputLatency / sampleRate;
+    result = latencyCallback(in,out,bufferFrames,&timeInfo,0,p);
+    for (i = 0; i < bufferFrames; i++) {
+      for (c = 0; c < CHANNELS; c++) {
+        history[((frame + i) % historyFrames) * CHANNELS + c] = out[i * CHANNELS + c];
+      }
+    }
+    frame += bufferFrames;
+  }
+  arenaFree(history);
+  arenaFree(in);
+  arenaFree(out);
+  return frame;
+}
@@ -0,0 +1,255 @@
+#include "callbacks.h"
+
+// This file records the lifecycle of every stream: when it was
+// opened and started, when its callback first ran, when it first
+// ran dry, when it finished, and how long it took to close. The
+// events go into one ring for the whole process, and Racket drains
+// it now and then (see lifecycle.rkt), logs the events, and keeps
+// counts and histograms of them.
+
+// Racket opens every stream with lifecycleCallback in place of the
+// real callback, and a streamLife record in place of the real user
+// data; the record holds the real ones. The wrapper costs a test of
+// two flags per buffer, and only looks at the clock on the first
+// callback and the first underrun. The finished callback is wrapped
+// the same way.
+
+// The close thread (see control.c) hands the record back once the
+// stream is closed. If the stream never finished (because it was
+// never started), its finished callback is called then, so that the
+// callback's data (soundCopyingInfo and the like) is freed however
+// the stream ends; once the stream is closed, nothing can race it.
+
+// An underrun is a buffer that portaudio flags as an output
+// underflow, or, for the streaming callback, one in which the ring
+// ran dry (its fault count went up).
+
+// the ring's length is a power of two, so that the positions can
+// wrap around.
+#define LIFE_RING_EVENTS 4096
+
+// must agree with lifecycle.rkt:
+#define LIFE_DEVICE_SELECTED 0
+#define LIFE_OPEN 1
+#define LIFE_OPEN_FAILED 2
+#define LIFE_START 3
+#define LIFE_FIRST_CALLBACK 4
+#define LIFE_FIRST_UNDERRUN 5
+#define LIFE_FINISHED 6
+#define LIFE_CLOSE_REQUESTED 7
+#define LIFE_CLOSED 8
+#define LIFE_RECLAIMED 9
+
+// must agree with _lifecycle-event in lifecycle.rkt.
+typedef struct lifecycleEvent{
+  // the stream's id, or 0 for events that belong to no stream:
+  long stream;
+  int kind;
+  // a device number or frame count, depending on the kind:
+  int arg;
+  // when it happened, on rsMonotonicSeconds' clock:
+  double at;
+  // a duration in seconds, depending on the kind:
+  double value;
+} lifecycleEvent;
+
+typedef struct lifeSlot{
+  // i+1 once the event pushed as the i'th is in place, and i while
+  // it's being written:
+  unsigned int seq;
+  lifecycleEvent event;
+} lifeSlot;
+
+struct streamLife{
+  long id;
+  // the real callback, NULL for a blocking stream:
+  PaStreamCallback *callback;
+  void *userData;
+  // the real finished callback, or NULL; set by Racket.
+  PaStreamFinishedCallback *finished;
+  double openedAt;
+  // set just before each start from Racket, so 0 if the stream was
+  // only ever started natively (e.g. by a sync group):
+  double startedAt;
+  // only touched by the callback:
+  int calledBack;
+  int underran;
+  // the number of times the stream has finished:
+  int finishes;
+};
+
+static lifeSlot lifeRing[LIFE_RING_EVENTS];
+// the number of events pushed; bumped by any thread:
+static unsigned int lifeHead = 0;
+// the number drained, and dropped because the ring was full; only
+// touched by Racket:
+static unsigned int lifeTail = 0;
+static unsigned long lifeDropped = 0;
+
+double lifecycleNow(void){
+  return rsMonotonicSeconds();
+}
+
+// record an event, from any thread. Never waits.
+void lifecyclePush(long stream, int kind, int arg, double value){
+  unsigned int i = (unsigned int)RS_ATOMIC_ADD(&lifeHead, 1);
+  lifeSlot *slot = &lifeRing[i & (LIFE_RING_EVENTS - 1)];
+  RS_ATOMIC_STORE(&slot->seq, i);
+  // the release store above only orders what came before it; the
+  // event mustn't be seen before the slot is marked as being written:
+  RS_FENCE();
+  slot->event.stream = stream;
+  slot->event.kind = kind;
+  slot->event.arg = arg;
+  slot->event.at = rsMonotonicSeconds();
+  slot->event.value = value;
+  RS_ATOMIC_STORE(&slot->seq, i + 1);
+}
+
+// copy up to 'max' events out of the ring, oldest first, returning
+// the number copied. Only Racket calls this, and only from one
+// thread at a time. Events that were overwritten before they could
+// be drained are counted in lifecycleDropped.
+int lifecycleDrain(lifecycleEvent *out, int max){
+  int n = 0;
+  unsigned int head;
+  lifeSlot *slot;
+  while (n < max) {
+    head = RS_ATOMIC_LOAD(&lifeHead);
+    if (head == lifeTail) {
+      break;
+    }
+    if (head - lifeTail > LIFE_RING_EVENTS) {
+      // lapped:
+      lifeDropped += head - lifeTail - LIFE_RING_EVENTS;
+      lifeTail = head - LIFE_RING_EVENTS;
+    }
+    slot = &lifeRing[lifeTail & (LIFE_RING_EVENTS - 1)];
+    if (RS_ATOMIC_LOAD(&slot->seq) != lifeTail + 1) {
+      if (RS_ATOMIC_LOAD(&lifeHead) - lifeTail > LIFE_RING_EVENTS) {
+        // lapped while we looked; try again.
+        continue;
+      }
+      // still being written; it'll be there next time.
+      break;
+    }
+    out[n] = slot->event;
+    // the copy must be done before we look at seq again:
+    RS_FENCE();
+    if (RS_ATOMIC_LOAD(&slot->seq) != lifeTail + 1) {
+      // overwritten while we copied it:
+      continue;
+    }
+    n++;
+    lifeTail++;
+  }
+  return n;
+}
+
+unsigned long lifecycleDropped(void){
+  return lifeDropped;
+}
+
+// a record for a stream that's about to be opened, with the real
+// callback (NULL for a blocking stream) and user data.
+streamLife *lifecycleNew(long id, PaStreamCallback *callback, void *userData){
+  streamLife *life = (streamLife *)arenaCalloc(sizeof(streamLife));
+  if (life == NULL) {
+    return NULL;
+  }
+  life->id = id;
+  life->callback = callback;
+  life->userData = userData;
+  life->openedAt = rsMonotonicSeconds();
+  return life;
+}
+
+// for a stream that never opened.
+void lifecycleFree(streamLife *life){
+  arenaFree(life);
+}
+
+int lifecycleWraps(streamLife *life){
+  return life->callback != NULL;
+}
+
+void lifecycleSetFinished(streamLife *life, PaStreamFinishedCallback *finished){
+  RS_ATOMIC_STORE_PTR(&life->finished, finished);
+}
+
+// called just before Racket starts the stream; returns the time.
+double lifecycleStarting(streamLife *life){
+  life->startedAt = rsMonotonicSeconds();
+  return life->startedAt;
+}
+
+// seconds since the stream was started, or since it was opened if
+// it wasn't started from Racket.
+static double sinceStart(streamLife *life, double now){
+  return now - (life->startedAt > 0.0 ? life->startedAt : life->openedAt);
+}
+
+int lifecycleCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  streamLife *life = (streamLife *)userData;
+  int result;
+  int faultsBefore = 0;
+  int underran;
+
+  if (!life->calledBack) {
+    life->calledBack = 1;
+    lifecyclePush(life->id, LIFE_FIRST_CALLBACK, (int)frameCount,
+                  sinceStart(life, rsMonotonicSeconds()));
+  }
+  if (life->underran) {
+    return life->callback(input,output,frameCount,timeInfo,statusFlags,life->userData);
+  }
+  if (life->callback == streamingCallback) {
+    faultsBefore = ((soundStreamInfo *)life->userData)->faultCount;
+  }
+  result = life->callback(input,output,frameCount,timeInfo,statusFlags,life->userData);
+  underran = (statusFlags & paOutputUnderflow) != 0;
+  if (life->callback == streamingCallback) {
+    underran = underran || ((soundStreamInfo *)life->userData)->faultCount != faultsBefore;
+  }
+  if (underran) {
+    life->underran = 1;
+    lifecyclePush(life->id, LIFE_FIRST_UNDERRUN, (int)frameCount,
+                  sinceStart(life, rsMonotonicSeconds()));
+  }
+  return result;
+}
+
+// the finished callback for every stream with a callback; it calls
+// the real one, if any. (A suspended streaming stream finishes too;
+// see control.c.)
+void lifecycleFinished(void *userData){
+  streamLife *life = (streamLife *)userData;
+  PaStreamFinishedCallback *finished = RS_ATOMIC_LOAD_PTR(&life->finished);
+  lifecyclePush(life->id, LIFE_FINISHED, 0, sinceStart(life, rsMonotonicSeconds()));
+  RS_ATOMIC_ADD(&life->finishes, 1);
+  if (finished != NULL) {
+    finished(life->userData);
+  }
+}
+
+// the stream is closed, so nothing else can touch the record.
+// 'requestedAt' is when the close was asked for.
+void lifecycleClosed(streamLife *life, double requestedAt){
+  PaStreamFinishedCallback *finished;
+  if (life == NULL) {
+    return;
+  }
+  finished = RS_ATOMIC_LOAD_PTR(&life->finished);
+  if (RS_ATOMIC_LOAD(&life->finishes) == 0 && finished != NULL) {
+    // never started, so portaudio never called it:
+    finished(life->userData);
+  }
+  lifecyclePush(life->id, LIFE_CLOSED, 0, rsMonotonicSeconds() - requestedAt);
+  arenaFree(life);
+}
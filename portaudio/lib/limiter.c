@@ -0,0 +1,421 @@
+#include <math.h>
+#include "callbacks.h"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+// This file provides look-ahead limiters: the last thing a callback
+// does to its output before it goes to the device, so that peaks come
+// out turned down instead of clipped. The streaming and copying
+// callbacks run one over their own output (after the EQ, and before
+// the tap and the spectrum analyzer see it); a limiter there bounds
+// that one stream or sound, and nothing else. Separate streams are
+// summed by the host after their callbacks, where no limiter can see
+// them. To keep sounds that peak together in check, mix them into one
+// stream: the place-stream callback (see placestream.c) runs its
+// limiter over the sum of its lanes, before it's clipped to 16 bits.
+
+// The limiter delays the sound by lookAhead frames. For each frame
+// that comes in, it works out the gain that would bring that frame's
+// peak down to the threshold; the gain it applies to the frame going
+// out is the mean, over the last lookAhead + 1 frames, of the least
+// of those gains over the lookAhead + 1 frames before each. That
+// starts turning the sound down lookAhead frames before a peak goes
+// out, smoothly, and never lets a sample out above the threshold.
+// Once the peak has passed, the gain comes back up with the release
+// time constant; it comes down as fast as it needs to.
+
+// The latency is exactly lookAhead frames, whatever the sound is.
+// The copying callback plays on for that long after the sound ends,
+// so that the end of the sound isn't cut off.
+
+// A limiter is shared by Racket and at most one playing sound,
+// stream or place stream at a time, each of which holds a reference;
+// whichever lets go last frees it. Attaching it resets it.
+
+#define LIMITER_MAX_LOOK_AHEAD 8192
+// the callbacks work out the gains this many frames at a time:
+#define LIMITER_BLOCK_FRAMES 256
+
+// must agree with _limiter-stats in limiter.rkt.
+typedef struct limiterStats{
+  unsigned long frames;
+  // frames that went out turned down, and the lowest gain yet:
+  unsigned long limitedFrames;
+  double minGain;
+  // the gain the last frame went out with:
+  double gain;
+  // the loudest samples that came in and went out:
+  int peakIn;
+  int peakOut;
+  // seconds the callbacks spent limiting, in all and at most in one
+  // buffer:
+  double processSeconds;
+  double maxProcessSeconds;
+} limiterStats;
+
+struct limiterState{
+  // never changed:
+  float threshold;
+  double releaseCoefficient;
+  unsigned int lookAhead;
+  // the window is lookAhead + 1 frames:
+  unsigned int windowFrames;
+
+  // the sound that's come in but not gone out yet, lookAhead frames
+  // of it; ints, since a mixer's sum can be louder than full scale:
+  int *delay;
+  unsigned int delayPos;
+
+  // the least of the last windowFrames gains, kept as a queue of
+  // (frame, gain) pairs with increasing gains, of which the first
+  // is the least:
+  unsigned long *minFrames;
+  float *minGains;
+  unsigned int minHead;
+  unsigned int minCount;
+
+  // the last windowFrames of those least gains, and their sum:
+  float *boxGains;
+  unsigned int boxPos;
+  double boxSum;
+
+  double gain;
+  unsigned long frame;
+  // silent frames that have come in since the last sound:
+  unsigned long quietFrames;
+  // set by the benchmark, to time the plain gain loop:
+  int plainGain;
+
+  int attached;
+  int refs;
+  limiterStats stats;
+};
+
+// a limiter that brings peaks down to 'threshold' (a fraction of
+// full scale), with 'lookAhead' frames of latency, letting the gain
+// back up with a time constant of 'releaseFrames'.
+limiterState *limiterNew(double threshold, double releaseFrames, unsigned int lookAhead){
+  limiterState *ls;
+  unsigned int window = lookAhead + 1;
+
+  if (lookAhead > LIMITER_MAX_LOOK_AHEAD || threshold <= 0.0 || threshold > 1.0) {
+    return NULL;
+  }
+  ls = (limiterState *)arenaCalloc(sizeof(limiterState));
+  if (ls == NULL) {
+    return NULL;
+  }
+  // a whole number of sample units, so that rounding can't take a
+  // sample over it:
+  ls->threshold = (float)floor(threshold * 32767.0);
+  if (ls->threshold < 1.0f) {
+    ls->threshold = 1.0f;
+  }
+  ls->releaseCoefficient = releaseFrames < 1.0 ? 1.0 : 1.0 - exp(-1.0 / releaseFrames);
+  ls->lookAhead = lookAhead;
+  ls->windowFrames = window;
+  ls->delay = (int *)arenaCalloc((lookAhead + 1) * CHANNELS * sizeof(int));
+  ls->minFrames = (unsigned long *)arenaCalloc(window * sizeof(unsigned long));
+  ls->minGains = (float *)arenaCalloc(window * sizeof(float));
+  ls->boxGains = (float *)arenaCalloc(window * sizeof(float));
+  if (ls->delay == NULL || ls->minFrames == NULL || ls->minGains == NULL
+      || ls->boxGains == NULL) {
+    arenaFree(ls->delay);
+    arenaFree(ls->minFrames);
+    arenaFree(ls->minGains);
+    arenaFree(ls->boxGains);
+    arenaFree(ls);
+    return NULL;
+  }
+  ls->refs = 1;
+  limiterReset(ls);
+  return ls;
+}
+
+// back to silence, with the gain all the way up. Not while a
+// callback is using it.
+void limiterReset(limiterState *ls){
+  unsigned int i;
+  memset(ls->delay,0,(ls->lookAhead + 1) * CHANNELS * sizeof(int));
+  ls->delayPos = 0;
+  ls->minHead = 0;
+  ls->minCount = 0;
+  for (i = 0; i < ls->windowFrames; i++) {
+    ls->boxGains[i] = 1.0f;
+  }
+  ls->boxPos = 0;
+  ls->boxSum = (double)ls->windowFrames;
+  ls->gain = 1.0;
+  ls->frame = 0;
+  ls->quietFrames = ls->lookAhead;
+  memset(&ls->stats,0,sizeof(limiterStats));
+  ls->stats.minGain = 1.0;
+  ls->stats.gain = 1.0;
+}
+
+// take a reference for a sound or stream's record, resetting the
+// limiter; returns NULL if it's already attached to one.
+limiterState *limiterAttach(limiterState *ls){
+  if (!RS_ATOMIC_CAS(&ls->attached,0,1)) {
+    return NULL;
+  }
+  RS_ATOMIC_ADD(&ls->refs,1);
+  limiterReset(ls);
+  return ls;
+}
+
+void limiterRelease(limiterState *ls){
+  if (RS_ATOMIC_ADD(&ls->refs,-1) == 1) {
+    arenaFree(ls->delay);
+    arenaFree(ls->minFrames);
+    arenaFree(ls->minGains);
+    arenaFree(ls->boxGains);
+    arenaFree(ls);
+  }
+}
+
+// called when a record that holds a reference is freed.
+void limiterDetach(limiterState *ls){
+  RS_ATOMIC_STORE(&ls->attached,0);
+  limiterRelease(ls);
+}
+
+unsigned int limiterLatency(limiterState *ls){
+  return ls->lookAhead;
+}
+
+void limiterGetStats(limiterState *ls, limiterStats *out){
+  memcpy(out,&ls->stats,sizeof(limiterStats));
+}
+
+// has everything that came in gone out? The copying callback keeps
+// going until it has.
+int limiterDrained(limiterState *ls){
+  return ls->quietFrames >= ls->lookAhead;
+}
+
+// out[i] = in[i] * gains[i / CHANNELS], for 'frames' frames. Both
+// loops round halves away from zero, and clip, so that they agree to
+// the sample.
+static void applyGainsPlain(short *out, const int *in, const float *gains,
+                            unsigned long frames){
+  unsigned long i;
+  for (i = 0; i < frames * CHANNELS; i++) {
+    out[i] = rsToSampleF(in[i] * gains[i / CHANNELS]);
+  }
+}
+
+static void applyGains(short *out, const int *in, const float *gains,
+                       unsigned long frames){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128i lo, hi;
+  __m128 g, gLo, gHi, xLo, xHi;
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 signBit = _mm_set1_ps(-0.0f);
+  // four frames, eight samples, at a time; each gain goes to both
+  // samples of its frame:
+  for (; i + 4 <= frames; i += 4) {
+    lo = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS));
+    hi = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS + 4));
+    g = _mm_loadu_ps(gains + i);
+    gLo = _mm_unpacklo_ps(g,g);
+    gHi = _mm_unpackhi_ps(g,g);
+    xLo = _mm_mul_ps(_mm_cvtepi32_ps(lo),gLo);
+    xHi = _mm_mul_ps(_mm_cvtepi32_ps(hi),gHi);
+    // add a half with the sample's sign, and truncate:
+    xLo = _mm_add_ps(xLo,_mm_or_ps(half,_mm_and_ps(xLo,signBit)));
+    xHi = _mm_add_ps(xHi,_mm_or_ps(half,_mm_and_ps(xHi,signBit)));
+    lo = _mm_cvttps_epi32(xLo);
+    hi = _mm_cvttps_epi32(xHi);
+    _mm_storeu_si128((__m128i *)(out + i * CHANNELS),_mm_packs_epi32(lo,hi));
+  }
+#endif
+  applyGainsPlain(out + i * CHANNELS,in + i * CHANNELS,gains + i,frames - i);
+}
+
+// limit up to LIMITER_BLOCK_FRAMES frames of 'in' into 'out'.
+static void limitBlock(limiterState *ls, const int *in, short *out, unsigned long frames){
+  float gains[LIMITER_BLOCK_FRAMES];
+  int delayed[LIMITER_BLOCK_FRAMES * CHANNELS];
+  unsigned long i;
+  unsigned int slot;
+  unsigned int window = ls->windowFrames;
+  int left, right, peak;
+  float needed, least;
+  double mean;
+  int *d;
+
+  for (i = 0; i < frames; i++) {
+    left = in[i * CHANNELS];
+    right = in[i * CHANNELS + 1];
+    peak = MYMAX(left < 0 ? -left : left, right < 0 ? -right : right);
+    if (peak > ls->stats.peakIn) {
+      ls->stats.peakIn = peak;
+    }
+    if (peak == 0) {
+      ls->quietFrames += 1;
+    } else {
+      ls->quietFrames = 0;
+    }
+    needed = (float)peak > ls->threshold ? ls->threshold / (float)peak : 1.0f;
+
+    // the least gain over the window ending here: the frame that
+    // fell out of the window goes, and gains no smaller than this
+    // one can never be the least again.
+    if (ls->minCount > 0 && ls->minFrames[ls->minHead] + window <= ls->frame) {
+      ls->minHead = (ls->minHead + 1) % window;
+      ls->minCount -= 1;
+    }
+    while (ls->minCount > 0
+           && ls->minGains[(ls->minHead + ls->minCount - 1) % window] >= needed) {
+      ls->minCount -= 1;
+    }
+    slot = (ls->minHead + ls->minCount) % window;
+    ls->minFrames[slot] = ls->frame;
+    ls->minGains[slot] = needed;
+    ls->minCount += 1;
+    least = ls->minGains[ls->minHead];
+
+    // and the mean of those over the window:
+    ls->boxSum += (double)least - (double)ls->boxGains[ls->boxPos];
+    ls->boxGains[ls->boxPos] = least;
+    ls->boxPos += 1;
+    if (ls->boxPos == window) {
+      // don't let rounding errors pile up:
+      ls->boxPos = 0;
+      ls->boxSum = 0.0;
+      for (slot = 0; slot < window; slot++) {
+        ls->boxSum += ls->boxGains[slot];
+      }
+    }
+    mean = ls->boxSum / window;
+    if (mean > 1.0) {
+      mean = 1.0;
+    }
+
+    // down at once, back up with the release:
+    if (mean < ls->gain) {
+      ls->gain = mean;
+    } else {
+      ls->gain += (mean - ls->gain) * ls->releaseCoefficient;
+    }
+    gains[i] = (float)ls->gain;
+    if (ls->gain < 1.0) {
+      ls->stats.limitedFrames += 1;
+      if (ls->gain < ls->stats.minGain) {
+        ls->stats.minGain = ls->gain;
+      }
+    }
+
+    // this frame goes in the delay, and the one lookAhead frames
+    // before it comes out:
+    if (ls->lookAhead == 0) {
+      delayed[i * CHANNELS] = left;
+      delayed[i * CHANNELS + 1] = right;
+    } else {
+      d = ls->delay + ls->delayPos * CHANNELS;
+      delayed[i * CHANNELS] = d[0];
+      delayed[i * CHANNELS + 1] = d[1];
+      d[0] = left;
+      d[1] = right;
+      ls->delayPos = (ls->delayPos + 1) % ls->lookAhead;
+    }
+    ls->frame += 1;
+  }
+
+  if (ls->plainGain) {
+    applyGainsPlain(out,delayed,gains,frames);
+  } else {
+    applyGains(out,delayed,gains,frames);
+  }
+  for (i = 0; i < frames * CHANNELS; i++) {
+    peak = out[i] < 0 ? -out[i] : out[i];
+    if (peak > ls->stats.peakOut) {
+      ls->stats.peakOut = peak;
+    }
+  }
+}
+
+// limit 'frames' frames into 'out', from 'narrow' if it isn't NULL,
+// and otherwise from 'wide'.
+static void limit(limiterState *ls, const short *narrow, const int *wide, short *out,
+                  unsigned long frames){
+  int block[LIMITER_BLOCK_FRAMES * CHANNELS];
+  double start = rsMonotonicSeconds();
+  double elapsed;
+  unsigned long done = 0;
+  unsigned long n, i;
+
+  while (done < frames) {
+    n = MYMIN(frames - done,LIMITER_BLOCK_FRAMES);
+    if (narrow) {
+      for (i = 0; i < n * CHANNELS; i++) {
+        block[i] = narrow[done * CHANNELS + i];
+      }
+      limitBlock(ls,block,out + done * CHANNELS,n);
+    } else {
+      limitBlock(ls,wide + done * CHANNELS,out + done * CHANNELS,n);
+    }
+    done += n;
+  }
+  ls->stats.frames += frames;
+  ls->stats.gain = ls->gain;
+  elapsed = rsMonotonicSeconds() - start;
+  ls->stats.processSeconds += elapsed;
+  if (elapsed > ls->stats.maxProcessSeconds) {
+    ls->stats.maxProcessSeconds = elapsed;
+  }
+}
+
+// called by a callback with the buffer it's about to deliver.
+void limiterProcess(limiterState *ls, short *samples, unsigned long frames){
+  limit(ls,samples,NULL,samples,frames);
+}
+
+// called by a mixing callback (see placestream.c) with its sums,
+// which may be louder than full scale, in place of clipping them
+// into 'out'.
+void limiterProcessWide(limiterState *ls, const int *in, short *out, unsigned long frames){
+  limit(ls,NULL,in,out,frames);
+}
+
+// the average seconds a callback spends limiting a buffer of
+// 'bufferFrames' frames of a sine that peaks at full scale, with
+// the given settings. With 'plain', the gains are applied without
+// SSE2. Returns a negative number if it couldn't allocate.
+double limiterBenchmark(double threshold, double releaseFrames, unsigned int lookAhead,
+                        unsigned long bufferFrames, int iterations, int plain){
+  limiterState *ls = limiterNew(threshold,releaseFrames,lookAhead);
+  short *source = (short *)arenaAlloc(FRAMES_TO_BYTES(bufferFrames));
+  short *buffer = (short *)arenaAlloc(FRAMES_TO_BYTES(bufferFrames));
+  double start;
+  double elapsed;
+  unsigned long i;
+  int k;
+
+  if (ls == NULL || source == NULL || buffer == NULL || iterations <= 0) {
+    if (ls != NULL) {
+      limiterRelease(ls);
+    }
+    arenaFree(source);
+    arenaFree(buffer);
+    return -1.0;
+  }
+  for (i = 0; i < bufferFrames; i++) {
+    source[i * CHANNELS] = (short)(32767.0 * sin(0.0628 * i));
+    source[i * CHANNELS + 1] = source[i * CHANNELS];
+  }
+  ls->plainGain = plain;
+  start = rsMonotonicSeconds();
+  for (k = 0; k < iterations; k++) {
+    memcpy(buffer,source,FRAMES_TO_BYTES(bufferFrames));
+    limiterProcess(ls,buffer,bufferFrames);
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  limiterRelease(ls);
+  arenaFree(source);
+  arenaFree(buffer);
+  return elapsed / iterations;
+}
@@ -0,0 +1,172 @@
+#include <math.h>
+#include "callbacks.h"
+
+// This file lets the copying callback loop over a region of its
+// sound, a given number of times or forever, so that a long ambient
+// bed can play from a short recording without Racket doing anything
+// while it loops.
+
+// When the position reaches loopEnd and there are loops left, it
+// jumps back. To hide the seam, the last crossfadeFrames frames
+// before loopEnd are mixed with the first crossfadeFrames frames
+// after loopStart, using an equal-power (sine/cosine) crossfade,
+// and the jump goes to loopStart + crossfadeFrames, where the
+// fade-in left off. So each pass after the first is
+// loopEnd - loopStart - crossfadeFrames frames long. On the last
+// pass there's no crossfade, and the sound plays on past loopEnd
+// to its end.
+
+// Racket can end the looping early through the sound's
+// playbackControl, if it has one (see playbackControlEndLoop).
+
+// The sound is read through soundCopyFrames and soundSampleAt, so
+// a packed sound (see adpcm.c) loops just like a plain one. The
+// copying callback also comes here for packed sounds that don't
+// loop at all.
+
+// the crossfade reads the start of the loop in pieces this big:
+#define CROSSFADE_CHUNK 64
+
+// called only by Racket.
+void playbackControlEndLoop(playbackControl *pc){
+  RS_ATOMIC_STORE(&pc->loopExit,1);
+}
+
+int loopActive(soundCopyingInfo *ri){
+  if (ri->loopEnd == 0 || ri->loopsLeft == 0) {
+    return 0;
+  }
+  if (ri->control && RS_ATOMIC_LOAD(&ri->control->loopExit)) {
+    ri->loopsLeft = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// the equal-power gains for frame j of the crossfade
+static void crossfadeGains(unsigned long j, unsigned long frames,
+                           double *fadeOut, double *fadeIn){
+  double theta = (3.14159265358979323846 / 2.0) * ((double)j + 0.5) / (double)frames;
+  *fadeOut = cos(theta);
+  *fadeIn = sin(theta);
+}
+
+// copy 'frames' frames starting at frame 'from' of the crossfade,
+// mixing the end of the loop into its start.
+static void crossfadeSegment(soundCopyingInfo *ri, short *out,
+                             unsigned long from, unsigned long frames){
+  unsigned long x = ri->crossfadeFrames;
+  short starting[CROSSFADE_CHUNK * CHANNELS];
+  double fadeOut, fadeIn, stepCos, stepSin, nextOut;
+  unsigned long i, j, n;
+  int ch;
+  // the end of the loop goes straight into the output, and gets
+  // mixed with the start there:
+  soundCopyFrames(ri,ri->loopEnd - x + from,frames,out);
+  // the gains turn through a quarter circle; step them with a
+  // rotation rather than calling sin and cos for every frame.
+  crossfadeGains(from,x,&fadeOut,&fadeIn);
+  stepCos = cos((3.14159265358979323846 / 2.0) / (double)x);
+  stepSin = sin((3.14159265358979323846 / 2.0) / (double)x);
+  for (i = 0; i < frames; i += n) {
+    n = MYMIN(frames - i, CROSSFADE_CHUNK);
+    soundCopyFrames(ri,ri->loopStart + from + i,n,starting);
+    for (j = 0; j < n; j++) {
+      for (ch = 0; ch < CHANNELS; ch++) {
+        out[(i + j) * CHANNELS + ch] =
+          rsToSample(out[(i + j) * CHANNELS + ch] * fadeOut
+                   + starting[j * CHANNELS + ch] * fadeIn);
+      }
+      nextOut = fadeOut * stepCos - fadeIn * stepSin;
+      fadeIn = fadeIn * stepCos + fadeOut * stepSin;
+      fadeOut = nextOut;
+    }
+  }
+}
+
+// go back to the start of the loop, from its end.
+static void jumpBack(soundCopyingInfo *ri){
+  ri->curSample = (ri->loopStart + ri->crossfadeFrames) * CHANNELS;
+  if (ri->loopsLeft > 0) {
+    ri->loopsLeft--;
+  }
+}
+
+unsigned long loopCopy(soundCopyingInfo *ri, short *output, unsigned long frames){
+  unsigned long soundFrames = ri->numSamples / CHANNELS;
+  unsigned long fadeStart = ri->loopEnd - ri->crossfadeFrames;
+  unsigned long done = 0;
+  unsigned long frame;
+  unsigned long seg;
+  short *out;
+
+  while (done < frames) {
+    frame = ri->curSample / CHANNELS;
+    out = output + done * CHANNELS;
+    if (soundFrames <= frame) {
+      break;
+    }
+    if (loopActive(ri) && frame < ri->loopEnd) {
+      if (frame < fadeStart) {
+        seg = MYMIN(frames - done, fadeStart - frame);
+        soundCopyFrames(ri,frame,seg,out);
+      } else {
+        seg = MYMIN(frames - done, ri->loopEnd - frame);
+        crossfadeSegment(ri,out,frame - fadeStart,seg);
+      }
+      ri->curSample += seg * CHANNELS;
+      if (ri->curSample / CHANNELS == ri->loopEnd) {
+        jumpBack(ri);
+      }
+    } else {
+      seg = MYMIN(frames - done, soundFrames - frame);
+      soundCopyFrames(ri,frame,seg,out);
+      ri->curSample += seg * CHANNELS;
+    }
+    done += seg;
+  }
+  return done;
+}
+
+static double rawSampleAt(soundCopyingInfo *ri, long frame, int channel){
+  if (frame < 0 || (long)(ri->numSamples / CHANNELS) <= frame) {
+    return 0.0;
+  }
+  return soundSampleAt(ri,(unsigned long)frame,channel);
+}
+
+double loopSampleAt(soundCopyingInfo *ri, long frame, int channel){
+  long fadeStart = (long)(ri->loopEnd - ri->crossfadeFrames);
+  double fadeOut, fadeIn;
+  if (!loopActive(ri)) {
+    return rawSampleAt(ri,frame,channel);
+  }
+  // past the end of the loop, we're really back at the start:
+  if ((long)ri->loopEnd <= frame
+      && frame - (long)ri->loopEnd < (long)(ri->loopEnd - ri->loopStart)) {
+    frame -= (long)(ri->loopEnd - ri->loopStart - ri->crossfadeFrames);
+  }
+  if (fadeStart <= frame && frame < (long)ri->loopEnd) {
+    crossfadeGains((unsigned long)(frame - fadeStart),ri->crossfadeFrames,&fadeOut,&fadeIn);
+    return rawSampleAt(ri,frame,channel) * fadeOut
+      + rawSampleAt(ri,frame - fadeStart + (long)ri->loopStart,channel) * fadeIn;
+  }
+  return rawSampleAt(ri,frame,channel);
+}
+
+void loopAdvance(soundCopyingInfo *ri, unsigned long frames){
+  unsigned long frame = ri->curSample / CHANNELS;
+  unsigned long soundFrames = ri->numSamples / CHANNELS;
+  // at very high rates, one step can cross the loop end more
+  // than once:
+  while (loopActive(ri) && frame < ri->loopEnd && ri->loopEnd <= frame + frames) {
+    frames -= ri->loopEnd - frame;
+    jumpBack(ri);
+    frame = ri->curSample / CHANNELS;
+  }
+  if (soundFrames - frame <= frames) {
+    ri->curSample = ri->numSamples;
+  } else {
+    ri->curSample = (frame + frames) * CHANNELS;
+  }
+}
@@ -0,0 +1,171 @@
+#include "callbacks.h"
+
+#ifndef WIN32
+# include <time.h>
+# include <errno.h>
+# include <sys/time.h>
+#endif
+#ifdef __APPLE__
+# include <mach/mach_time.h>
+#endif
+
+// This file provides the thin layer of platform code used by
+// the parts of the library that run on threads of their own:
+// threads, locks, condition variables, a monotonic clock, and
+// the table of portaudio entry points registered by Racket.
+
+// NB: none of these should ever be called from inside a
+// portaudio callback; they may block.
+
+paFunctionTable paFns = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+// register a portaudio entry point by its C name. Returns 1
+// if the name is one we know about, 0 otherwise.
+int setPaFunction(const char *name, void *fn){
+  if (strcmp(name,"Pa_WriteStream") == 0) {
+    paFns.writeStream = (PaError (*)(PaStream *, const void *, unsigned long))fn;
+  } else if (strcmp(name,"Pa_ReadStream") == 0) {
+    paFns.readStream = (PaError (*)(PaStream *, void *, unsigned long))fn;
+  } else if (strcmp(name,"Pa_GetStreamWriteAvailable") == 0) {
+    paFns.getStreamWriteAvailable = (signed long (*)(PaStream *))fn;
+  } else if (strcmp(name,"Pa_GetStreamReadAvailable") == 0) {
+    paFns.getStreamReadAvailable = (signed long (*)(PaStream *))fn;
+  } else if (strcmp(name,"Pa_StartStream") == 0) {
+    paFns.startStream = (PaError (*)(PaStream *))fn;
+  } else if (strcmp(name,"Pa_StopStream") == 0) {
+    paFns.stopStream = (PaError (*)(PaStream *))fn;
+  } else if (strcmp(name,"Pa_CloseStream") == 0) {
+    paFns.closeStream = (PaError (*)(PaStream *))fn;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// the thread entry point and its argument, handed to the
+// platform's thread-start function:
+typedef struct threadStart{
+  void (*fn)(void *);
+  void *arg;
+} threadStart;
+
+#ifdef WIN32
+
+static DWORD WINAPI threadTrampoline(LPVOID p){
+  threadStart ts = *(threadStart *)p;
+  free(p);
+  ts.fn(ts.arg);
+  return 0;
+}
+
+int rsThreadCreate(rsThread *thread, void (*fn)(void *), void *arg){
+  threadStart *ts = (threadStart *)malloc(sizeof(threadStart));
+  if (ts == NULL) { return 1; }
+  ts->fn = fn;
+  ts->arg = arg;
+  *thread = CreateThread(NULL, 0, threadTrampoline, ts, 0, NULL);
+  if (*thread == NULL) {
+    free(ts);
+    return 1;
+  }
+  return 0;
+}
+
+void rsThreadJoin(rsThread thread){
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+void rsMutexInit(rsMutex *m){ InitializeCriticalSection(m); }
+void rsMutexDestroy(rsMutex *m){ DeleteCriticalSection(m); }
+void rsMutexLock(rsMutex *m){ EnterCriticalSection(m); }
+void rsMutexUnlock(rsMutex *m){ LeaveCriticalSection(m); }
+void rsCondInit(rsCond *c){ InitializeConditionVariable(c); }
+void rsCondDestroy(rsCond *c){ }
+void rsCondWait(rsCond *c, rsMutex *m){ SleepConditionVariableCS(c, m, INFINITE); }
+void rsCondTimedWait(rsCond *c, rsMutex *m, long millis){
+  SleepConditionVariableCS(c, m, (DWORD)millis);
+}
+void rsCondBroadcast(rsCond *c){ WakeAllConditionVariable(c); }
+
+double rsMonotonicSeconds(void){
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+void rsSleepMillis(long millis){ Sleep((DWORD)millis); }
+
+#else
+
+static void *threadTrampoline(void *p){
+  threadStart ts = *(threadStart *)p;
+  free(p);
+  ts.fn(ts.arg);
+  return NULL;
+}
+
+int rsThreadCreate(rsThread *thread, void (*fn)(void *), void *arg){
+  threadStart *ts = (threadStart *)malloc(sizeof(threadStart));
+  if (ts == NULL) { return 1; }
+  ts->fn = fn;
+  ts->arg = arg;
+  if (pthread_create(thread, NULL, threadTrampoline, ts) != 0) {
+    free(ts);
+    return 1;
+  }
+  return 0;
+}
+
+void rsThreadJoin(rsThread thread){ pthread_join(thread, NULL); }
+void rsMutexInit(rsMutex *m){ pthread_mutex_init(m, NULL); }
+void rsMutexDestroy(rsMutex *m){ pthread_mutex_destroy(m); }
+void rsMutexLock(rsMutex *m){ pthread_mutex_lock(m); }
+void rsMutexUnlock(rsMutex *m){ pthread_mutex_unlock(m); }
+void rsCondInit(rsCond *c){ pthread_cond_init(c, NULL); }
+void rsCondDestroy(rsCond *c){ pthread_cond_destroy(c); }
+void rsCondWait(rsCond *c, rsMutex *m){ pthread_cond_wait(c, m); }
+void rsCondBroadcast(rsCond *c){ pthread_cond_broadcast(c); }
+
+// the condition variable uses the realtime clock, so
+// the deadline has to be computed against that one.
+void rsCondTimedWait(rsCond *c, rsMutex *m, long millis){
+  struct timeval now;
+  struct timespec deadline;
+  gettimeofday(&now, NULL);
+  deadline.tv_sec = now.tv_sec + millis / 1000;
+  deadline.tv_nsec = (now.tv_usec * 1000L) + (millis % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(c, m, &deadline);
+}
+
+// clock_gettime only appeared in OS X 10.12, and we still
+// build for 10.5:
+#ifdef __APPLE__
+double rsMonotonicSeconds(void){
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  return (double)mach_absolute_time() * timebase.numer / timebase.denom * 1e-9;
+}
+#else
+double rsMonotonicSeconds(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#endif
+
+void rsSleepMillis(long millis){
+  struct timespec ts;
+  ts.tv_sec = millis / 1000;
+  ts.tv_nsec = (millis % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { }
+}
+
+#endif
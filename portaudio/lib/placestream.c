@@ -0,0 +1,322 @@
+#include "callbacks.h"
+
+// This file provides place streams: a stream that Racket code in any
+// place can feed and control, so that sound can be made in several
+// places at once. Places don't share a heap, so nothing here is a
+// Racket object; a place stream is a block of C memory, and Racket
+// passes its address from place to place (see place-stream.rkt).
+
+// A place stream has a fixed number of lanes. Each lane is a ring of
+// its own, and the callback mixes the lanes together (with the
+// kernels in kernels.c), clipping the sum, or running it through a
+// limiter if the stream has one (see limiter.c). A lane has at most
+// one producer at a time: a place claims a lane, and gets back a
+// token that its writes must carry; a write with the wrong token
+// (because the lane has been released, and perhaps claimed by
+// someone else) does nothing. So each ring has one writer and one
+// reader, just like a soundStreamInfo's, and no locks are needed
+// anywhere.
+
+// Every lane's ring is read at the same position, the stream's; a
+// lane that nobody has claimed, or whose producer has fallen behind,
+// just adds nothing. A claimed lane that runs dry counts a fault.
+
+// The memory belongs to everyone holding a reference: the stream
+// (until it's done), and each place's handle. Handing the stream to
+// another place takes a reference first (placeStreamRetain), which
+// the other place's handle then owns, so the stream can't vanish
+// while the message is in flight.
+
+#define PLACE_MAX_LANES 32
+// the callback mixes this many frames at a time:
+#define PLACE_CHUNK 512
+
+typedef struct placeLane{
+  // 0 if unclaimed, otherwise the claimant's token.
+  int owner;
+  // only mutated by the callback:
+  unsigned long lastFrameRead;
+  unsigned long faults;
+  // only mutated by the lane's producer:
+  unsigned long lastFrameWritten;
+  short *buffer;
+  // pad each lane out to its own cache lines, so that producers in
+  // different places don't fight over them:
+  char pad[64];
+} placeLane;
+
+typedef struct placeStream{
+  int refs;
+  int lanes;
+  // a power of two, so that the frame counts can wrap:
+  unsigned long bufferFrames;
+  // the next claim token:
+  int nextToken;
+  // set by anyone, to end the stream:
+  int stopRequested;
+  // set by the stream-finished callback:
+  int done;
+  unsigned long framesPlayed;
+  // limits the mix in place of clipping it (see limiter.c), or NULL;
+  // the stream holds a reference to it.
+  limiterState *limiter;
+  placeLane lane[PLACE_MAX_LANES];
+  int acc[PLACE_CHUNK * CHANNELS];
+} placeStream;
+
+// a stream with 'lanes' lanes, each with room for at least
+// 'bufferFrames' frames, and one reference, for its creator.
+placeStream *placeStreamNew(int lanes, unsigned long bufferFrames){
+  placeStream *ps;
+  unsigned long frames = 1024;
+  int i;
+  if (lanes < 1 || lanes > PLACE_MAX_LANES) {
+    return NULL;
+  }
+  while (frames < bufferFrames) {
+    frames *= 2;
+  }
+  ps = (placeStream *)arenaCalloc(sizeof(placeStream));
+  if (ps == NULL) {
+    return NULL;
+  }
+  ps->refs = 1;
+  ps->lanes = lanes;
+  ps->bufferFrames = frames;
+  ps->nextToken = 1;
+  for (i = 0; i < lanes; i++) {
+    ps->lane[i].buffer = (short *)arenaCalloc(FRAMES_TO_BYTES(frames));
+    if (ps->lane[i].buffer == NULL) {
+      for (i = i - 1; i >= 0; i--) {
+        arenaFree(ps->lane[i].buffer);
+      }
+      arenaFree(ps);
+      return NULL;
+    }
+  }
+  return ps;
+}
+
+void placeStreamRetain(placeStream *ps){
+  RS_ATOMIC_ADD(&ps->refs,1);
+}
+
+void placeStreamRelease(placeStream *ps){
+  int i;
+  if (RS_ATOMIC_ADD(&ps->refs,-1) == 1) {
+    for (i = 0; i < ps->lanes; i++) {
+      arenaFree(ps->lane[i].buffer);
+    }
+    if (ps->limiter) {
+      limiterDetach(ps->limiter);
+    }
+    arenaFree(ps);
+  }
+}
+
+// give the stream a limiter, attached with limiterAttach, whose
+// reference the stream then owns. Only before the stream starts.
+void placeStreamSetLimiter(placeStream *ps, limiterState *ls){
+  ps->limiter = ls;
+}
+
+// claim the given lane, or the first free one if 'lane' is -1.
+// Returns the token (which also says which lane: see placeTokenLane),
+// or 0 if there's no such free lane.
+int placeLaneClaim(placeStream *ps, int lane){
+  int token;
+  int i, from = 0, to = ps->lanes;
+  if (lane >= ps->lanes) {
+    return 0;
+  }
+  if (lane >= 0) {
+    from = lane;
+    to = lane + 1;
+  }
+  for (i = from; i < to; i++) {
+    if (RS_ATOMIC_LOAD(&ps->lane[i].owner) == 0) {
+      // the lane number lives in the token's low bits, and the rest
+      // is never 0 (nor negative):
+      token = (((RS_ATOMIC_ADD(&ps->nextToken,1) & 0xffffff) + 1) << 5) | i;
+      if (RS_ATOMIC_CAS(&ps->lane[i].owner,0,token)) {
+        // anything the last owner left queued plays first:
+        return token;
+      }
+    }
+  }
+  return 0;
+}
+
+int placeTokenLane(int token){
+  return token & (PLACE_MAX_LANES - 1);
+}
+
+static placeLane *ownedLane(placeStream *ps, int token){
+  int i = placeTokenLane(token);
+  if (token <= 0 || i >= ps->lanes || RS_ATOMIC_LOAD(&ps->lane[i].owner) != token) {
+    return NULL;
+  }
+  return &ps->lane[i];
+}
+
+// give the lane up. Anything already written still plays.
+void placeLaneRelease(placeStream *ps, int token){
+  placeLane *l = ownedLane(ps,token);
+  if (l != NULL) {
+    RS_ATOMIC_CAS(&l->owner,token,0);
+  }
+}
+
+// the first frame the producer may write, catching up with the
+// callback if it has fallen behind.
+static unsigned long writePosition(placeLane *l){
+  unsigned long read = RS_ATOMIC_LOAD(&l->lastFrameRead);
+  return (l->lastFrameWritten < read) ? read : l->lastFrameWritten;
+}
+
+// the number of frames that can be written at the lane's write
+// position without wrapping, and where they go. Returns -1 if the
+// token isn't the lane's.
+long placeLaneRegion(placeStream *ps, int token, short **where){
+  placeLane *l = ownedLane(ps,token);
+  unsigned long start, room, offset;
+  if (l == NULL) {
+    return -1;
+  }
+  start = writePosition(l);
+  room = RS_ATOMIC_LOAD(&l->lastFrameRead) + ps->bufferFrames - start;
+  offset = start & (ps->bufferFrames - 1);
+  *where = l->buffer + offset * CHANNELS;
+  return (long)MYMIN(room, ps->bufferFrames - offset);
+}
+
+// the producer has written 'frames' frames at the region.
+void placeLaneCommit(placeStream *ps, int token, unsigned long frames){
+  placeLane *l = ownedLane(ps,token);
+  if (l != NULL) {
+    // the samples have to be there before the callback sees the count:
+    RS_ATOMIC_STORE(&l->lastFrameWritten,writePosition(l) + frames);
+  }
+}
+
+// copy in as many of the given frames as there's room for, and
+// return the number copied (or -1 if the token isn't the lane's).
+long placeLaneWrite(placeStream *ps, int token, const short *frames,
+                    unsigned long count){
+  unsigned long done = 0;
+  long n;
+  short *where;
+  while (done < count) {
+    n = placeLaneRegion(ps,token,&where);
+    if (n < 0) {
+      return done ? (long)done : -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    n = (long)MYMIN((unsigned long)n, count - done);
+    memcpy(where,frames + done * CHANNELS,FRAMES_TO_BYTES(n));
+    placeLaneCommit(ps,token,(unsigned long)n);
+    done += (unsigned long)n;
+  }
+  return (long)done;
+}
+
+// frames written to the lane and not yet played.
+unsigned long placeLaneQueued(placeStream *ps, int lane){
+  placeLane *l = &ps->lane[lane];
+  unsigned long read = RS_ATOMIC_LOAD(&l->lastFrameRead);
+  unsigned long written = RS_ATOMIC_LOAD(&l->lastFrameWritten);
+  return (written > read) ? written - read : 0;
+}
+
+unsigned long placeLaneFaults(placeStream *ps, int lane){
+  return RS_ATOMIC_LOAD(&ps->lane[lane].faults);
+}
+
+int placeLaneClaimed(placeStream *ps, int lane){
+  return RS_ATOMIC_LOAD(&ps->lane[lane].owner) != 0;
+}
+
+void placeStreamStop(placeStream *ps){
+  RS_ATOMIC_STORE(&ps->stopRequested,1);
+}
+
+int placeStreamDone(placeStream *ps){
+  return RS_ATOMIC_LOAD(&ps->done);
+}
+
+unsigned long placeStreamFramesPlayed(placeStream *ps){
+  return RS_ATOMIC_LOAD(&ps->framesPlayed);
+}
+
+int placeStreamLanes(placeStream *ps){
+  return ps->lanes;
+}
+
+// add 'frames' frames of the lane, from 'at', into the accumulator,
+// returning the number there were.
+static unsigned long mixLane(placeStream *ps, placeLane *l, unsigned long at,
+                             unsigned long frames, int first){
+  unsigned long written = RS_ATOMIC_LOAD(&l->lastFrameWritten);
+  unsigned long n = (written > at) ? MYMIN(written - at, frames) : 0;
+  unsigned long offset = at & (ps->bufferFrames - 1);
+  unsigned long toEnd = MYMIN(n, ps->bufferFrames - offset);
+  kernelAccumulate(ps->acc,l->buffer + offset * CHANNELS,toEnd * CHANNELS,first);
+  kernelAccumulate(ps->acc + toEnd * CHANNELS,l->buffer,(n - toEnd) * CHANNELS,first);
+  if (first && n < frames) {
+    memset(ps->acc + n * CHANNELS,0,(frames - n) * CHANNELS * sizeof(int));
+  }
+  return n;
+}
+
+int placeStreamCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  placeStream *ps = (placeStream *)userData;
+  short *out = (short *)output;
+  unsigned long at = ps->framesPlayed;
+  unsigned long n, got, shortfall[PLACE_MAX_LANES];
+  int i;
+
+  if (RS_ATOMIC_LOAD(&ps->stopRequested)) {
+    memset(out,0,FRAMES_TO_BYTES(frameCount));
+    return paComplete;
+  }
+  for (i = 0; i < ps->lanes; i++) {
+    shortfall[i] = 0;
+  }
+  while (frameCount > 0) {
+    n = MYMIN(frameCount, PLACE_CHUNK);
+    for (i = 0; i < ps->lanes; i++) {
+      got = mixLane(ps,&ps->lane[i],at,n,i == 0);
+      shortfall[i] += n - got;
+    }
+    if (ps->limiter) {
+      limiterProcessWide(ps->limiter,ps->acc,out,n);
+    } else {
+      kernelSaturate(out,ps->acc,n * CHANNELS);
+    }
+    out += n * CHANNELS;
+    at += n;
+    frameCount -= n;
+  }
+  for (i = 0; i < ps->lanes; i++) {
+    if (shortfall[i] > 0 && RS_ATOMIC_LOAD(&ps->lane[i].owner) != 0) {
+      RS_ATOMIC_STORE(&ps->lane[i].faults,ps->lane[i].faults + 1);
+    }
+    RS_ATOMIC_STORE(&ps->lane[i].lastFrameRead,at);
+  }
+  RS_ATOMIC_STORE(&ps->framesPlayed,at);
+  return paContinue;
+}
+
+// the stream-finished callback; drops the stream's reference.
+void placeStreamFinished(placeStream *ps){
+  RS_ATOMIC_STORE(&ps->done,1);
+  placeStreamRelease(ps);
+}
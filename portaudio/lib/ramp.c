@@ -0,0 +1,280 @@
+#include <math.h>
+#include "callbacks.h"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+// This file provides gain controls for sounds played by the
+// copying callback: a left and right gain that Racket can change
+// while the sound plays, either at once or with a linear or
+// exponential ramp that starts on a given frame. Frames are
+// counted as they're played, starting from zero; unless the
+// playback rate has been changed (see varispeed.c), that's the
+// same as counting frames of the sound.
+// The gains are applied as the samples are copied, so fading or
+// ducking a sound doesn't mean rendering it again.
+
+// Racket hands the callback one command at a time, through the
+// 'pending' ramp in the control. 'generation' works like a
+// seqlock: Racket makes it odd, writes the ramp, and makes it
+// even again. The callback only takes a ramp that it saw the
+// same even generation on both before and after copying it; if
+// Racket was in the middle of a write, the callback just picks
+// the ramp up on the next buffer. A new ramp replaces any ramp
+// that's still waiting or running, starting from whatever gain
+// the old one had reached.
+
+// exponential ramps are computed exactly every EXP_STEP frames
+// and linearly in between, so the inner loop stays the same
+// for both shapes.
+#define EXP_STEP 64
+// an exponential ramp can't start or end at zero; it starts or
+// ends at this (-80 dB) instead, and then snaps to the target.
+#define EXP_FLOOR 1e-4f
+
+playbackControl *playbackControlNew(float left, float right){
+  playbackControl *pc = (playbackControl *)arenaCalloc(sizeof(playbackControl));
+  if (pc == NULL) {
+    return NULL;
+  }
+  pc->refs = 1;
+  pc->left = left;
+  pc->right = right;
+  pc->rate = 1.0;
+  pc->rateTarget = 1.0;
+  return pc;
+}
+
+// the copying info takes a reference of its own; it's released
+// by freeCopyingInfo.
+void playbackControlAttach(soundCopyingInfo *ri, playbackControl *pc){
+  RS_ATOMIC_ADD(&pc->refs,1);
+  // a request to leave the last sound's loop doesn't apply to this one
+  pc->loopExit = 0;
+  ri->control = pc;
+}
+
+void playbackControlRelease(playbackControl *pc){
+  if (RS_ATOMIC_ADD(&pc->refs,-1) == 1) {
+    arenaFree(pc);
+  }
+}
+
+// called only by Racket.
+void playbackControlRamp(playbackControl *pc, double targetLeft, double targetRight,
+                         unsigned long frames, unsigned long startFrame,
+                         int shape, int stopAtEnd){
+  unsigned int gen = pc->generation;
+  RS_ATOMIC_STORE(&pc->generation,gen+1);
+  RS_FENCE();
+  pc->pending.targetLeft = (float)targetLeft;
+  pc->pending.targetRight = (float)targetRight;
+  pc->pending.frames = frames;
+  pc->pending.startFrame = startFrame;
+  pc->pending.shape = shape;
+  pc->pending.stopAtEnd = stopAtEnd;
+  RS_ATOMIC_STORE(&pc->generation,gen+2);
+}
+
+// the gain the callback last applied to the given channel
+// (0 is left, 1 is right).
+double playbackControlGain(playbackControl *pc, int channel){
+  return (channel == 0) ? pc->left : pc->right;
+}
+
+// nonzero while a ramp is waiting to start or running, including
+// one that Racket has sent that the callback hasn't seen yet.
+int playbackControlBusy(playbackControl *pc){
+  return (RS_ATOMIC_LOAD(&pc->generation) != pc->seenGeneration
+          || pc->rampWaiting || pc->rampActive);
+}
+
+// pick up a new command from Racket, if there is one.
+static void pollRamp(playbackControl *pc){
+  unsigned int before = RS_ATOMIC_LOAD(&pc->generation);
+  unsigned int after;
+  playbackRamp ramp;
+  if (before == pc->seenGeneration || (before & 1)) {
+    return;
+  }
+  ramp = pc->pending;
+  RS_FENCE();
+  after = RS_ATOMIC_LOAD(&pc->generation);
+  if (after != before) {
+    return;
+  }
+  pc->seenGeneration = before;
+  pc->ramp = ramp;
+  pc->rampWaiting = 1;
+  pc->rampActive = 0;
+}
+
+static float expGain(float from, float to, double fraction){
+  from = MYMAX(from,EXP_FLOOR);
+  to = MYMAX(to,EXP_FLOOR);
+  return (float)(from * pow(to / from, fraction));
+}
+
+// copy 'frames' frames, scaling frame i by left + i*dLeft and
+// right + i*dRight.
+static void gainSegment(short *out, const short *in, unsigned long frames,
+                        float left, float dLeft, float right, float dRight){
+  unsigned long i = 0;
+#ifdef __SSE2__
+  // four frames at a time: two registers of two stereo frames.
+  __m128 base = _mm_set_ps(right,left,right,left);
+  __m128 slope = _mm_set_ps(dRight,dLeft,dRight,dLeft);
+  __m128 offsets = _mm_set_ps(1.0f,1.0f,0.0f,0.0f);
+  __m128 two = _mm_set1_ps(2.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 signBit = _mm_set1_ps(-0.0f);
+  const __m128 hiLimit = _mm_set1_ps(32767.0f);
+  const __m128 loLimit = _mm_set1_ps(-32768.0f);
+  __m128 idx, gLo, gHi, fLo, fHi;
+  __m128i raw, lo, hi;
+  for (; i + 4 <= frames; i += 4) {
+    idx = _mm_add_ps(_mm_set1_ps((float)i),offsets);
+    gLo = _mm_add_ps(base,_mm_mul_ps(idx,slope));
+    gHi = _mm_add_ps(base,_mm_mul_ps(_mm_add_ps(idx,two),slope));
+    raw = _mm_loadu_si128((const __m128i *)(in + i * CHANNELS));
+    // sign-extend the shorts into ints
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw,raw),16);
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw,raw),16);
+    fLo = _mm_mul_ps(_mm_cvtepi32_ps(lo),gLo);
+    fHi = _mm_mul_ps(_mm_cvtepi32_ps(hi),gHi);
+    // zero NaNs and clip first, so that nothing outside the int range
+    // converts to the "integer indefinite" value; then round as
+    // rsToSampleF does, adding a half with the sample's sign and
+    // truncating:
+    fLo = _mm_and_ps(fLo,_mm_cmpord_ps(fLo,fLo));
+    fHi = _mm_and_ps(fHi,_mm_cmpord_ps(fHi,fHi));
+    fLo = _mm_max_ps(loLimit,_mm_min_ps(hiLimit,fLo));
+    fHi = _mm_max_ps(loLimit,_mm_min_ps(hiLimit,fHi));
+    fLo = _mm_add_ps(fLo,_mm_or_ps(half,_mm_and_ps(fLo,signBit)));
+    fHi = _mm_add_ps(fHi,_mm_or_ps(half,_mm_and_ps(fHi,signBit)));
+    _mm_storeu_si128((__m128i *)(out + i * CHANNELS),
+                     _mm_packs_epi32(_mm_cvttps_epi32(fLo),_mm_cvttps_epi32(fHi)));
+  }
+#endif
+  for (; i < frames; i++) {
+    out[i*CHANNELS]   = rsToSampleF(in[i*CHANNELS]   * (left + (float)i * dLeft));
+    out[i*CHANNELS+1] = rsToSampleF(in[i*CHANNELS+1] * (right + (float)i * dRight));
+  }
+}
+
+// copy at the control's current, steady gains.
+static void steadySegment(playbackControl *pc, short *out, const short *in,
+                          unsigned long frames){
+  if (pc->left == 1.0f && pc->right == 1.0f) {
+    if (out != in) {
+      memcpy(out,in,FRAMES_TO_BYTES(frames));
+    }
+  } else {
+    gainSegment(out,in,frames,pc->left,0.0f,pc->right,0.0f);
+  }
+}
+
+// the gain 'pos' frames into the running ramp.
+static float rampGain(playbackControl *pc, float from, float to, unsigned long pos){
+  double fraction = (double)pos / (double)pc->ramp.frames;
+  if (pc->ramp.shape == RAMP_EXPONENTIAL) {
+    return expGain(from,to,fraction);
+  } else {
+    return (float)(from + (to - from) * fraction);
+  }
+}
+
+// apply the gains to 'frames' frames going from 'in' to 'out' (which
+// may be the same buffer). 'clock' is the number of frames played
+// before these ones. Returns the number of frames done, and sets
+// *stopped if a ramp ended the sound.
+static unsigned long controlledGain(playbackControl *pc, short *out, const short *in,
+                                    unsigned long frames, unsigned long clock,
+                                    int *stopped){
+  unsigned long done = 0;
+  unsigned long seg;
+  float left0, right0, left1, right1;
+
+  *stopped = 0;
+  pollRamp(pc);
+  while (done < frames) {
+    if (pc->rampWaiting) {
+      if (pc->ramp.startFrame == RAMP_NOW || pc->ramp.startFrame <= clock + done) {
+        pc->rampWaiting = 0;
+        pc->startLeft = pc->left;
+        pc->startRight = pc->right;
+        pc->rampPos = 0;
+        if (pc->ramp.frames == 0) {
+          pc->left = pc->ramp.targetLeft;
+          pc->right = pc->ramp.targetRight;
+          if (pc->ramp.stopAtEnd) {
+            *stopped = 1;
+            return done;
+          }
+        } else {
+          pc->rampActive = 1;
+        }
+        continue;
+      }
+      seg = MYMIN(frames - done, pc->ramp.startFrame - (clock + done));
+      steadySegment(pc,out,in,seg);
+    } else if (pc->rampActive) {
+      seg = MYMIN(frames - done, pc->ramp.frames - pc->rampPos);
+      if (pc->ramp.shape == RAMP_EXPONENTIAL) {
+        seg = MYMIN(seg, EXP_STEP - (pc->rampPos % EXP_STEP));
+      }
+      left0 = rampGain(pc,pc->startLeft,pc->ramp.targetLeft,pc->rampPos);
+      right0 = rampGain(pc,pc->startRight,pc->ramp.targetRight,pc->rampPos);
+      left1 = rampGain(pc,pc->startLeft,pc->ramp.targetLeft,pc->rampPos + seg);
+      right1 = rampGain(pc,pc->startRight,pc->ramp.targetRight,pc->rampPos + seg);
+      gainSegment(out,in,seg,left0,(left1 - left0) / seg,right0,(right1 - right0) / seg);
+      pc->rampPos += seg;
+      pc->left = left1;
+      pc->right = right1;
+      if (pc->rampPos == pc->ramp.frames) {
+        // land exactly on the target, whatever the rounding did
+        pc->left = pc->ramp.targetLeft;
+        pc->right = pc->ramp.targetRight;
+        pc->rampActive = 0;
+        if (pc->ramp.stopAtEnd) {
+          *stopped = 1;
+          return done + seg;
+        }
+      }
+    } else {
+      seg = frames - done;
+      steadySegment(pc,out,in,seg);
+    }
+    done += seg;
+    out += seg * CHANNELS;
+    in += seg * CHANNELS;
+  }
+  return done;
+}
+
+unsigned long controlledCopy(soundCopyingInfo *ri, short *output, unsigned long frames){
+  playbackControl *pc = ri->control;
+  unsigned long framesLeft = (ri->numSamples - ri->curSample) / CHANNELS;
+  unsigned long n;
+  unsigned long done;
+  int stopped;
+
+  if (varispeedActive(ri)) {
+    // resample into the output, then apply the gains in place
+    n = varispeedRender(ri,output,frames);
+    done = controlledGain(pc,output,output,n,ri->framesPlayed,&stopped);
+  } else if (loopActive(ri) || ri->packed) {
+    // loop (or decode) into the output, then apply the gains in place
+    n = loopCopy(ri,output,frames);
+    done = controlledGain(pc,output,output,n,ri->framesPlayed,&stopped);
+  } else {
+    n = MYMIN(frames,framesLeft);
+    done = controlledGain(pc,output,ri->sound + ri->curSample,n,ri->framesPlayed,&stopped);
+    ri->curSample += done * CHANNELS;
+  }
+  ri->framesPlayed += done;
+  if (stopped) {
+    ri->curSample = ri->numSamples;
+  }
+  return done;
+}
@@ -0,0 +1,405 @@
+#include "callbacks.h"
+
+// This file provides recorders: recording of unknown length. The
+// recording callback appends what it's given to a chunk of fixed
+// size, and when the chunk is full it seals it and takes the next
+// one. The chunks are made ahead of time by a native thread of the
+// recorder's own, which keeps a few spares where the callback can
+// reach them, and moves the sealed ones to a list that Racket takes
+// them from. So the callback never allocates or waits, and nothing
+// is copied after it: a sealed chunk belongs to Racket, which reads
+// its samples where they are (see s16vec-record.rkt) and frees it.
+
+// If there's no spare chunk when the callback needs one (because
+// the thread was held up), the input is dropped and counted, and
+// the next chunk starts later in the stream; each chunk says where
+// in the stream it starts.
+
+// A recording ends when Racket stops the stream, or when it reaches
+// its maximum length, if it has one; in either case the last chunk
+// is sealed with the frames it has, however few.
+
+// The recorder itself is shared by Racket and the stream, each with
+// a reference; whichever lets go last frees it. The stream lets go
+// in its finished callback (recorderStreamFinished), which lifecycle.c
+// calls at close if portaudio never did. Racket stops the thread
+// before it lets go (see recorderRelease), so the free never has to
+// join it, and the finished callback never waits.
+
+// the rings between the callback and the thread; a power of two.
+#define REC_SLOTS 32
+// how often the thread looks at the rings, in milliseconds:
+#define REC_REFILL_MILLIS 10
+
+// must agree with _record-chunk in s16vec-record.rkt. The samples
+// follow the header, in the same block.
+typedef struct recordChunk{
+  short *samples;
+  unsigned long frames;
+  // the stream's frame count at the start of the chunk:
+  unsigned long startFrame;
+  // the next sealed chunk, while the recorder has it:
+  struct recordChunk *next;
+} recordChunk;
+
+// must agree with _recorder-stats in s16vec-record.rkt.
+typedef struct recorderStats{
+  // frames recorded, and dropped for want of a chunk:
+  unsigned long frames;
+  unsigned long droppedFrames;
+  unsigned long chunksMade;
+  unsigned long chunksSealed;
+  // times the thread couldn't get memory for a chunk:
+  unsigned long allocFailures;
+} recorderStats;
+
+typedef struct recorder{
+  unsigned long chunkFrames;
+  // the most frames to record, or 0 for no limit:
+  unsigned long maxFrames;
+  // the number of spares the thread keeps ready:
+  unsigned int spareTarget;
+
+  // spares, from the thread to the callback:
+  recordChunk *spares[REC_SLOTS];
+  unsigned int sparesPut;
+  unsigned int sparesTaken;
+  // sealed chunks, from the callback to the thread:
+  recordChunk *sealed[REC_SLOTS];
+  unsigned int sealedPut;
+  unsigned int sealedTaken;
+
+  // only touched by the callback (and by recorderFinish, once the
+  // callback is done):
+  recordChunk *current;
+  // frames the stream has delivered, recorded or not:
+  unsigned long position;
+
+  // sealed chunks waiting for Racket, oldest first; under the lock.
+  recordChunk *readyFirst;
+  recordChunk *readyLast;
+
+  // set once the callback has recorded all it will:
+  int done;
+  // set once the stream has finished, so the callback won't run:
+  int finished;
+  int refs;
+
+  // if the input is being analyzed (see spectrum.c), the analyzer;
+  // the recorder holds a reference to it.
+  spectrumAnalyzer *spectrum;
+
+  rsMutex lock;
+  rsCond cond;
+  rsThread thread;
+  int threadStarted;
+  int stopRequested;
+
+  // only mutated by the callback, except chunksMade and
+  // allocFailures, which only the thread touches.
+  recorderStats stats;
+} recorder;
+
+static recordChunk *chunkNew(recorder *r){
+  recordChunk *c = (recordChunk *)arenaAlloc(sizeof(recordChunk)
+                                             + FRAMES_TO_BYTES(r->chunkFrames));
+  if (c == NULL) {
+    r->stats.allocFailures += 1;
+    return NULL;
+  }
+  c->samples = (short *)(c + 1);
+  c->frames = 0;
+  c->startFrame = 0;
+  c->next = NULL;
+  r->stats.chunksMade += 1;
+  return c;
+}
+
+// hand a full (or final) chunk to the thread. Only the callback
+// calls this, or recorderFinish once the callback is done.
+static void seal(recorder *r, recordChunk *c){
+  unsigned int put = r->sealedPut;
+  if (put - RS_ATOMIC_LOAD(&r->sealedTaken) == REC_SLOTS) {
+    // can't happen while the thread keeps no more than REC_SLOTS - 1
+    // spares, but if it does, the chunk's sound is lost, and the
+    // chunk is used again.
+    r->stats.droppedFrames += c->frames;
+    r->stats.frames -= c->frames;
+    c->frames = 0;
+    c->startFrame = r->position;
+    return;
+  }
+  r->sealed[put & (REC_SLOTS - 1)] = c;
+  RS_ATOMIC_STORE(&r->sealedPut,put + 1);
+  r->stats.chunksSealed += 1;
+  r->current = NULL;
+}
+
+static recordChunk *takeSpare(recorder *r){
+  unsigned int taken = r->sparesTaken;
+  recordChunk *c;
+  if (taken == RS_ATOMIC_LOAD(&r->sparesPut)) {
+    return NULL;
+  }
+  c = r->spares[taken & (REC_SLOTS - 1)];
+  RS_ATOMIC_STORE(&r->sparesTaken,taken + 1);
+  return c;
+}
+
+// the recording callback. Records two channels of 16-bit input.
+int recordingCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  recorder *r = (recorder *)userData;
+  const short *in = (const short *)input;
+  unsigned long left = frameCount;
+  unsigned long n;
+  recordChunk *c;
+
+  if (r->maxFrames && r->position + left > r->maxFrames) {
+    left = r->maxFrames - r->position;
+  }
+  if (r->spectrum && in != NULL) {
+    spectrumWrite(r->spectrum,in,left);
+  }
+  while (left > 0) {
+    c = r->current;
+    if (c == NULL) {
+      c = takeSpare(r);
+      if (c == NULL) {
+        // nowhere to put it:
+        r->stats.droppedFrames += left;
+        r->position += left;
+        break;
+      }
+      c->frames = 0;
+      c->startFrame = r->position;
+      r->current = c;
+    }
+    n = MYMIN(left, r->chunkFrames - c->frames);
+    if (in != NULL) {
+      memcpy(c->samples + c->frames * CHANNELS,in,FRAMES_TO_BYTES(n));
+      in += n * CHANNELS;
+    } else {
+      memset(c->samples + c->frames * CHANNELS,0,FRAMES_TO_BYTES(n));
+    }
+    c->frames += n;
+    r->stats.frames += n;
+    r->position += n;
+    left -= n;
+    if (c->frames == r->chunkFrames) {
+      seal(r,c);
+    }
+  }
+  if (r->maxFrames && r->position >= r->maxFrames) {
+    if (r->current != NULL && r->current->frames > 0) {
+      seal(r,r->current);
+    }
+    RS_ATOMIC_STORE(&r->done,1);
+    return paComplete;
+  }
+  return paContinue;
+}
+
+// move the sealed chunks to the list for Racket. The caller holds
+// the lock.
+static void collectSealed(recorder *r){
+  unsigned int put = RS_ATOMIC_LOAD(&r->sealedPut);
+  unsigned int taken = r->sealedTaken;
+  recordChunk *c;
+  while (taken != put) {
+    c = r->sealed[taken & (REC_SLOTS - 1)];
+    c->next = NULL;
+    if (r->readyLast == NULL) {
+      r->readyFirst = c;
+    } else {
+      r->readyLast->next = c;
+    }
+    r->readyLast = c;
+    taken++;
+  }
+  RS_ATOMIC_STORE(&r->sealedTaken,taken);
+}
+
+static void refillSpares(recorder *r){
+  unsigned int put = r->sparesPut;
+  recordChunk *c;
+  while (put - RS_ATOMIC_LOAD(&r->sparesTaken) < r->spareTarget) {
+    c = chunkNew(r);
+    if (c == NULL) {
+      break;
+    }
+    r->spares[put & (REC_SLOTS - 1)] = c;
+    put++;
+    RS_ATOMIC_STORE(&r->sparesPut,put);
+  }
+}
+
+static void recorderThread(void *arg){
+  recorder *r = (recorder *)arg;
+  rsMutexLock(&r->lock);
+  while (!r->stopRequested) {
+    collectSealed(r);
+    rsMutexUnlock(&r->lock);
+    refillSpares(r);
+    rsMutexLock(&r->lock);
+    rsCondTimedWait(&r->cond,&r->lock,REC_REFILL_MILLIS);
+  }
+  collectSealed(r);
+  rsMutexUnlock(&r->lock);
+}
+
+// a recorder whose chunks hold 'chunkFrames' frames, with 'spares'
+// of them ready at all times, that stops after 'maxFrames' frames
+// (0 for never). It holds two references: Racket's, and the
+// stream's. Returns NULL if there's no memory or no thread. Called
+// only by Racket.
+recorder *recorderNew(unsigned long chunkFrames, unsigned int spares,
+                      unsigned long maxFrames){
+  recorder *r = (recorder *)arenaCalloc(sizeof(recorder));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->chunkFrames = MYMAX(chunkFrames, 1);
+  r->maxFrames = maxFrames;
+  r->spareTarget = MYMIN(MYMAX(spares, 1), REC_SLOTS - 1);
+  r->refs = 2;
+  rsMutexInit(&r->lock);
+  rsCondInit(&r->cond);
+  // the first spares are made here, so the recording can start
+  // right away:
+  refillSpares(r);
+  if (RS_ATOMIC_LOAD(&r->sparesPut) == 0
+      || rsThreadCreate(&r->thread,recorderThread,r) != 0) {
+    while (r->sparesTaken != r->sparesPut) {
+      arenaFree(r->spares[r->sparesTaken++ & (REC_SLOTS - 1)]);
+    }
+    rsCondDestroy(&r->cond);
+    rsMutexDestroy(&r->lock);
+    arenaFree(r);
+    return NULL;
+  }
+  r->threadStarted = 1;
+  return r;
+}
+
+static void stopThread(recorder *r){
+  rsMutexLock(&r->lock);
+  r->stopRequested = 1;
+  rsCondBroadcast(&r->cond);
+  rsMutexUnlock(&r->lock);
+  if (r->threadStarted) {
+    rsThreadJoin(r->thread);
+    r->threadStarted = 0;
+  }
+}
+
+// the thread is stopped already: Racket's reference is dropped only
+// by recorderRelease, which stops it first.
+static void recorderFree(recorder *r){
+  recordChunk *c;
+  recordChunk *next;
+  for (c = r->readyFirst; c != NULL; c = next) {
+    next = c->next;
+    arenaFree(c);
+  }
+  while (r->sealedTaken != r->sealedPut) {
+    arenaFree(r->sealed[r->sealedTaken++ & (REC_SLOTS - 1)]);
+  }
+  while (r->sparesTaken != r->sparesPut) {
+    arenaFree(r->spares[r->sparesTaken++ & (REC_SLOTS - 1)]);
+  }
+  arenaFree(r->current);
+  if (r->spectrum) {
+    spectrumRelease(r->spectrum);
+  }
+  rsCondDestroy(&r->cond);
+  rsMutexDestroy(&r->lock);
+  arenaFree(r);
+}
+
+static void dropReference(recorder *r){
+  if (RS_ATOMIC_ADD(&r->refs,-1) == 1) {
+    recorderFree(r);
+  }
+}
+
+// analyze the input as it's recorded. The reference to the analyzer
+// (see spectrumRetain) becomes the recorder's, which releases it
+// when it's freed. Must be called before the stream starts. Called
+// only by Racket.
+void recorderSetSpectrum(recorder *r, spectrumAnalyzer *sa){
+  r->spectrum = sa;
+}
+
+// the stream's finished callback: the callback won't run again.
+// Racket calls it too, if the stream never opened. If the stream's
+// reference is the last, this frees the recorder, but doesn't wait
+// for anything: the thread was stopped when Racket let go.
+void recorderStreamFinished(void *userData){
+  recorder *r = (recorder *)userData;
+  RS_ATOMIC_STORE(&r->done,1);
+  RS_ATOMIC_STORE(&r->finished,1);
+  dropReference(r);
+}
+
+// has the callback recorded all it will? Called only by Racket.
+int recorderDone(recorder *r){
+  return RS_ATOMIC_LOAD(&r->done);
+}
+
+// has the stream finished? Called only by Racket.
+int recorderFinished(recorder *r){
+  return RS_ATOMIC_LOAD(&r->finished);
+}
+
+// once the stream is finished: seal the last chunk, however short,
+// and stop the thread. Called only by Racket.
+void recorderFinish(recorder *r){
+  stopThread(r);
+  if (r->current != NULL && r->current->frames > 0) {
+    seal(r,r->current);
+  }
+  rsMutexLock(&r->lock);
+  collectSealed(r);
+  rsMutexUnlock(&r->lock);
+}
+
+// the oldest sealed chunk, which now belongs to the caller, or NULL
+// if there's none yet. Called only by Racket.
+recordChunk *recorderTake(recorder *r){
+  recordChunk *c;
+  rsMutexLock(&r->lock);
+  // don't wait for the thread to notice:
+  collectSealed(r);
+  c = r->readyFirst;
+  if (c != NULL) {
+    r->readyFirst = c->next;
+    if (r->readyFirst == NULL) {
+      r->readyLast = NULL;
+    }
+    c->next = NULL;
+  }
+  rsMutexUnlock(&r->lock);
+  return c;
+}
+
+void recorderGetStats(recorder *r, recorderStats *out){
+  *out = r->stats;
+}
+
+// stop the thread and drop Racket's reference, so that if the
+// stream's is the last, its finished callback has nothing to join.
+// Chunks already taken aren't affected. Called only by Racket.
+void recorderRelease(recorder *r){
+  stopThread(r);
+  dropReference(r);
+}
+
+void recordChunkFree(recordChunk *c){
+  arenaFree(c);
+}
@@ -0,0 +1,123 @@
+#ifndef RSOUND_SHARED_RING_H
+#define RSOUND_SHARED_RING_H
+
+// A shared ring is a streaming ring buffer that lives in a named
+// POSIX shared-memory segment, so that another process can write
+// sound straight into it and the streaming callback can play it,
+// without the samples passing through Racket. Racket makes the
+// segment (see make-shared-ring in shared-ring.rkt) and plays it;
+// the other process opens it by name and writes to it.
+
+// Unlike callbacks.h, this header is meant to be included by those
+// other processes; it doesn't depend on anything else here. The
+// functions below are all a producer needs. They use the gcc/clang
+// atomic builtins.
+
+// The ring works just like a soundStreamInfo's: frame counters that
+// only go up, one written only by the callback (lastFrameRead) and
+// one written only by the producer (lastFrameWritten). The producer
+// may write up to bufferFrames frames past lastFrameRead. If it falls
+// behind, the callback plays silence, counts a fault, and moves on;
+// the producer then skips ahead to where the callback is. Samples are
+// 16-bit signed, two interleaved channels.
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHARED_RING_MAGIC 0x52534852u
+#define SHARED_RING_VERSION 1
+#define SHARED_RING_CHANNELS 2
+#define SHARED_RING_FRAME_BYTES (SHARED_RING_CHANNELS * 2)
+// the samples start this far into the segment:
+#define SHARED_RING_DATA_OFFSET 256
+
+typedef struct sharedRingHeader{
+  // fixed when the ring is made:
+  uint32_t magic;
+  uint32_t version;
+  uint32_t channels;
+  uint32_t bufferFrames;
+  uint32_t dataOffset;
+  // the rate it's being played at, or 0 if it isn't playing yet:
+  uint32_t sampleRate;
+  uint32_t pad0[10];
+  // written only by the callback; each group of fields gets a
+  // cache line of its own.
+  uint32_t lastFrameRead;
+  uint32_t lastOffsetRead;
+  uint32_t faultCount;
+  uint32_t pad1[13];
+  // written only by the producer. Once 'finished' is set, the
+  // stream ends when it has played everything written.
+  uint32_t lastFrameWritten;
+  uint32_t lastOffsetWritten;
+  uint32_t finished;
+  uint32_t pad2[13];
+} sharedRingHeader;
+
+static inline short *sharedRingSamples(sharedRingHeader *h){
+  return (short *)((char *)h + h->dataOffset);
+}
+
+// the number of bytes of the whole segment.
+static inline size_t sharedRingSegmentBytes(uint32_t bufferFrames){
+  return SHARED_RING_DATA_OFFSET + (size_t)bufferFrames * SHARED_RING_FRAME_BYTES;
+}
+
+// how many frames the producer can write right now.
+static inline uint32_t sharedRingWritable(sharedRingHeader *h){
+  uint32_t read = __atomic_load_n(&h->lastFrameRead,__ATOMIC_ACQUIRE);
+  uint32_t written = h->lastFrameWritten;
+  if (written < read) {
+    written = read;
+  }
+  return read + h->bufferFrames - written;
+}
+
+// write as many of the given frames as there's room for, and return
+// the number written.
+static inline uint32_t sharedRingWrite(sharedRingHeader *h, const short *frames,
+                                       uint32_t count){
+  uint32_t read = __atomic_load_n(&h->lastFrameRead,__ATOMIC_ACQUIRE);
+  uint32_t written = h->lastFrameWritten;
+  uint32_t offset = h->lastOffsetWritten;
+  uint32_t bufferBytes = h->bufferFrames * SHARED_RING_FRAME_BYTES;
+  uint32_t bytes, bytesToEnd;
+  char *data = (char *)sharedRingSamples(h);
+  if (written < read) {
+    // the callback ran dry and went on without us; catch up.
+    offset = (offset + ((read - written) % h->bufferFrames) * SHARED_RING_FRAME_BYTES)
+      % bufferBytes;
+    written = read;
+  }
+  if (count > read + h->bufferFrames - written) {
+    count = read + h->bufferFrames - written;
+  }
+  bytes = count * SHARED_RING_FRAME_BYTES;
+  bytesToEnd = bufferBytes - offset;
+  if (bytes > bytesToEnd) {
+    memcpy(data + offset,frames,bytesToEnd);
+    memcpy(data,(const char *)frames + bytesToEnd,bytes - bytesToEnd);
+  } else {
+    memcpy(data + offset,frames,bytes);
+  }
+  h->lastOffsetWritten = (offset + bytes) % bufferBytes;
+  // the samples have to be there before the callback sees the count:
+  __atomic_store_n(&h->lastFrameWritten,written + count,__ATOMIC_RELEASE);
+  return count;
+}
+
+// no more frames are coming; the stream ends once it has played the
+// ones already written.
+static inline void sharedRingFinish(sharedRingHeader *h){
+  __atomic_store_n(&h->finished,1,__ATOMIC_RELEASE);
+}
+
+// is the header one of ours?
+static inline int sharedRingValid(const sharedRingHeader *h){
+  return h->magic == SHARED_RING_MAGIC
+    && h->version == SHARED_RING_VERSION
+    && h->channels == SHARED_RING_CHANNELS;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include "callbacks.h"
+#include "shared-ring.h"
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+// This file is the library's side of shared rings (see shared-ring.h):
+// making and removing the shared-memory segment, and the callback
+// that plays it. The callback is the streamingCallback, with the
+// producer's frame count copied in before it runs and the callback's
+// copied back out afterward; the stream's soundStreamInfo points its
+// buffer at the samples in the segment.
+
+// Shared rings need POSIX shared memory; on Windows, making one
+// always fails.
+
+// make a fresh segment with the given name (which should start with
+// a slash), big enough for 'frames' frames. Returns NULL if the name
+// is taken or there's no memory for it. Called only by Racket.
+sharedRingHeader *sharedRingCreate(const char *name, unsigned int frames){
+#ifdef WIN32
+  return NULL;
+#else
+  size_t bytes = sharedRingSegmentBytes(frames);
+  sharedRingHeader *h;
+  int fd;
+  if (frames == 0) {
+    return NULL;
+  }
+  fd = shm_open(name,O_CREAT | O_EXCL | O_RDWR,0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd,(off_t)bytes) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  h = (sharedRingHeader *)mmap(NULL,bytes,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    shm_unlink(name);
+    return NULL;
+  }
+  // touch every page now, so the callback doesn't take the faults,
+  // and keep them in memory if we're allowed to (see arena.c).
+  memset(h,0,bytes);
+  mlock(h,bytes);
+  h->channels = SHARED_RING_CHANNELS;
+  h->bufferFrames = frames;
+  h->dataOffset = SHARED_RING_DATA_OFFSET;
+  h->version = SHARED_RING_VERSION;
+  // last, so a producer that opens the segment early knows to wait:
+  RS_ATOMIC_STORE(&h->magic,SHARED_RING_MAGIC);
+  return h;
+#endif
+}
+
+// unmap the segment and remove its name; the stream that played it
+// must be closed. Called only by Racket.
+void sharedRingDestroy(sharedRingHeader *h, const char *name){
+#ifndef WIN32
+  size_t bytes = sharedRingSegmentBytes(h->bufferFrames);
+  munlock(h,bytes);
+  munmap(h,bytes);
+  shm_unlink(name);
+#endif
+}
+
+// Racket can be a producer, too (mostly for testing).
+unsigned int sharedRingWriteFrames(sharedRingHeader *h, const short *frames,
+                                   unsigned int count){
+  return sharedRingWrite(h,frames,count);
+}
+
+void sharedRingFinishWriting(sharedRingHeader *h){
+  sharedRingFinish(h);
+}
+
+int sharedStreamingCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  soundStreamInfo *ssi = (soundStreamInfo *)userData;
+  sharedRingHeader *h = ssi->shared;
+  // read 'finished' first: once it's set, the count we read after it
+  // is the final one.
+  int finished = (int)RS_ATOMIC_LOAD(&h->finished);
+  int result;
+
+  ssi->lastFrameWritten = RS_ATOMIC_LOAD(&h->lastFrameWritten);
+  // running dry at the very end isn't a fault:
+  ssi->idle = finished;
+  result = streamingCallback(input,output,frameCount,timeInfo,statusFlags,userData);
+  h->faultCount = (uint32_t)ssi->faultCount;
+  h->lastOffsetRead = ssi->lastOffsetRead;
+  RS_ATOMIC_STORE(&h->lastFrameRead,(uint32_t)ssi->lastFrameRead);
+  if (finished && ssi->lastFrameWritten <= ssi->lastFrameRead) {
+    return paComplete;
+  }
+  return result;
+}
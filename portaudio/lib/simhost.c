@@ -0,0 +1,498 @@
+#include <stdlib.h>
+#include "callbacks.h"
+
+// This file is a simulated portaudio: the same entry points, with
+// "sim" in front of their names, but with no sound card behind them.
+// When the environment variable RSOUND_SIMULATED_HOST is set,
+// portaudio.rkt loads these instead of the real library (see
+// pa-entry-name there), so that the whole package can be run, hard,
+// on a machine with no audio at all; test/stress-streams.rkt does.
+
+// Each started stream gets a native thread that calls its callback
+// once a buffer, paced by the clock (or by a multiple of it; see
+// simHostConfigure), and calls its finished callback when it stops,
+// as portaudio does. The host counts what happens, so that a test
+// can see streams that were never closed, callbacks that took longer
+// than a buffer (deadline misses), and so on. A host also has a limit
+// on the number of streams open at once, as real ones do.
+
+// The host's own memory comes from malloc rather than the arena, so
+// that the arena's statistics show only the package's memory.
+
+#define SIM_DEVICES 2
+#define SIM_DEFAULT_FRAMES_PER_BUFFER 256
+#define SIM_STREAM_MAGIC 0x5354524d
+
+typedef struct simHostStats{
+  long opened;
+  long closed;
+  // open now, and the most ever open at once:
+  long open;
+  long peakOpen;
+  // opens refused because too many streams were open:
+  long refused;
+  long started;
+  long callbacks;
+  // callbacks that finished after their buffer was due:
+  long deadlineMisses;
+  long finishedCallbacks;
+  // calls with a stream that wasn't open:
+  long badStreams;
+} simHostStats;
+
+typedef struct simStream{
+  int magic;
+  PaStreamCallback *callback;
+  PaStreamFinishedCallback *finished;
+  void *userData;
+  int inputChannels;
+  int outputChannels;
+  unsigned long framesPerBuffer;
+  PaStreamInfo info;
+  // the callback thread, if the stream has been started and not
+  // stopped since:
+  rsThread thread;
+  int hasThread;
+  // nonzero while the callback thread is calling the callback:
+  int active;
+  // set to end the callback thread:
+  int stopRequested;
+  double cpuLoad;
+  short *in;
+  short *out;
+} simStream;
+
+static simHostStats simStats;
+static int simInitCount = 0;
+// 0 means no limit:
+static long simMaxStreams = 64;
+// how many times faster than real time the streams run:
+static double simSpeed = 1.0;
+
+static const PaHostApiInfo simHostApi = {
+  1, paInDevelopment, "simulated host", SIM_DEVICES, 1, 0
+};
+
+static const PaDeviceInfo simDevices[SIM_DEVICES] = {
+  {2, "simulated output", 0, 0, 2, 0.0, 0.01, 0.0, 0.1, 44100.0},
+  {2, "simulated duplex", 0, 2, 2, 0.01, 0.01, 0.1, 0.1, 44100.0}
+};
+
+static const PaHostErrorInfo simHostError = {paInDevelopment, 0, ""};
+
+typedef struct simVersionInfo{
+  int versionMajor;
+  int versionMinor;
+  int versionSubMinor;
+  const char *versionControlRevision;
+  const char *versionText;
+} simVersionInfo;
+
+static const simVersionInfo simVersion = {19, 0, 0, "", "simulated host"};
+
+// set the limit on open streams (0 for none) and the speed.
+void simHostConfigure(long maxStreams, double speed){
+  simMaxStreams = maxStreams;
+  simSpeed = (speed > 0.0) ? speed : 1.0;
+}
+
+void simHostGetStats(simHostStats *stats){
+  stats->opened = RS_ATOMIC_LOAD(&simStats.opened);
+  stats->closed = RS_ATOMIC_LOAD(&simStats.closed);
+  stats->open = RS_ATOMIC_LOAD(&simStats.open);
+  stats->peakOpen = RS_ATOMIC_LOAD(&simStats.peakOpen);
+  stats->refused = RS_ATOMIC_LOAD(&simStats.refused);
+  stats->started = RS_ATOMIC_LOAD(&simStats.started);
+  stats->callbacks = RS_ATOMIC_LOAD(&simStats.callbacks);
+  stats->deadlineMisses = RS_ATOMIC_LOAD(&simStats.deadlineMisses);
+  stats->finishedCallbacks = RS_ATOMIC_LOAD(&simStats.finishedCallbacks);
+  stats->badStreams = RS_ATOMIC_LOAD(&simStats.badStreams);
+}
+
+static simStream *checkStream(PaStream *stream){
+  simStream *s = (simStream *)stream;
+  if (s == NULL || s->magic != SIM_STREAM_MAGIC) {
+    RS_ATOMIC_ADD(&simStats.badStreams,1);
+    return NULL;
+  }
+  return s;
+}
+
+// VERSIONS, ERRORS, INITIALIZATION
+
+int simPa_GetVersion(void){
+  return 1900;
+}
+
+const char *simPa_GetVersionText(void){
+  return simVersion.versionText;
+}
+
+const simVersionInfo *simPa_GetVersionInfo(void){
+  return &simVersion;
+}
+
+const char *simPa_GetErrorText(PaError errorCode){
+  switch (errorCode) {
+  case paNoError: return "Success";
+  case paNotInitialized: return "PortAudio not initialized";
+  case paInvalidChannelCount: return "Invalid number of channels";
+  case paInvalidDevice: return "Invalid device";
+  case paInsufficientMemory: return "Insufficient memory";
+  case paDeviceUnavailable: return "Device unavailable";
+  case paBadStreamPtr: return "Invalid stream pointer";
+  case paStreamIsStopped: return "Stream is stopped";
+  case paStreamIsNotStopped: return "Stream is not stopped";
+  default: return "Simulated host error";
+  }
+}
+
+PaError simPa_Initialize(void){
+  RS_ATOMIC_ADD(&simInitCount,1);
+  return paNoError;
+}
+
+PaError simPa_Terminate(void){
+  if (RS_ATOMIC_LOAD(&simInitCount) == 0) {
+    return paNotInitialized;
+  }
+  RS_ATOMIC_ADD(&simInitCount,-1);
+  return paNoError;
+}
+
+// HOST APIS AND DEVICES
+
+PaHostApiIndex simPa_GetHostApiCount(void){
+  return RS_ATOMIC_LOAD(&simInitCount) ? 1 : paNotInitialized;
+}
+
+PaHostApiIndex simPa_GetDefaultHostApi(void){
+  return RS_ATOMIC_LOAD(&simInitCount) ? 0 : paNotInitialized;
+}
+
+const PaHostApiInfo *simPa_GetHostApiInfo(PaHostApiIndex hostApi){
+  return (hostApi == 0) ? &simHostApi : NULL;
+}
+
+PaHostApiIndex simPa_HostApiTypeIdToHostApiIndex(PaHostApiTypeId type){
+  return (type == paInDevelopment) ? 0 : paHostApiNotFound;
+}
+
+const PaHostErrorInfo *simPa_GetLastHostErrorInfo(void){
+  return &simHostError;
+}
+
+PaDeviceIndex simPa_GetDeviceCount(void){
+  return RS_ATOMIC_LOAD(&simInitCount) ? SIM_DEVICES : paNotInitialized;
+}
+
+PaDeviceIndex simPa_GetDefaultInputDevice(void){
+  return 1;
+}
+
+PaDeviceIndex simPa_GetDefaultOutputDevice(void){
+  return 0;
+}
+
+const PaDeviceInfo *simPa_GetDeviceInfo(PaDeviceIndex device){
+  return (device >= 0 && device < SIM_DEVICES) ? &simDevices[device] : NULL;
+}
+
+static PaError checkParameters(const PaStreamParameters *p, int input){
+  int most;
+  if (p == NULL) {
+    return paNoError;
+  }
+  if (p->device < 0 || p->device >= SIM_DEVICES) {
+    return paInvalidDevice;
+  }
+  most = input ? simDevices[p->device].maxInputChannels
+    : simDevices[p->device].maxOutputChannels;
+  if (p->channelCount < 1 || p->channelCount > most) {
+    return paInvalidChannelCount;
+  }
+  if (p->sampleFormat != paInt16) {
+    return paSampleFormatNotSupported;
+  }
+  return paNoError;
+}
+
+PaError simPa_IsFormatSupported(const PaStreamParameters *inputParameters,
+                                const PaStreamParameters *outputParameters,
+                                double sampleRate){
+  PaError err = checkParameters(inputParameters,1);
+  if (err != paNoError) {
+    return err;
+  }
+  return checkParameters(outputParameters,0);
+}
+
+// STREAMS
+
+PaError simPa_OpenStream(PaStream **stream,
+                         const PaStreamParameters *inputParameters,
+                         const PaStreamParameters *outputParameters,
+                         double sampleRate,
+                         unsigned long framesPerBuffer,
+                         PaStreamFlags streamFlags,
+                         PaStreamCallback *streamCallback,
+                         void *userData){
+  simStream *s;
+  long open;
+  PaError err;
+
+  if (RS_ATOMIC_LOAD(&simInitCount) == 0) {
+    return paNotInitialized;
+  }
+  err = simPa_IsFormatSupported(inputParameters,outputParameters,sampleRate);
+  if (err != paNoError) {
+    return err;
+  }
+  open = RS_ATOMIC_ADD(&simStats.open,1) + 1;
+  if (simMaxStreams > 0 && open > simMaxStreams) {
+    RS_ATOMIC_ADD(&simStats.open,-1);
+    RS_ATOMIC_ADD(&simStats.refused,1);
+    return paDeviceUnavailable;
+  }
+  s = (simStream *)calloc(1,sizeof(simStream));
+  if (s == NULL) {
+    RS_ATOMIC_ADD(&simStats.open,-1);
+    return paInsufficientMemory;
+  }
+  s->magic = SIM_STREAM_MAGIC;
+  s->callback = streamCallback;
+  s->userData = userData;
+  s->inputChannels = inputParameters ? inputParameters->channelCount : 0;
+  s->outputChannels = outputParameters ? outputParameters->channelCount : 0;
+  s->framesPerBuffer = framesPerBuffer ? framesPerBuffer : SIM_DEFAULT_FRAMES_PER_BUFFER;
+  s->info.structVersion = 1;
+  s->info.inputLatency = inputParameters ? inputParameters->suggestedLatency : 0.0;
+  s->info.outputLatency = outputParameters ? outputParameters->suggestedLatency : 0.0;
+  s->info.sampleRate = sampleRate;
+  s->in = (short *)calloc(s->framesPerBuffer * (s->inputChannels + 1), sizeof(short));
+  s->out = (short *)calloc(s->framesPerBuffer * (s->outputChannels + 1), sizeof(short));
+  if (s->in == NULL || s->out == NULL) {
+    free(s->in);
+    free(s->out);
+    free(s);
+    RS_ATOMIC_ADD(&simStats.open,-1);
+    return paInsufficientMemory;
+  }
+  RS_ATOMIC_ADD(&simStats.opened,1);
+  // a racy maximum is close enough for statistics:
+  if (open > RS_ATOMIC_LOAD(&simStats.peakOpen)) {
+    RS_ATOMIC_STORE(&simStats.peakOpen,open);
+  }
+  *stream = s;
+  return paNoError;
+}
+
+PaError simPa_OpenDefaultStream(PaStream **stream,
+                                int numInputChannels,
+                                int numOutputChannels,
+                                PaSampleFormat sampleFormat,
+                                double sampleRate,
+                                unsigned long framesPerBuffer,
+                                PaStreamCallback *streamCallback,
+                                void *userData){
+  PaStreamParameters in, out;
+  in.device = simPa_GetDefaultInputDevice();
+  in.channelCount = numInputChannels;
+  in.sampleFormat = sampleFormat;
+  in.suggestedLatency = simDevices[in.device].defaultLowInputLatency;
+  in.hostApiSpecificStreamInfo = NULL;
+  out.device = simPa_GetDefaultOutputDevice();
+  out.channelCount = numOutputChannels;
+  out.sampleFormat = sampleFormat;
+  out.suggestedLatency = simDevices[out.device].defaultLowOutputLatency;
+  out.hostApiSpecificStreamInfo = NULL;
+  return simPa_OpenStream(stream,
+                          numInputChannels > 0 ? &in : NULL,
+                          numOutputChannels > 0 ? &out : NULL,
+                          sampleRate,framesPerBuffer,paNoFlag,
+                          streamCallback,userData);
+}
+
+PaError simPa_SetStreamFinishedCallback(PaStream *stream,
+                                        PaStreamFinishedCallback *streamFinishedCallback){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->hasThread) {
+    return paStreamIsNotStopped;
+  }
+  s->finished = streamFinishedCallback;
+  return paNoError;
+}
+
+// the callback thread.
+static void runStream(void *arg){
+  simStream *s = (simStream *)arg;
+  double period = s->framesPerBuffer / (s->info.sampleRate * simSpeed);
+  double start = rsMonotonicSeconds();
+  double due, before, after;
+  unsigned long buffers = 0;
+  PaStreamCallbackTimeInfo timeInfo;
+  int result = paContinue;
+
+  while (result == paContinue && !RS_ATOMIC_LOAD(&s->stopRequested)) {
+    before = rsMonotonicSeconds();
+    timeInfo.currentTime = before;
+    timeInfo.inputBufferAdcTime = before - s->info.inputLatency;
+    timeInfo.outputBufferDacTime = before + s->info.outputLatency;
+    result = s->callback(s->in,s->out,s->framesPerBuffer,&timeInfo,0,s->userData);
+    after = rsMonotonicSeconds();
+    buffers++;
+    RS_ATOMIC_ADD(&simStats.callbacks,1);
+    s->cpuLoad = (after - before) / period;
+    // the next buffer is due at:
+    due = start + buffers * period;
+    if (after > due) {
+      RS_ATOMIC_ADD(&simStats.deadlineMisses,1);
+    } else {
+      rsSleepMillis((long)((due - after) * 1000.0));
+    }
+  }
+  RS_ATOMIC_STORE(&s->active,0);
+  if (s->finished != NULL) {
+    RS_ATOMIC_ADD(&simStats.finishedCallbacks,1);
+    s->finished(s->userData);
+  }
+}
+
+PaError simPa_StartStream(PaStream *stream){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->hasThread) {
+    return paStreamIsNotStopped;
+  }
+  if (s->callback == NULL) {
+    // a blocking stream: nothing to run.
+    s->hasThread = 0;
+    RS_ATOMIC_STORE(&s->active,1);
+    RS_ATOMIC_ADD(&simStats.started,1);
+    return paNoError;
+  }
+  RS_ATOMIC_STORE(&s->stopRequested,0);
+  RS_ATOMIC_STORE(&s->active,1);
+  if (rsThreadCreate(&s->thread,runStream,s) != 0) {
+    RS_ATOMIC_STORE(&s->active,0);
+    return paInsufficientMemory;
+  }
+  s->hasThread = 1;
+  RS_ATOMIC_ADD(&simStats.started,1);
+  return paNoError;
+}
+
+PaError simPa_StopStream(PaStream *stream){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->callback == NULL) {
+    RS_ATOMIC_STORE(&s->active,0);
+    return paNoError;
+  }
+  if (!s->hasThread) {
+    return paStreamIsStopped;
+  }
+  RS_ATOMIC_STORE(&s->stopRequested,1);
+  rsThreadJoin(s->thread);
+  s->hasThread = 0;
+  return paNoError;
+}
+
+PaError simPa_AbortStream(PaStream *stream){
+  return simPa_StopStream(stream);
+}
+
+PaError simPa_CloseStream(PaStream *stream){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->hasThread) {
+    simPa_StopStream(s);
+  }
+  s->magic = 0;
+  free(s->in);
+  free(s->out);
+  free(s);
+  RS_ATOMIC_ADD(&simStats.closed,1);
+  RS_ATOMIC_ADD(&simStats.open,-1);
+  return paNoError;
+}
+
+PaError simPa_IsStreamStopped(PaStream *stream){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  return (s->callback == NULL) ? !RS_ATOMIC_LOAD(&s->active) : !s->hasThread;
+}
+
+PaError simPa_IsStreamActive(PaStream *stream){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  return RS_ATOMIC_LOAD(&s->active);
+}
+
+const PaStreamInfo *simPa_GetStreamInfo(PaStream *stream){
+  simStream *s = checkStream(stream);
+  return s ? &s->info : NULL;
+}
+
+PaTime simPa_GetStreamTime(PaStream *stream){
+  return checkStream(stream) ? rsMonotonicSeconds() : 0.0;
+}
+
+double simPa_GetStreamCpuLoad(PaStream *stream){
+  simStream *s = checkStream(stream);
+  return s ? s->cpuLoad : 0.0;
+}
+
+// BLOCKING I/O: paced by the clock, and the input is silence.
+
+static void blockFor(simStream *s, unsigned long frames){
+  rsSleepMillis((long)(1000.0 * frames / (s->info.sampleRate * simSpeed)));
+}
+
+PaError simPa_ReadStream(PaStream *stream, void *buffer, unsigned long frames){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->callback != NULL) {
+    return paCanNotReadFromACallbackStream;
+  }
+  memset(buffer,0,frames * s->inputChannels * sizeof(short));
+  blockFor(s,frames);
+  return paNoError;
+}
+
+PaError simPa_WriteStream(PaStream *stream, const void *buffer, unsigned long frames){
+  simStream *s = checkStream(stream);
+  if (s == NULL) {
+    return paBadStreamPtr;
+  }
+  if (s->callback != NULL) {
+    return paCanNotWriteToACallbackStream;
+  }
+  blockFor(s,frames);
+  return paNoError;
+}
+
+signed long simPa_GetStreamReadAvailable(PaStream *stream){
+  simStream *s = checkStream(stream);
+  return s ? (signed long)s->framesPerBuffer : paBadStreamPtr;
+}
+
+signed long simPa_GetStreamWriteAvailable(PaStream *stream){
+  simStream *s = checkStream(stream);
+  return s ? (signed long)s->framesPerBuffer : paBadStreamPtr;
+}
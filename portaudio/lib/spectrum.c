@@ -0,0 +1,411 @@
+#include <math.h>
+#include "callbacks.h"
+
+// This file provides spectrum analyzers: a tap on a stream's sound
+// (what the streaming or copying callback delivers, or what the
+// recording callback receives) that computes its spectrum on a
+// native thread of the analyzer's own, so that a display needn't
+// copy the sound out and transform it in Racket.
+
+// The callback copies its buffer into a ring, and that's all it
+// does; it never waits. If the ring hasn't room (because the thread
+// has fallen behind), the frames are dropped and counted. The thread
+// takes the frames a hop at a time, mixes them to mono, and slides
+// them into a window of the last fftSize frames; after each hop,
+// once the window is full, it computes the magnitudes of the
+// Hann-windowed FFT of the window, and publishes them as the latest
+// spectrum. Racket only ever sees the latest one.
+
+// The magnitudes are scaled so that a full-scale sine at the center
+// of a bin comes out at 1.0.
+
+// An analyzer is shared by Racket and any number of streams, each of
+// which holds a reference (see spectrumRetain); whichever lets go
+// last frees it. It's meant to tap one stream at a time: a callback
+// that finds another in the middle of writing drops its frames.
+
+// the ring's frames are a power of two, and at least this many:
+#define SPECTRUM_MIN_RING_FRAMES 8192
+// how often the thread looks for frames, in milliseconds:
+#define SPECTRUM_POLL_MILLIS 10
+
+#define SPECTRUM_MIN_FFT 16
+#define SPECTRUM_MAX_FFT 16384
+
+#define SPECTRUM_TWO_PI 6.283185307179586
+
+// must agree with _spectrum-stats in spectrum-analyzer.rkt.
+typedef struct spectrumStats{
+  // mutated only by the callback:
+  unsigned long framesIn;
+  unsigned long droppedFrames;
+  // seconds the callbacks spent writing, in all and at most in one
+  // buffer:
+  double writeSeconds;
+  double maxWriteSeconds;
+  // mutated only by the thread:
+  unsigned long spectra;
+  double analysisSeconds;
+} spectrumStats;
+
+struct spectrumAnalyzer{
+  unsigned int fftSize;
+  unsigned int hop;
+
+  short *ring;
+  unsigned int ringFrames;
+  // frames ever put in the ring (only mutated by the callback) and
+  // taken out of it (only mutated by the thread):
+  unsigned int put;
+  unsigned int taken;
+  // set while a callback is writing:
+  int writing;
+
+  // the thread's: the last fftSize frames, mixed to mono, and how
+  // many of them are real so far; and its scratch space.
+  double *window;
+  unsigned int windowFilled;
+  double *re;
+  double *im;
+  double *scratchMagnitudes;
+
+  // shared by everyone, and never changed:
+  double *hann;
+  double *cosTable;
+  double *sinTable;
+  unsigned int *bitReverse;
+  double scale;
+
+  // the latest spectrum, under the lock; sequence counts them.
+  double *latest;
+  unsigned long sequence;
+
+  rsMutex lock;
+  rsCond cond;
+  rsThread thread;
+  int threadStarted;
+  int stopRequested;
+
+  int refs;
+  spectrumStats stats;
+};
+
+static int isPowerOfTwo(unsigned int n){
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+// the magnitudes of the windowed transform of 'samples' (fftSize of
+// them), into 'out' (fftSize / 2 + 1 of them). 're' and 'im' are
+// scratch space.
+static void analyze(spectrumAnalyzer *sa, const double *samples,
+                    double *re, double *im, double *out){
+  unsigned int n = sa->fftSize;
+  unsigned int i, j, k, size, half, step;
+  double tr, ti, wr, wi;
+
+  for (i = 0; i < n; i++) {
+    j = sa->bitReverse[i];
+    re[j] = samples[i] * sa->hann[i];
+    im[j] = 0.0;
+  }
+  // iterative radix-2:
+  for (size = 2; size <= n; size *= 2) {
+    half = size / 2;
+    step = n / size;
+    for (i = 0; i < n; i += size) {
+      for (k = 0; k < half; k++) {
+        wr = sa->cosTable[k * step];
+        wi = -sa->sinTable[k * step];
+        j = i + k + half;
+        tr = re[j] * wr - im[j] * wi;
+        ti = re[j] * wi + im[j] * wr;
+        re[j] = re[i + k] - tr;
+        im[j] = im[i + k] - ti;
+        re[i + k] += tr;
+        im[i + k] += ti;
+      }
+    }
+  }
+  for (k = 0; k <= n / 2; k++) {
+    out[k] = sqrt(re[k] * re[k] + im[k] * im[k]) * sa->scale;
+  }
+}
+
+// called by a callback with the frames it delivered or received.
+void spectrumWrite(spectrumAnalyzer *sa, const short *samples, unsigned long frames){
+  double start = rsMonotonicSeconds();
+  double elapsed;
+  unsigned int put;
+  unsigned int room;
+  unsigned int offset;
+  unsigned int toEnd;
+
+  if (!RS_ATOMIC_CAS(&sa->writing,0,1)) {
+    // another stream's callback got here first:
+    RS_ATOMIC_ADD(&sa->stats.droppedFrames,frames);
+    return;
+  }
+  put = sa->put;
+  room = sa->ringFrames - (put - RS_ATOMIC_LOAD(&sa->taken));
+  offset = put & (sa->ringFrames - 1);
+  toEnd = sa->ringFrames - offset;
+  if (frames > room) {
+    sa->stats.droppedFrames += frames;
+  } else {
+    if (frames > toEnd) {
+      memcpy(sa->ring + offset * CHANNELS,samples,FRAMES_TO_BYTES(toEnd));
+      memcpy(sa->ring,samples + toEnd * CHANNELS,FRAMES_TO_BYTES(frames - toEnd));
+    } else {
+      memcpy(sa->ring + offset * CHANNELS,samples,FRAMES_TO_BYTES(frames));
+    }
+    // the frames have to be there before the thread sees the count:
+    RS_ATOMIC_STORE(&sa->put,put + (unsigned int)frames);
+    sa->stats.framesIn += frames;
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  sa->stats.writeSeconds += elapsed;
+  sa->stats.maxWriteSeconds = MYMAX(sa->stats.maxWriteSeconds, elapsed);
+  RS_ATOMIC_STORE(&sa->writing,0);
+}
+
+// take the ring's frames a hop at a time, computing a spectrum after
+// each. Only the thread calls this.
+static void drain(spectrumAnalyzer *sa){
+  unsigned int put = RS_ATOMIC_LOAD(&sa->put);
+  unsigned int n = sa->fftSize;
+  unsigned int hop = sa->hop;
+  unsigned int i, at;
+  double start;
+
+  while (put - sa->taken >= hop) {
+    memmove(sa->window,sa->window + hop,(n - hop) * sizeof(double));
+    for (i = 0; i < hop; i++) {
+      at = ((sa->taken + i) & (sa->ringFrames - 1)) * CHANNELS;
+      sa->window[n - hop + i] = 0.5 * ((double)sa->ring[at] + (double)sa->ring[at + 1]);
+    }
+    RS_ATOMIC_STORE(&sa->taken,sa->taken + hop);
+    sa->windowFilled = MYMIN(sa->windowFilled + hop, n);
+    if (sa->windowFilled == n) {
+      start = rsMonotonicSeconds();
+      analyze(sa,sa->window,sa->re,sa->im,sa->scratchMagnitudes);
+      rsMutexLock(&sa->lock);
+      memcpy(sa->latest,sa->scratchMagnitudes,(n / 2 + 1) * sizeof(double));
+      sa->sequence += 1;
+      sa->stats.spectra += 1;
+      sa->stats.analysisSeconds += rsMonotonicSeconds() - start;
+      rsMutexUnlock(&sa->lock);
+    }
+  }
+}
+
+static void spectrumThread(void *arg){
+  spectrumAnalyzer *sa = (spectrumAnalyzer *)arg;
+  rsMutexLock(&sa->lock);
+  while (!sa->stopRequested) {
+    rsCondTimedWait(&sa->cond,&sa->lock,SPECTRUM_POLL_MILLIS);
+    rsMutexUnlock(&sa->lock);
+    drain(sa);
+    rsMutexLock(&sa->lock);
+  }
+  rsMutexUnlock(&sa->lock);
+}
+
+static void freeTables(spectrumAnalyzer *sa){
+  arenaFree(sa->ring);
+  free(sa->window);
+  free(sa->re);
+  free(sa->im);
+  free(sa->scratchMagnitudes);
+  free(sa->hann);
+  free(sa->cosTable);
+  free(sa->sinTable);
+  free(sa->bitReverse);
+  free(sa->latest);
+  free(sa);
+}
+
+// an analyzer computing fftSize-point spectra (a power of two) every
+// 'hop' frames (at most fftSize), with its thread started. It holds
+// one reference, Racket's. Returns NULL if the sizes are wrong, or
+// there's no memory or no thread. Called only by Racket.
+spectrumAnalyzer *spectrumNew(unsigned int fftSize, unsigned int hop){
+  spectrumAnalyzer *sa;
+  unsigned int ringFrames = SPECTRUM_MIN_RING_FRAMES;
+  unsigned int i, j, bits;
+  double windowSum = 0.0;
+
+  if (!isPowerOfTwo(fftSize) || fftSize < SPECTRUM_MIN_FFT || fftSize > SPECTRUM_MAX_FFT
+      || hop == 0 || hop > fftSize) {
+    return NULL;
+  }
+  while (ringFrames < 4 * fftSize) {
+    ringFrames *= 2;
+  }
+  sa = (spectrumAnalyzer *)calloc(1,sizeof(spectrumAnalyzer));
+  if (sa == NULL) {
+    return NULL;
+  }
+  sa->fftSize = fftSize;
+  sa->hop = hop;
+  sa->ringFrames = ringFrames;
+  // the callback touches the ring, so it comes from the arena:
+  sa->ring = (short *)arenaAlloc(FRAMES_TO_BYTES(ringFrames));
+  sa->window = (double *)calloc(fftSize,sizeof(double));
+  sa->re = (double *)malloc(fftSize * sizeof(double));
+  sa->im = (double *)malloc(fftSize * sizeof(double));
+  sa->scratchMagnitudes = (double *)malloc((fftSize / 2 + 1) * sizeof(double));
+  sa->hann = (double *)malloc(fftSize * sizeof(double));
+  sa->cosTable = (double *)malloc(fftSize / 2 * sizeof(double));
+  sa->sinTable = (double *)malloc(fftSize / 2 * sizeof(double));
+  sa->bitReverse = (unsigned int *)malloc(fftSize * sizeof(unsigned int));
+  sa->latest = (double *)calloc(fftSize / 2 + 1,sizeof(double));
+  if (sa->ring == NULL || sa->window == NULL || sa->re == NULL || sa->im == NULL
+      || sa->scratchMagnitudes == NULL || sa->hann == NULL || sa->cosTable == NULL
+      || sa->sinTable == NULL || sa->bitReverse == NULL || sa->latest == NULL) {
+    freeTables(sa);
+    return NULL;
+  }
+
+  for (i = 0; i < fftSize; i++) {
+    sa->hann[i] = 0.5 - 0.5 * cos(SPECTRUM_TWO_PI * i / fftSize);
+    windowSum += sa->hann[i];
+  }
+  for (i = 0; i < fftSize / 2; i++) {
+    sa->cosTable[i] = cos(SPECTRUM_TWO_PI * i / fftSize);
+    sa->sinTable[i] = sin(SPECTRUM_TWO_PI * i / fftSize);
+  }
+  for (bits = 0; (1u << bits) < fftSize; bits++) {
+  }
+  for (i = 0; i < fftSize; i++) {
+    sa->bitReverse[i] = 0;
+    for (j = 0; j < bits; j++) {
+      if (i & (1u << j)) {
+        sa->bitReverse[i] |= 1u << (bits - 1 - j);
+      }
+    }
+  }
+  // a sine's energy is split between two bins, and the window
+  // scales it by its sum:
+  sa->scale = 2.0 / (windowSum * 32768.0);
+
+  sa->refs = 1;
+  rsMutexInit(&sa->lock);
+  rsCondInit(&sa->cond);
+  if (rsThreadCreate(&sa->thread,spectrumThread,sa) != 0) {
+    rsCondDestroy(&sa->cond);
+    rsMutexDestroy(&sa->lock);
+    freeTables(sa);
+    return NULL;
+  }
+  sa->threadStarted = 1;
+  return sa;
+}
+
+// copy the latest spectrum (fftSize / 2 + 1 magnitudes) to 'out',
+// and return the number of spectra computed so far; 0 means there
+// isn't one yet, and 'out' is untouched. Called only by Racket.
+unsigned long spectrumLatest(spectrumAnalyzer *sa, double *out){
+  unsigned long sequence;
+  rsMutexLock(&sa->lock);
+  sequence = sa->sequence;
+  if (sequence > 0) {
+    memcpy(out,sa->latest,(sa->fftSize / 2 + 1) * sizeof(double));
+  }
+  rsMutexUnlock(&sa->lock);
+  return sequence;
+}
+
+void spectrumGetStats(spectrumAnalyzer *sa, spectrumStats *out){
+  rsMutexLock(&sa->lock);
+  *out = sa->stats;
+  rsMutexUnlock(&sa->lock);
+}
+
+// a stream is about to tap it; the stream's record lets go of it
+// when it's freed.
+spectrumAnalyzer *spectrumRetain(spectrumAnalyzer *sa){
+  RS_ATOMIC_ADD(&sa->refs,1);
+  return sa;
+}
+
+static void stopThread(spectrumAnalyzer *sa){
+  rsMutexLock(&sa->lock);
+  sa->stopRequested = 1;
+  rsCondBroadcast(&sa->cond);
+  rsMutexUnlock(&sa->lock);
+  if (sa->threadStarted) {
+    rsThreadJoin(sa->thread);
+    sa->threadStarted = 0;
+  }
+}
+
+// drop a reference; the last one frees it. Streams' records call
+// this when they're freed, which may be from a finished callback, so
+// the thread must have been stopped by then (see spectrumClose).
+void spectrumRelease(spectrumAnalyzer *sa){
+  if (RS_ATOMIC_ADD(&sa->refs,-1) == 1) {
+    stopThread(sa);
+    rsCondDestroy(&sa->cond);
+    rsMutexDestroy(&sa->lock);
+    freeTables(sa);
+  }
+}
+
+// stop the thread, and drop Racket's reference. Streams still
+// tapping it go on writing to the ring, harmlessly. Called only by
+// Racket.
+void spectrumClose(spectrumAnalyzer *sa){
+  stopThread(sa);
+  spectrumRelease(sa);
+}
+
+// the average seconds that spectrumWrite takes for a buffer of the
+// given size. Whenever the ring is full, this waits (untimed) for the
+// thread to drain it, so nothing is dropped.
+double spectrumWriteBenchmark(spectrumAnalyzer *sa, unsigned long bufferFrames,
+                              int iterations){
+  short *buf = (short *)arenaCalloc(FRAMES_TO_BYTES(bufferFrames));
+  double before = sa->stats.writeSeconds;
+  int i;
+  if (buf == NULL || iterations <= 0 || bufferFrames > sa->ringFrames) {
+    arenaFree(buf);
+    return -1.0;
+  }
+  for (i = 0; i < iterations; i++) {
+    while (bufferFrames > sa->ringFrames - (sa->put - RS_ATOMIC_LOAD(&sa->taken))) {
+      rsSleepMillis(1);
+    }
+    spectrumWrite(sa,buf,bufferFrames);
+  }
+  arenaFree(buf);
+  return (sa->stats.writeSeconds - before) / iterations;
+}
+
+// the average seconds one spectrum takes to compute, on this thread,
+// with scratch space of its own.
+double spectrumAnalyzeBenchmark(spectrumAnalyzer *sa, int iterations){
+  unsigned int n = sa->fftSize;
+  double *samples = (double *)malloc(n * sizeof(double));
+  double *re = (double *)malloc(n * sizeof(double));
+  double *im = (double *)malloc(n * sizeof(double));
+  double *out = (double *)malloc((n / 2 + 1) * sizeof(double));
+  double start;
+  double result = -1.0;
+  unsigned int i;
+  int k;
+  if (samples != NULL && re != NULL && im != NULL && out != NULL && iterations > 0) {
+    for (i = 0; i < n; i++) {
+      samples[i] = 10000.0 * sin(SPECTRUM_TWO_PI * 7.0 * i / n);
+    }
+    start = rsMonotonicSeconds();
+    for (k = 0; k < iterations; k++) {
+      analyze(sa,samples,re,im,out);
+    }
+    result = (rsMonotonicSeconds() - start) / iterations;
+  }
+  free(samples);
+  free(re);
+  free(im);
+  free(out);
+  return result;
+}
@@ -0,0 +1,308 @@
+#include <math.h>
+#include "callbacks.h"
+
+// This file lets several output streams, on different devices, play
+// in step: they start on the same sample, and stay together even
+// though each device's clock runs at its own slightly wrong rate.
+
+// Each stream in the group is a member, with a streaming ring of its
+// own that Racket fills as usual. Time comes from portaudio: the
+// outputBufferDacTime that each callback is handed says when the
+// first frame of the buffer will be heard, on the clock that
+// Pa_GetStreamTime uses, which is shared by the streams of one host
+// API. Racket opens and primes all of the streams, picks a start time
+// a little way in the future, and starts them; each member plays
+// silence until its buffer reaches the start time, and then starts
+// the ring on exactly the frame that lines up with it. A member whose
+// first buffer is already late skips the ring ahead by however late
+// it is, so it starts in step anyway.
+
+// After that, each member compares how far through its ring it has
+// got with how far it should have got by the time its buffer plays,
+// and adjusts the rate at which it reads the ring (by a few hundred
+// parts per million at most) to close the gap, resampling with linear
+// interpolation. That's a PI loop on the position error. The errors
+// are noisy--callbacks don't run on a precise schedule, and neither
+// do the DAC times--so they're smoothed first, and the loop is slow:
+// it settles over tens of seconds, which is fine for clocks that
+// drift by tens of parts per million.
+
+// the most members in a group:
+#define SYNC_MAX_MEMBERS 16
+// a callback works through its buffer this many frames at a time,
+// so the scratch space for the ring's frames is bounded:
+#define SYNC_CHUNK 1024
+// the largest rate adjustment, as a fraction:
+#define SYNC_MAX_ADJUST 0.0005
+// the loop's natural frequency (radians per second) and damping:
+#define SYNC_OMEGA (2.0 * 3.14159265358979323846 / 30.0)
+#define SYNC_DAMPING 0.8
+// how much of each new error goes into the smoothed one:
+#define SYNC_SMOOTHING 0.05
+
+// what each member reports; kept in the group, so that Racket can
+// read it after the member is gone.
+typedef struct syncMemberStats{
+  int started;
+  int clocked;
+  // smoothed position error, in frames; positive means ahead.
+  double error;
+  // the rate the ring is read at, relative to nominal:
+  double ratio;
+  // frames of the ring skipped because the first buffer was late:
+  unsigned long lateFrames;
+} syncMemberStats;
+
+typedef struct syncGroup{
+  // one reference for Racket, one for each member.
+  int refs;
+  double sampleRate;
+  // the stream time of the first frame; 0 until Racket sets it.
+  double startTime;
+  int members;
+  syncMemberStats stats[SYNC_MAX_MEMBERS];
+} syncGroup;
+
+typedef struct syncMember{
+  syncGroup *group;
+  int index;
+  soundStreamInfo *ssi;
+  // the position in the ring of the next frame to play, in frames
+  // since the start, and the frames of the ring on either side of it:
+  // 'held' frames, starting with the one at floor(position).
+  double position;
+  double fraction;
+  int held;
+  short hold[2 * CHANNELS];
+  // the PI loop:
+  double integral;
+  short scratch[(SYNC_CHUNK + 4) * CHANNELS];
+} syncMember;
+
+static double loopKp(double rate){
+  return 2.0 * SYNC_DAMPING * SYNC_OMEGA / rate;
+}
+
+static double loopKi(double rate){
+  return SYNC_OMEGA * SYNC_OMEGA / rate;
+}
+
+syncGroup *syncGroupNew(double sampleRate){
+  syncGroup *g = (syncGroup *)arenaCalloc(sizeof(syncGroup));
+  if (g == NULL) {
+    return NULL;
+  }
+  g->refs = 1;
+  g->sampleRate = sampleRate;
+  return g;
+}
+
+void syncGroupRelease(syncGroup *g){
+  if (RS_ATOMIC_ADD(&g->refs,-1) == 1) {
+    arenaFree(g);
+  }
+}
+
+// called by Racket after the streams are primed, and before they're
+// started (so starting them publishes it to the callbacks).
+void syncGroupSetStart(syncGroup *g, double startTime){
+  g->startTime = startTime;
+}
+
+// the member plays the given stream info's ring, and frees it when
+// the member is freed. Returns NULL if the group is full.
+syncMember *syncMemberNew(syncGroup *g, soundStreamInfo *ssi){
+  syncMember *m;
+  if (g->members >= SYNC_MAX_MEMBERS) {
+    return NULL;
+  }
+  m = (syncMember *)arenaCalloc(sizeof(syncMember));
+  if (m == NULL) {
+    return NULL;
+  }
+  RS_ATOMIC_ADD(&g->refs,1);
+  m->group = g;
+  m->index = g->members++;
+  m->ssi = ssi;
+  g->stats[m->index].ratio = 1.0;
+  return m;
+}
+
+// the stream-finished callback for a member's stream. As with
+// streamingInfoFinished, Racket frees the member once it sees that
+// the stream is all done.
+void syncMemberFinished(syncMember *m){
+  streamingInfoFinished(m->ssi);
+}
+
+void syncMemberFree(syncMember *m){
+  freeStreamingInfo(m->ssi);
+  syncGroupRelease(m->group);
+  arenaFree(m);
+}
+
+double syncGroupStat(syncGroup *g, int member, int which){
+  syncMemberStats *s = &g->stats[member];
+  switch (which) {
+  case 0: return (double)s->started;
+  case 1: return (double)s->clocked;
+  case 2: return s->error;
+  case 3: return s->ratio;
+  default: return (double)s->lateFrames;
+  }
+}
+
+int syncGroupMembers(syncGroup *g){
+  return g->members;
+}
+
+// the spread of the members' errors, in frames: how far apart the
+// furthest-apart members are.
+double syncGroupSkew(syncGroup *g){
+  double lo = 0.0, hi = 0.0;
+  int i, any = 0;
+  for (i = 0; i < g->members; i++) {
+    if (g->stats[i].started && g->stats[i].clocked) {
+      if (!any || g->stats[i].error < lo) {
+        lo = g->stats[i].error;
+      }
+      if (!any || g->stats[i].error > hi) {
+        hi = g->stats[i].error;
+      }
+      any = 1;
+    }
+  }
+  return hi - lo;
+}
+
+// take 'frames' frames from the ring (running the stream's EQ, and
+// counting faults, just as the streaming callback does).
+static void pullFrames(syncMember *m, short *out, unsigned long frames,
+                       const PaStreamCallbackTimeInfo *timeInfo){
+  if (frames > 0) {
+    streamingCallback(NULL,out,frames,timeInfo,0,m->ssi);
+  }
+}
+
+// throw away 'frames' frames of the ring.
+static void skipFrames(syncMember *m, unsigned long frames,
+                       const PaStreamCallbackTimeInfo *timeInfo){
+  unsigned long n;
+  while (frames > 0) {
+    n = MYMIN(frames, SYNC_CHUNK);
+    pullFrames(m,m->scratch,n,timeInfo);
+    frames -= n;
+  }
+}
+
+// play 'frames' frames (at most SYNC_CHUNK), reading the ring at the
+// given ratio.
+static void resample(syncMember *m, short *out, unsigned long frames, double ratio,
+                     const PaStreamCallbackTimeInfo *timeInfo){
+  short *s = m->scratch;
+  double end = m->fraction + (double)frames * ratio;
+  // the ring frames needed: the last output frame interpolates
+  // between s[lastIndex] and s[lastIndex+1], and we have to consume
+  // everything up to floor(end).
+  unsigned long lastIndex = (unsigned long)(m->fraction + (double)(frames - 1) * ratio);
+  unsigned long upTo = MYMAX(lastIndex + 1, (unsigned long)end);
+  unsigned long k, i;
+  double p, f;
+  int ch;
+
+  memcpy(s,m->hold,FRAMES_TO_BYTES(m->held));
+  pullFrames(m,s + m->held * CHANNELS,upTo + 1 - m->held,timeInfo);
+  for (k = 0; k < frames; k++) {
+    p = m->fraction + (double)k * ratio;
+    i = (unsigned long)p;
+    f = p - (double)i;
+    for (ch = 0; ch < CHANNELS; ch++) {
+      out[k * CHANNELS + ch] =
+        rsToSample(s[i * CHANNELS + ch]
+                   + f * (s[(i + 1) * CHANNELS + ch] - s[i * CHANNELS + ch]));
+    }
+  }
+  // keep the frames from floor(end) on for next time:
+  i = (unsigned long)end;
+  m->held = (int)(upTo + 1 - i);
+  memcpy(m->hold,s + i * CHANNELS,FRAMES_TO_BYTES(m->held));
+  m->fraction = end - (double)i;
+  m->position += (double)frames * ratio;
+}
+
+int syncCallback(
+    const void *input, void *output,
+    unsigned long frameCount,
+    const PaStreamCallbackTimeInfo* timeInfo,
+    PaStreamCallbackFlags statusFlags,
+    void *userData ) {
+
+  syncMember *m = (syncMember *)userData;
+  syncGroup *g = m->group;
+  syncMemberStats *st = &g->stats[m->index];
+  short *out = (short *)output;
+  double rate = g->sampleRate;
+  double startTime = g->startTime;
+  double dac = timeInfo ? timeInfo->outputBufferDacTime : 0.0;
+  double offset, error, dt, ratio;
+  unsigned long lead, n;
+
+  if (!st->started) {
+    if (dac == 0.0 || startTime == 0.0) {
+      // no clock to go by: just start.
+      st->clocked = 0;
+      lead = 0;
+    } else {
+      st->clocked = 1;
+      offset = (startTime - dac) * rate;
+      if (offset >= (double)frameCount) {
+        // not yet.
+        memset(out,0,FRAMES_TO_BYTES(frameCount));
+        return paContinue;
+      }
+      if (offset < 0.0) {
+        // late: catch up with the others.
+        st->lateFrames = (unsigned long)floor(-offset + 0.5);
+        skipFrames(m,st->lateFrames,timeInfo);
+        m->position = (double)st->lateFrames;
+        lead = 0;
+      } else {
+        lead = (unsigned long)floor(offset + 0.5);
+        lead = MYMIN(lead, frameCount);
+      }
+    }
+    memset(out,0,FRAMES_TO_BYTES(lead));
+    out += lead * CHANNELS;
+    frameCount -= lead;
+    dac += (double)lead / rate;
+    st->started = 1;
+  }
+
+  // how far ahead of where we should be are we?
+  if (st->clocked) {
+    error = m->position - (dac - startTime) * rate;
+    st->error += SYNC_SMOOTHING * (error - st->error);
+    dt = (double)frameCount / rate;
+    m->integral += st->error * dt;
+    ratio = 1.0 - loopKp(rate) * st->error - loopKi(rate) * m->integral;
+    if (ratio > 1.0 + SYNC_MAX_ADJUST) {
+      ratio = 1.0 + SYNC_MAX_ADJUST;
+      // don't wind up the integral while we're pinned:
+      m->integral -= st->error * dt;
+    } else if (ratio < 1.0 - SYNC_MAX_ADJUST) {
+      ratio = 1.0 - SYNC_MAX_ADJUST;
+      m->integral -= st->error * dt;
+    }
+  } else {
+    ratio = 1.0;
+  }
+  st->ratio = ratio;
+
+  while (frameCount > 0) {
+    n = MYMIN(frameCount, SYNC_CHUNK);
+    resample(m,out,n,ratio,timeInfo);
+    out += n * CHANNELS;
+    frameCount -= n;
+  }
+  return paContinue;
+}
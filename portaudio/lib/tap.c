@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include "callbacks.h"
+
+// This file provides output taps: a record of exactly what the
+// streaming callback handed to portaudio, buffer by buffer, written
+// to a file so that it can be compared with what should have been
+// played. Each record is a tapRecordHeader followed by the buffer's
+// samples, as delivered (after the EQ, with any underrun's silence
+// in place). The header says where in the stream the buffer was,
+// how many of its frames were silence because the ring ran dry,
+// portaudio's status flags, and the timestamps.
+
+// The callback copies each record into a ring, and a native thread
+// of the tap's own copies the ring to the file. The callback never
+// waits: if the ring hasn't room for a record (because the disk is
+// slow), the record is dropped and counted, and the next record that
+// makes it says how many went missing. So the cost to the callback
+// is at most one copy of its buffer, and it times itself, so that
+// the cost can be reported.
+
+// the ring's bytes are a power of two, so that the byte counts can
+// wrap around.
+#define TAP_MIN_RING_BYTES 65536
+// how often the thread looks for records, in milliseconds:
+#define TAP_DRAIN_MILLIS 20
+
+#define TAP_RECORD_MAGIC 0x52504154u
+
+// must agree with read-output-tap in output-tap.rkt.
+typedef struct tapRecordHeader{
+  unsigned int magic;
+  unsigned int frames;
+  // the stream's frame count at the start of the buffer:
+  unsigned int position;
+  unsigned int statusFlags;
+  // frames at the end of the buffer that were silence because the
+  // ring had run dry:
+  unsigned int underrunFrames;
+  // the stream's fault count, after this buffer:
+  unsigned int faultCount;
+  // records dropped so far, before this one:
+  unsigned int dropped;
+  unsigned int reserved;
+  double currentTime;
+  double outputBufferDacTime;
+} tapRecordHeader;
+
+typedef struct outputTapStats{
+  unsigned long records;
+  unsigned long dropped;
+  unsigned long bytesWritten;
+  // seconds the callback spent tapping, in all and at most in one
+  // buffer:
+  double tapSeconds;
+  double maxTapSeconds;
+  // nonzero if the file couldn't be written:
+  int writeError;
+} outputTapStats;
+
+typedef struct outputTap{
+  char *ring;
+  unsigned long ringBytes;
+  // bytes ever put in the ring (only mutated by the callback) and
+  // taken out of it (only mutated by the thread):
+  unsigned long put;
+  unsigned long taken;
+  FILE *file;
+
+  rsMutex lock;
+  rsCond cond;
+  rsThread thread;
+  int threadStarted;
+  int stopRequested;
+
+  // only mutated by the callback, except bytesWritten and
+  // writeError, which only the thread touches.
+  outputTapStats stats;
+} outputTap;
+
+static void ringCopyIn(outputTap *t, unsigned long at, const void *src, unsigned long bytes){
+  unsigned long offset = at & (t->ringBytes - 1);
+  unsigned long toEnd = t->ringBytes - offset;
+  if (bytes > toEnd) {
+    memcpy(t->ring + offset,src,toEnd);
+    memcpy(t->ring,(const char *)src + toEnd,bytes - toEnd);
+  } else {
+    memcpy(t->ring + offset,src,bytes);
+  }
+}
+
+// called by the streaming callback, after it has filled 'output'.
+void tapWrite(outputTap *t, const void *output, unsigned long frames,
+              unsigned int position, PaStreamCallbackFlags statusFlags,
+              unsigned int underrunFrames, int faultCount,
+              const PaStreamCallbackTimeInfo *timeInfo){
+  double start = rsMonotonicSeconds();
+  double elapsed;
+  unsigned long taken = RS_ATOMIC_LOAD(&t->taken);
+  unsigned long bytes = sizeof(tapRecordHeader) + FRAMES_TO_BYTES(frames);
+  tapRecordHeader h;
+
+  if (bytes > t->ringBytes - (t->put - taken)) {
+    t->stats.dropped += 1;
+  } else {
+    h.magic = TAP_RECORD_MAGIC;
+    h.frames = (unsigned int)frames;
+    h.position = position;
+    h.statusFlags = (unsigned int)statusFlags;
+    h.underrunFrames = underrunFrames;
+    h.faultCount = (unsigned int)faultCount;
+    h.dropped = (unsigned int)t->stats.dropped;
+    h.reserved = 0;
+    h.currentTime = timeInfo ? timeInfo->currentTime : 0.0;
+    h.outputBufferDacTime = timeInfo ? timeInfo->outputBufferDacTime : 0.0;
+    ringCopyIn(t,t->put,&h,sizeof(h));
+    ringCopyIn(t,t->put + sizeof(h),output,FRAMES_TO_BYTES(frames));
+    // the bytes have to be there before the thread sees the count:
+    RS_ATOMIC_STORE(&t->put,t->put + bytes);
+    t->stats.records += 1;
+  }
+  elapsed = rsMonotonicSeconds() - start;
+  t->stats.tapSeconds += elapsed;
+  t->stats.maxTapSeconds = MYMAX(t->stats.maxTapSeconds, elapsed);
+}
+
+// copy everything in the ring to the file.
+static void drain(outputTap *t){
+  unsigned long put = RS_ATOMIC_LOAD(&t->put);
+  unsigned long bytes = put - t->taken;
+  unsigned long offset = t->taken & (t->ringBytes - 1);
+  unsigned long toEnd = t->ringBytes - offset;
+  unsigned long first = MYMIN(bytes, toEnd);
+  size_t done;
+
+  if (bytes == 0) {
+    return;
+  }
+  if (!t->stats.writeError) {
+    done = fwrite(t->ring + offset,1,first,t->file);
+    if (done == first && bytes > first) {
+      done += fwrite(t->ring,1,bytes - first,t->file);
+    }
+    t->stats.bytesWritten += done;
+    if (done < bytes) {
+      t->stats.writeError = 1;
+    }
+  }
+  // a file that can't be written still has to be drained, or the
+  // callback would drop everything from here on; the count of
+  // bytes written says where the file stops.
+  RS_ATOMIC_STORE(&t->taken,put);
+}
+
+static void tapThread(void *arg){
+  outputTap *t = (outputTap *)arg;
+  rsMutexLock(&t->lock);
+  while (!t->stopRequested) {
+    rsCondTimedWait(&t->cond,&t->lock,TAP_DRAIN_MILLIS);
+    rsMutexUnlock(&t->lock);
+    drain(t);
+    rsMutexLock(&t->lock);
+  }
+  rsMutexUnlock(&t->lock);
+  drain(t);
+  if (fflush(t->file) != 0) {
+    t->stats.writeError = 1;
+  }
+}
+
+// open the file (truncating it) and start the thread. The ring
+// holds at least 'ringBytes' bytes. Returns NULL if the file
+// can't be opened or the thread can't be started. Called only by
+// Racket.
+outputTap *tapOpen(const char *path, unsigned long ringBytes){
+  outputTap *t;
+  unsigned long bytes = TAP_MIN_RING_BYTES;
+
+  while (bytes < ringBytes) {
+    bytes *= 2;
+  }
+  t = (outputTap *)calloc(1,sizeof(outputTap));
+  if (t == NULL) {
+    return NULL;
+  }
+  // the callback touches the ring, so it comes from the arena:
+  t->ring = (char *)arenaAlloc(bytes);
+  t->ringBytes = bytes;
+  t->file = fopen(path,"wb");
+  if (t->ring == NULL || t->file == NULL) {
+    if (t->file != NULL) {
+      fclose(t->file);
+    }
+    arenaFree(t->ring);
+    free(t);
+    return NULL;
+  }
+  rsMutexInit(&t->lock);
+  rsCondInit(&t->cond);
+  if (rsThreadCreate(&t->thread,tapThread,t) != 0) {
+    rsCondDestroy(&t->cond);
+    rsMutexDestroy(&t->lock);
+    fclose(t->file);
+    arenaFree(t->ring);
+    free(t);
+    return NULL;
+  }
+  t->threadStarted = 1;
+  return t;
+}
+
+void tapGetStats(outputTap *t, outputTapStats *out){
+  *out = t->stats;
+}
+
+// write out whatever's left, close the file, and free everything.
+// The stream being tapped must be done with the tap (i.e., its
+// info must have been freed). Returns 0 if the whole record made
+// it to the file. Called only by Racket.
+int tapClose(outputTap *t){
+  int ok;
+  rsMutexLock(&t->lock);
+  t->stopRequested = 1;
+  rsCondBroadcast(&t->cond);
+  rsMutexUnlock(&t->lock);
+  if (t->threadStarted) {
+    rsThreadJoin(t->thread);
+  }
+  ok = !t->stats.writeError;
+  if (fclose(t->file) != 0) {
+    ok = 0;
+  }
+  rsCondDestroy(&t->cond);
+  rsMutexDestroy(&t->lock);
+  arenaFree(t->ring);
+  free(t);
+  return ok ? 0 : 1;
+}
+
+// the average seconds that tapWrite takes for a buffer of the
+// given size. Whenever the ring is full, this waits (untimed) for the
+// thread to drain it, so every record is written.
+double tapWriteBenchmark(outputTap *t, unsigned long bufferFrames, int iterations){
+  short *buf = (short *)arenaCalloc(FRAMES_TO_BYTES(bufferFrames));
+  unsigned long bytes = sizeof(tapRecordHeader) + FRAMES_TO_BYTES(bufferFrames);
+  double before = t->stats.tapSeconds;
+  int i;
+  if (buf == NULL || iterations <= 0 || bytes > t->ringBytes) {
+    arenaFree(buf);
+    return -1.0;
+  }
+  for (i = 0; i < iterations; i++) {
+    while (bytes > t->ringBytes - (t->put - RS_ATOMIC_LOAD(&t->taken))) {
+      rsSleepMillis(1);
+    }
+    tapWrite(t,buf,bufferFrames,(unsigned int)(i * bufferFrames),0,0,0,NULL);
+  }
+  arenaFree(buf);
+  return (t->stats.tapSeconds - before) / iterations;
+}
@@ -0,0 +1,148 @@
+#include "callbacks.h"
+
+// This file lets the copying callback play a sound at a rate other
+// than the one it was recorded at, so that one stored sound can be
+// played at many pitches without rendering a resampled copy.
+
+// The rate is one of the sound's controls (see playbackControl in
+// callbacks.h). Racket sets a new rate with a glide length, and the
+// callback moves the rate linearly to the new one over that many
+// frames, so changes don't click. The playback position is curSample
+// plus a fraction; each output frame is interpolated from the frames
+// around it, either linearly or with a four-point (Catmull-Rom)
+// cubic. Frames before the start or past the end of the sound count
+// as silence. If the sound loops (see loop.c), the interpolation
+// reads across the seam, crossfade and all.
+
+// When the rate is 1 and the position is a whole frame, the copying
+// callback doesn't come here at all, and just copies.
+
+// called only by Racket.
+void playbackControlSetRate(playbackControl *pc, double rate,
+                            unsigned long glideFrames, int interpolation){
+  unsigned int gen = pc->rateGeneration;
+  RS_ATOMIC_STORE(&pc->rateGeneration,gen+1);
+  RS_FENCE();
+  pc->pendingRate = rate;
+  pc->pendingRateFrames = glideFrames;
+  pc->pendingInterpolation = interpolation;
+  RS_ATOMIC_STORE(&pc->rateGeneration,gen+2);
+}
+
+// the rate the callback last played at.
+double playbackControlRate(playbackControl *pc){
+  return pc->rate;
+}
+
+// pick up a new rate from Racket, if there is one.
+static void pollRate(playbackControl *pc){
+  unsigned int before = RS_ATOMIC_LOAD(&pc->rateGeneration);
+  double rate;
+  unsigned long glideFrames;
+  int interpolation;
+  if (before == pc->seenRateGeneration || (before & 1)) {
+    return;
+  }
+  rate = pc->pendingRate;
+  glideFrames = pc->pendingRateFrames;
+  interpolation = pc->pendingInterpolation;
+  RS_FENCE();
+  if (RS_ATOMIC_LOAD(&pc->rateGeneration) != before) {
+    return;
+  }
+  pc->seenRateGeneration = before;
+  pc->interpolation = interpolation;
+  pc->rateFrom = pc->rate;
+  pc->rateTarget = rate;
+  pc->rateGlidePos = 0;
+  pc->rateGlideFrames = glideFrames;
+  if (glideFrames == 0) {
+    pc->rate = rate;
+  }
+}
+
+int varispeedActive(soundCopyingInfo *ri){
+  playbackControl *pc = ri->control;
+  pollRate(pc);
+  return !(pc->rate == 1.0
+           && pc->rateGlidePos >= pc->rateGlideFrames
+           && ri->fraction == 0.0);
+}
+
+// one sample of the sound, or silence off either end.
+static double sampleAt(soundCopyingInfo *ri, long frame, int channel,
+                       long soundFrames){
+  if (frame < 0 || soundFrames <= frame) {
+    return 0.0;
+  }
+  return soundSampleAt(ri,(unsigned long)frame,channel);
+}
+
+unsigned long varispeedRender(soundCopyingInfo *ri, short *output, unsigned long frames){
+  playbackControl *pc = ri->control;
+  long soundFrames = (long)(ri->numSamples / CHANNELS);
+  long frame;
+  unsigned long k;
+  unsigned long whole;
+  int ch;
+  double f, p0, p1, p2, p3;
+  const short *s;
+
+  for (k = 0; k < frames; k++) {
+    frame = (long)(ri->curSample / CHANNELS);
+    if (soundFrames <= frame) {
+      break;
+    }
+    f = ri->fraction;
+    for (ch = 0; ch < CHANNELS; ch++) {
+      if (frame < (long)ri->loopEnd) {
+        // the neighbors might be on the other side of the loop
+        p0 = loopSampleAt(ri,frame-1,ch);
+        p1 = loopSampleAt(ri,frame,ch);
+        p2 = loopSampleAt(ri,frame+1,ch);
+        p3 = loopSampleAt(ri,frame+2,ch);
+      } else if (1 <= frame && frame + 2 < soundFrames && !ri->packed) {
+        // the usual case: no need to check the ends
+        s = ri->sound + frame * CHANNELS + ch;
+        p0 = s[-CHANNELS];
+        p1 = s[0];
+        p2 = s[CHANNELS];
+        p3 = s[2*CHANNELS];
+      } else {
+        p0 = sampleAt(ri,frame-1,ch,soundFrames);
+        p1 = sampleAt(ri,frame,ch,soundFrames);
+        p2 = sampleAt(ri,frame+1,ch,soundFrames);
+        p3 = sampleAt(ri,frame+2,ch,soundFrames);
+      }
+      if (pc->interpolation == INTERPOLATE_CUBIC) {
+        output[k * CHANNELS + ch] =
+          rsToSample(p1 + 0.5 * f * (p2 - p0
+                                   + f * (2.0*p0 - 5.0*p1 + 4.0*p2 - p3
+                                          + f * (3.0*(p1 - p2) + p3 - p0))));
+      } else {
+        output[k * CHANNELS + ch] = rsToSample(p1 + f * (p2 - p1));
+      }
+    }
+    // move the rate along its glide, then the position along
+    if (pc->rateGlidePos < pc->rateGlideFrames) {
+      pc->rateGlidePos++;
+      if (pc->rateGlidePos == pc->rateGlideFrames) {
+        pc->rate = pc->rateTarget;
+      } else {
+        pc->rate = pc->rateFrom + (pc->rateTarget - pc->rateFrom)
+          * ((double)pc->rateGlidePos / (double)pc->rateGlideFrames);
+      }
+    }
+    ri->fraction += pc->rate;
+    whole = (unsigned long)ri->fraction;
+    ri->fraction -= (double)whole;
+    if (ri->loopEnd != 0) {
+      loopAdvance(ri,whole);
+    } else if ((unsigned long)(soundFrames - frame) <= whole) {
+      ri->curSample = ri->numSamples;
+    } else {
+      ri->curSample += whole * CHANNELS;
+    }
+  }
+  return k;
+}
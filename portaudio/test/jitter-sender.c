@@ -0,0 +1,139 @@
+// A tiny sender for a jitter buffer (see lib/jitter-packet.h): it
+// sends packets of sound to a UDP port on the loopback interface,
+// and finishes.
+//
+//   jitter-sender PORT FRAMES PACKET-FRAMES [DROP-EVERY [SWAP-EVERY [RATE]]]
+//
+// The sound is a ramp that the tests can check: frame i is
+// (i mod 10000) on the left, and its negation on the right. With
+// DROP-EVERY n > 0, every n'th packet isn't sent at all; with
+// SWAP-EVERY n > 0, every n'th packet is sent after the one that
+// follows it. With RATE, packets are paced as if played at that many
+// frames per second; without it, they're sent as fast as they can be.
+//
+// Build it with something like
+//
+//   cc -I../lib -o jitter-sender jitter-sender.c
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "jitter-packet.h"
+
+static int fd;
+static struct sockaddr_in addr;
+
+static void makePacket(char *buf, unsigned long start, unsigned long frames){
+  jitterPacketHeader *h = (jitterPacketHeader *)buf;
+  short *samples = (short *)(h + 1);
+  unsigned long i;
+  jitterPacketInit(h,(uint32_t)start,(uint32_t)frames);
+  for (i = 0; i < frames; i++) {
+    samples[2*i] = (short)((start + i) % 10000);
+    samples[2*i+1] = (short)-samples[2*i];
+  }
+}
+
+static int sendPacket(const char *buf){
+  const jitterPacketHeader *h = (const jitterPacketHeader *)buf;
+  size_t bytes = jitterPacketBytes(h->frames);
+  if (sendto(fd,buf,bytes,0,(struct sockaddr *)&addr,sizeof(addr)) != (ssize_t)bytes) {
+    perror("sendto");
+    return -1;
+  }
+  return 0;
+}
+
+static void pace(double rate, unsigned long frames){
+  struct timespec ts;
+  double secs;
+  if (rate <= 0.0) {
+    return;
+  }
+  secs = (double)frames / rate;
+  ts.tv_sec = (time_t)secs;
+  ts.tv_nsec = (long)((secs - (double)ts.tv_sec) * 1e9);
+  nanosleep(&ts,NULL);
+}
+
+int main(int argc, char **argv){
+  unsigned long frames, packetFrames, dropEvery = 0, swapEvery = 0;
+  unsigned long start, n, packet = 0;
+  double rate = 0.0;
+  char *buf, *held;
+  int holding = 0;
+
+  if (argc < 4) {
+    fprintf(stderr,"usage: %s PORT FRAMES PACKET-FRAMES [DROP-EVERY [SWAP-EVERY [RATE]]]\n",
+            argv[0]);
+    return 2;
+  }
+  frames = strtoul(argv[2],NULL,10);
+  packetFrames = strtoul(argv[3],NULL,10);
+  if (argc > 4) {
+    dropEvery = strtoul(argv[4],NULL,10);
+  }
+  if (argc > 5) {
+    swapEvery = strtoul(argv[5],NULL,10);
+  }
+  if (argc > 6) {
+    rate = atof(argv[6]);
+  }
+  if (packetFrames == 0 || packetFrames > JITTER_PACKET_MAX_FRAMES) {
+    fprintf(stderr,"packets must hold 1 to %d frames\n",JITTER_PACKET_MAX_FRAMES);
+    return 2;
+  }
+
+  fd = socket(AF_INET,SOCK_DGRAM,0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)atoi(argv[1]));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  buf = (char *)malloc(jitterPacketBytes((uint32_t)packetFrames));
+  held = (char *)malloc(jitterPacketBytes((uint32_t)packetFrames));
+  if (buf == NULL || held == NULL) {
+    return 1;
+  }
+
+  for (start = 0; start < frames; start += n) {
+    n = frames - start;
+    if (n > packetFrames) {
+      n = packetFrames;
+    }
+    packet++;
+    pace(rate,n);
+    if (dropEvery > 0 && packet % dropEvery == 0) {
+      continue;
+    }
+    if (swapEvery > 0 && packet % swapEvery == 0 && start + n < frames) {
+      // send it after the next one:
+      makePacket(held,start,n);
+      holding = 1;
+      continue;
+    }
+    makePacket(buf,start,n);
+    if (sendPacket(buf) != 0) {
+      return 1;
+    }
+    if (holding) {
+      holding = 0;
+      if (sendPacket(held) != 0) {
+        return 1;
+      }
+    }
+  }
+  if (holding && sendPacket(held) != 0) {
+    return 1;
+  }
+  close(fd);
+  free(buf);
+  free(held);
+  return 0;
+}
@@ -0,0 +1,82 @@
+// A tiny producer for a shared ring (see lib/shared-ring.h): it opens
+// the ring that Racket made, writes sound into it, and finishes.
+//
+//   shared-ring-producer NAME FRAMES [PITCH]
+//
+// With a pitch, it writes FRAMES frames of a sine at that pitch, at
+// whatever rate the ring is being played at. Without one, it writes a
+// ramp that the tests can check: frame i is (i mod 10000) on the
+// left, and its negation on the right.
+//
+// Build it with something like
+//
+//   cc -I../lib -o shared-ring-producer shared-ring-producer.c -lm -lrt
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shared-ring.h"
+
+#define CHUNK 256
+
+int main(int argc, char **argv){
+  sharedRingHeader *h;
+  struct stat st;
+  short chunk[CHUNK * SHARED_RING_CHANNELS];
+  unsigned long frames, done = 0, i, n, written;
+  double pitch = 0.0, rate;
+  int fd;
+
+  if (argc < 3) {
+    fprintf(stderr,"usage: %s NAME FRAMES [PITCH]\n",argv[0]);
+    return 2;
+  }
+  frames = strtoul(argv[2],NULL,10);
+  if (argc > 3) {
+    pitch = atof(argv[3]);
+  }
+
+  fd = shm_open(argv[1],O_RDWR,0);
+  if (fd < 0 || fstat(fd,&st) != 0) {
+    perror("shm_open");
+    return 1;
+  }
+  h = (sharedRingHeader *)mmap(NULL,(size_t)st.st_size,PROT_READ | PROT_WRITE,
+                               MAP_SHARED,fd,0);
+  close(fd);
+  if (h == MAP_FAILED || !sharedRingValid(h)) {
+    fprintf(stderr,"%s isn't a shared ring\n",argv[1]);
+    return 1;
+  }
+
+  while (done < frames) {
+    n = frames - done;
+    if (n > CHUNK) {
+      n = CHUNK;
+    }
+    rate = h->sampleRate ? h->sampleRate : 44100.0;
+    for (i = 0; i < n; i++) {
+      if (pitch > 0.0) {
+        chunk[2*i] = (short)(6000.0 * sin(2.0 * M_PI * pitch * (double)(done + i) / rate));
+      } else {
+        chunk[2*i] = (short)((done + i) % 10000);
+      }
+      chunk[2*i+1] = (short)-chunk[2*i];
+    }
+    // write the chunk, waiting for room as we go:
+    for (i = 0; i < n; i += written) {
+      written = sharedRingWrite(h,chunk + 2*i,(uint32_t)(n - i));
+      if (written == 0) {
+        usleep(2000);
+      }
+    }
+    done += n;
+  }
+  sharedRingFinish(h);
+  munmap(h,(size_t)st.st_size);
+  return 0;
+}